@@ -1,138 +1,290 @@
 #include "bencode.h"
-#include <iostream>
-#include <iomanip>
-#include <string>
-#include <vector>
 #include <openssl/sha.h>
-#include <fstream>
-#include <variant>
-#include <list>
-#include <map>
-#include <sstream>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 namespace Bencode {
 
-BNode::BNode(const Bvalue& value) : value(value) {}
+namespace {
+constexpr size_t ARENA_BLOCK_SIZE = 64 << 10;
+constexpr size_t MAX_DEPTH = 512;
 
-char BencodeParser::peek() const {
-    return data[pos];
+[[noreturn]] void Fail(const std::string& message, size_t pos) {
+    throw std::invalid_argument("<Bencode> " + message + " at position " + std::to_string(pos));
 }
 
-char BencodeParser::get() {
-    return data[pos++];
+void CheckType(bool matches, const char* expected) {
+    if (!matches) {
+        throw std::invalid_argument(std::string("<Bencode> expected ") + expected);
+    }
 }
-
-std::shared_ptr<BNode> BencodeParser::parseValue() {
-    char c = peek();
-    if (c == 'i') return parseInt();
-    else if (c == 'l') return parseList();
-    else if (c == 'd') return parseMap();
-    else if ('0' <= c && c <= '9') return parseString();
-    throw 3;
 }
 
-std::shared_ptr<BNode> BencodeParser::parseInt() {
-    pos++;
-    int end = data.find('e', pos);
-    Bvalue val = (Bint)std::stoll(data.substr(pos, end - pos));
-    pos = end + 1;
-    return std::make_shared<BNode>(val);
+bool Node::IsInt() const {
+    return type == Type::Int;
 }
 
-std::shared_ptr<BNode> BencodeParser::parseString() {
-    int endLen = data.find(':', pos);
-    int len = std::stoi(data.substr(pos, endLen - pos));
-    Bvalue val = (Bstring)data.substr(endLen + 1, len);
-    pos = endLen + 1 + len;
-    return std::make_shared<BNode>(val);
+bool Node::IsString() const {
+    return type == Type::String;
 }
 
-std::shared_ptr<BNode> BencodeParser::parseList() {
-    pos++;
-    Blist list;
-    while (peek() != 'e') {
-        list.push_back(parseValue());
-    }
-    pos++;
-    return std::make_shared<BNode>((Bvalue)list);
+bool Node::IsList() const {
+    return type == Type::List;
 }
 
-std::shared_ptr<BNode> BencodeParser::parseMap() {
-    pos++;
-    Bmap map;
-    while (peek() != 'e') {
-        std::string key = std::get<std::string>(parseString()->value);
-        std::shared_ptr<BNode> value = parseValue();
-        map[key] = value;
-    }
-    pos++;
-    return std::make_shared<BNode>((Bvalue)map);
+bool Node::IsDict() const {
+    return type == Type::Dict;
 }
 
-BencodeParser::BencodeParser(const std::string& data_) : data(data_), pos(0) {}
+int64_t Node::AsInt() const {
+    CheckType(IsInt(), "integer");
+    return integer;
+}
 
-std::shared_ptr<BNode> BencodeParser::parse() {
-    return parseValue();
+std::string_view Node::AsString() const {
+    CheckType(IsString(), "string");
+    return string;
 }
 
-BencodeEncoder::BencodeEncoder(std::shared_ptr<BNode> data_) : data(data_) {}
+const Node* Node::begin() const {
+    CheckType(IsList(), "list");
+    return items;
+}
 
-std::string BencodeEncoder::encode() {
-    return encodeValue(data);
+const Node* Node::end() const {
+    CheckType(IsList(), "list");
+    return items + size;
 }
 
-std::string BencodeEncoder::encodeValue(const std::shared_ptr<BNode> data) const {
-    if (std::holds_alternative<Bint>(data->value)) {
-        return encodeInt(std::get<Bint>(data->value));
-    } else if (std::holds_alternative<Bstring>(data->value)) {
-        return encodeString(std::get<Bstring>(data->value));
-    } else if (std::holds_alternative<Blist>(data->value)) {
-        return encodeList(std::get<Blist>(data->value));
-    } else if (std::holds_alternative<Bmap>(data->value)) {
-        return encodeMap(std::get<Bmap>(data->value));
-    } else {
-        throw std::runtime_error("Unknown type of BNode");
+const Node* Node::Find(std::string_view key) const {
+    CheckType(IsDict(), "dictionary");
+    const DictEntry* last = entries + size;
+    const DictEntry* it = std::lower_bound(entries, last, key, [] (const DictEntry& entry, std::string_view key) {
+        return entry.key < key;
+    });
+    if (it == last || it->key != key) {
+        return nullptr;
     }
+    return &it->value;
 }
 
-std::string BencodeEncoder::encodeString(const Bstring& value) const {
-    return std::to_string(value.size()) + ":" + value;
+const Node& Node::At(std::string_view key) const {
+    const Node* value = Find(key);
+    if (!value) {
+        throw std::invalid_argument("<Bencode> missing key " + std::string(key));
+    }
+    return *value;
 }
 
-std::string BencodeEncoder::encodeInt(const Bint& value) const {
-    return "i" + std::to_string(value) + "e";
-}
+/*
+ * Выделение памяти блоками без освобождения отдельных объектов, в арене лежат только тривиальные типы
+ */
+class Document::Arena {
+public:
+    template <class T>
+    T* Copy(const T* first, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>);
+        if (count == 0) {
+            return nullptr;
+        }
+        size_t bytes = count * sizeof(T);
+        size_t offset = (used_ + alignof(T) - 1) / alignof(T) * alignof(T);
+        if (blocks_.empty() || offset + bytes > blockSize_) {
+            blockSize_ = std::max(ARENA_BLOCK_SIZE, bytes);
+            blocks_.emplace_back(new char[blockSize_]);
+            offset = 0;
+        }
+        used_ = offset + bytes;
+        T* result = reinterpret_cast<T*>(blocks_.back().get() + offset);
+        std::uninitialized_copy(first, first + count, result);
+        return result;
+    }
 
-std::string BencodeEncoder::encodeList(const Blist& value) const {
-    std::ostringstream oss;
-    oss << "l";
-    for (auto& e : value) {
-        oss << encodeValue(e);
-    } 
-    oss << "e";
-    return oss.str();
-}
+private:
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    size_t blockSize_ = 0;
+    size_t used_ = 0;
+};
+
+/*
+ * Рекурсивный спуск. Элементы списков и словарей сначала собираются на общих стеках,
+ * а после закрытия контейнера одним куском копируются в арену
+ */
+class Document::Parser {
+public:
+    Parser(std::string_view data, Arena& arena) : data_(data), pos_(0), depth_(0), arena_(arena) {}
+
+    Node Parse() {
+        Node root = ParseValue();
+        if (pos_ != data_.size()) {
+            Fail("trailing data", pos_);
+        }
+        return root;
+    }
+
+private:
+    std::string_view data_;
+    size_t pos_;
+    size_t depth_;
+    Arena& arena_;
+    std::vector<Node> listStack_;
+    std::vector<DictEntry> dictStack_;
 
-std::string BencodeEncoder::encodeMap(const Bmap& value) const {
-    std::ostringstream oss;
-    oss << "d";
-    for (auto& [key, val] : value) {
-        oss << encodeString(key) << encodeValue(val);
+    char Peek() const {
+        if (pos_ >= data_.size()) {
+            Fail("unexpected end of data", pos_);
+        }
+        return data_[pos_];
     }
-    oss << "e";
-    return oss.str();
+
+    Node MakeNode(Node::Type type, size_t start) const {
+        Node node{};
+        node.type = type;
+        node.raw = data_.substr(start, pos_ - start);
+        return node;
+    }
+
+    Node ParseValue() {
+        char c = Peek();
+        if (c == 'i') return ParseInt();
+        if (c == 'l') return ParseList();
+        if (c == 'd') return ParseDict();
+        if ('0' <= c && c <= '9') {
+            size_t start = pos_;
+            std::string_view string = ParseString();
+            Node node = MakeNode(Node::Type::String, start);
+            node.string = string;
+            return node;
+        }
+        Fail(std::string("unexpected symbol '") + c + "'", pos_);
+        return Node{};
+    }
+
+    uint64_t ParseDigits(char terminator) {
+        size_t start = pos_;
+        uint64_t value = 0;
+        while (Peek() != terminator) {
+            char c = data_[pos_];
+            if (c < '0' || c > '9') {
+                Fail("invalid number", pos_);
+            }
+            if (value > (std::numeric_limits<uint64_t>::max() - (c - '0')) / 10) {
+                Fail("number overflow", pos_);
+            }
+            value = value * 10 + (c - '0');
+            ++pos_;
+        }
+        if (pos_ == start) {
+            Fail("empty number", pos_);
+        }
+        ++pos_;
+        return value;
+    }
+
+    Node ParseInt() {
+        size_t start = pos_++;
+        bool negative = Peek() == '-';
+        if (negative) {
+            ++pos_;
+        }
+        uint64_t value = ParseDigits('e');
+        if (value > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+            Fail("integer overflow", start);
+        }
+        Node node = MakeNode(Node::Type::Int, start);
+        node.integer = negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+        return node;
+    }
+
+    std::string_view ParseString() {
+        uint64_t length = ParseDigits(':');
+        if (length > data_.size() - pos_) {
+            Fail("string is out of data", pos_);
+        }
+        std::string_view result = data_.substr(pos_, length);
+        pos_ += length;
+        return result;
+    }
+
+    void Enter() {
+        if (++depth_ > MAX_DEPTH) {
+            Fail("nesting is too deep", pos_);
+        }
+        ++pos_;
+    }
+
+    Node ParseList() {
+        size_t start = pos_;
+        Enter();
+        size_t mark = listStack_.size();
+        while (Peek() != 'e') {
+            Node item = ParseValue();
+            listStack_.push_back(item);
+        }
+        ++pos_;
+        --depth_;
+
+        Node node = MakeNode(Node::Type::List, start);
+        node.size = listStack_.size() - mark;
+        node.items = arena_.Copy(listStack_.data() + mark, node.size);
+        listStack_.resize(mark);
+        return node;
+    }
+
+    Node ParseDict() {
+        size_t start = pos_;
+        Enter();
+        size_t mark = dictStack_.size();
+        while (Peek() != 'e') {
+            if (Peek() < '0' || Peek() > '9') {
+                Fail("dictionary key must be a string", pos_);
+            }
+            std::string_view key = ParseString();
+            Node value = ParseValue();
+            dictStack_.push_back(DictEntry{key, value});
+        }
+        ++pos_;
+        --depth_;
+
+        // по стандарту ключи уже отсортированы, но полагаться на это нельзя
+        auto first = dictStack_.begin() + mark;
+        auto byKey = [] (const DictEntry& lhs, const DictEntry& rhs) { return lhs.key < rhs.key; };
+        if (!std::is_sorted(first, dictStack_.end(), byKey)) {
+            std::stable_sort(first, dictStack_.end(), byKey);
+        }
+
+        Node node = MakeNode(Node::Type::Dict, start);
+        node.size = dictStack_.size() - mark;
+        node.entries = arena_.Copy(dictStack_.data() + mark, node.size);
+        dictStack_.resize(mark);
+        return node;
+    }
+};
+
+Document::Document(std::string_view data) : arena_(std::make_unique<Arena>()), root_() {
+    Parser parser(data, *arena_);
+    root_ = parser.Parse();
 }
 
-std::string extract_info(const std::shared_ptr<BNode> info) {
-    auto be = BencodeEncoder(info);
-    return be.encode();
+Document::~Document() = default;
+
+Document::Document(Document&&) noexcept = default;
+
+Document& Document::operator=(Document&&) noexcept = default;
+
+const Node& Document::Root() const {
+    return root_;
 }
 
-std::string sha1_raw(const std::string& input) {
+std::string sha1_raw(std::string_view input) {
     unsigned char hash[SHA_DIGEST_LENGTH];
     SHA1(reinterpret_cast<const unsigned char*>(input.data()), input.size(), hash);
     return std::string(reinterpret_cast<char*>(hash), SHA_DIGEST_LENGTH);
 }
 
-};
\ No newline at end of file
+};
@@ -1,64 +1,90 @@
 #pragma once
 
-#include <iostream>
-#include <iomanip>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <openssl/sha.h>
-#include <fstream>
-#include <variant>
-#include <list>
-#include <map>
-#include <sstream>
-#include <memory>
-#include "torrent_file.h"
 
 namespace Bencode {
-    
-    using Bvalue = std::variant<int64_t, std::string, std::vector<std::shared_ptr<struct BNode>>, std::map<std::string, std::shared_ptr<struct BNode>>>;
-    using Bint = int64_t;
-    using Bstring = std::string;
-    using Blist = std::vector<std::shared_ptr<struct BNode>>;
-    using Bmap = std::map<std::string, std::shared_ptr<struct BNode>>;
-    
-    struct BNode {
-        Bvalue value;
-        BNode(const Bvalue& value);
+
+    struct DictEntry;
+
+    /*
+     * Значение bencode. Строки и raw -- string_view в исходный буфер, вложенные узлы лежат в арене документа,
+     * поэтому узлы действительны, пока живы документ и исходный буфер
+     */
+    struct Node {
+        enum class Type : uint8_t {
+            Int,
+            String,
+            List,
+            Dict,
+        };
+
+        Type type;
+        int64_t integer;
+        std::string_view string;
+        const Node* items;  // элементы списка
+        const DictEntry* entries;  // элементы словаря, отсортированы по ключу
+        size_t size;  // количество элементов списка или словаря
+        std::string_view raw;  // закодированное значение целиком, как оно записано в исходном буфере
+
+        bool IsInt() const;
+        bool IsString() const;
+        bool IsList() const;
+        bool IsDict() const;
+
+        /*
+         * При несовпадении типа бросают std::invalid_argument
+         */
+        int64_t AsInt() const;
+        std::string_view AsString() const;
+        const Node* begin() const;
+        const Node* end() const;
+
+        /*
+         * Значение по ключу словаря или nullptr, если ключа нет
+         */
+        const Node* Find(std::string_view key) const;
+
+        /*
+         * Значение по ключу словаря, при отсутствии ключа бросает std::invalid_argument
+         */
+        const Node& At(std::string_view key) const;
     };
-    
-    class BencodeParser {
-    private:
-        const std::string& data;
-        int pos;
-    
-        char peek() const;
-        char get();
-        std::shared_ptr<BNode> parseValue();
-        std::shared_ptr<BNode> parseInt();
-        std::shared_ptr<BNode> parseString();
-        std::shared_ptr<BNode> parseList();
-        std::shared_ptr<BNode> parseMap();
-    
-    public:
-        BencodeParser(const std::string& data_);
-        std::shared_ptr<BNode> parse();
+
+    struct DictEntry {
+        std::string_view key;
+        Node value;
     };
 
-    class BencodeEncoder {
-    private:
-        const std::shared_ptr<BNode> data;
-    
-        std::string encodeValue(const std::shared_ptr<BNode> data) const;
-        std::string encodeString(const Bstring& value) const;
-        std::string encodeInt(const Bint& value) const;
-        std::string encodeList(const Blist& value) const;
-        std::string encodeMap(const Bmap& value) const;
-    
+    /*
+     * Разобранный bencode документ. Все узлы выделяются в арене большими блоками,
+     * строки не копируются. Исходный буфер должен жить дольше документа
+     */
+    class Document {
     public:
-        BencodeEncoder(std::shared_ptr<BNode> data_);
-        std::string encode();
+        /*
+         * При ошибке разбора бросает std::invalid_argument
+         */
+        explicit Document(std::string_view data);
+        ~Document();
+
+        Document(const Document&) = delete;
+        Document& operator=(const Document&) = delete;
+        Document(Document&&) noexcept;
+        Document& operator=(Document&&) noexcept;
+
+        const Node& Root() const;
+
+    private:
+        class Arena;
+        class Parser;
+
+        std::unique_ptr<Arena> arena_;
+        Node root_;
     };
-    
-    std::string extract_info(const std::shared_ptr<BNode> info);
-    std::string sha1_raw(const std::string& input);
-};
\ No newline at end of file
+
+    std::string sha1_raw(std::string_view input);
+};
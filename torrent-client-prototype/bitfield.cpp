@@ -0,0 +1,348 @@
+#include "bitfield.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TORRENT_BITFIELD_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+constexpr size_t WORD_BITS = 64;
+constexpr size_t BLOCK_WORDS = 4;  // 256 бит, один регистр AVX2
+
+/*
+ * Операции над массивами слов одинаковой длины, длина кратна BLOCK_WORDS
+ */
+struct Kernels {
+    const char* name;
+    bool (*intersectAny)(const uint64_t* a, const uint64_t* b, size_t words);
+    bool (*differenceAny)(const uint64_t* a, const uint64_t* b, size_t words);
+    size_t (*intersectCount)(const uint64_t* a, const uint64_t* b, size_t words);
+    // первое слово не меньше from с ненулевым a & b, words, если таких нет
+    size_t (*findCommon)(const uint64_t* a, const uint64_t* b, size_t from, size_t words);
+};
+
+bool ScalarIntersectAny(const uint64_t* a, const uint64_t* b, size_t words) {
+    for (size_t i = 0; i < words; i += BLOCK_WORDS) {
+        if (((a[i] & b[i]) | (a[i + 1] & b[i + 1]) | (a[i + 2] & b[i + 2]) | (a[i + 3] & b[i + 3])) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ScalarDifferenceAny(const uint64_t* a, const uint64_t* b, size_t words) {
+    for (size_t i = 0; i < words; i += BLOCK_WORDS) {
+        if (((a[i] & ~b[i]) | (a[i + 1] & ~b[i + 1]) | (a[i + 2] & ~b[i + 2]) | (a[i + 3] & ~b[i + 3])) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t ScalarIntersectCount(const uint64_t* a, const uint64_t* b, size_t words) {
+    size_t count = 0;
+    for (size_t i = 0; i < words; ++i) {
+        count += __builtin_popcountll(a[i] & b[i]);
+    }
+    return count;
+}
+
+size_t ScalarFindCommon(const uint64_t* a, const uint64_t* b, size_t from, size_t words) {
+    for (size_t i = from; i < words; ++i) {
+        if ((a[i] & b[i]) != 0) {
+            return i;
+        }
+    }
+    return words;
+}
+
+constexpr Kernels SCALAR_KERNELS{"scalar", ScalarIntersectAny, ScalarDifferenceAny, ScalarIntersectCount, ScalarFindCommon};
+
+#ifdef TORRENT_BITFIELD_X86
+__attribute__((target("sse4.1")))
+bool Sse41IntersectAny(const uint64_t* a, const uint64_t* b, size_t words) {
+    for (size_t i = 0; i < words; i += BLOCK_WORDS) {
+        __m128i x = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        __m128i y = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 2)),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 2)));
+        if (!_mm_testz_si128(_mm_or_si128(x, y), _mm_or_si128(x, y))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+__attribute__((target("sse4.1")))
+bool Sse41DifferenceAny(const uint64_t* a, const uint64_t* b, size_t words) {
+    for (size_t i = 0; i < words; i += BLOCK_WORDS) {
+        // andnot(x, y) = ~x & y
+        __m128i x = _mm_andnot_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)),
+                                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m128i y = _mm_andnot_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 2)),
+                                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 2)));
+        if (!_mm_testz_si128(_mm_or_si128(x, y), _mm_or_si128(x, y))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// отдельной векторной инструкции подсчета бит до AVX-512 нет, а popcnt обрабатывает слово за такт
+__attribute__((target("popcnt")))
+size_t PopcntIntersectCount(const uint64_t* a, const uint64_t* b, size_t words) {
+    size_t count = 0;
+    for (size_t i = 0; i < words; ++i) {
+        count += __builtin_popcountll(a[i] & b[i]);
+    }
+    return count;
+}
+
+__attribute__((target("sse4.1")))
+size_t Sse41FindCommon(const uint64_t* a, const uint64_t* b, size_t from, size_t words) {
+    size_t i = from;
+    for (; i < words && i % 2 != 0; ++i) {
+        if ((a[i] & b[i]) != 0) return i;
+    }
+    for (; i < words; i += 2) {
+        __m128i x = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        if (!_mm_testz_si128(x, x)) {
+            return (a[i] & b[i]) != 0 ? i : i + 1;
+        }
+    }
+    return words;
+}
+
+__attribute__((target("avx2")))
+bool Avx2IntersectAny(const uint64_t* a, const uint64_t* b, size_t words) {
+    for (size_t i = 0; i < words; i += BLOCK_WORDS) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        if (!_mm256_testz_si256(x, y)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+__attribute__((target("avx2")))
+bool Avx2DifferenceAny(const uint64_t* a, const uint64_t* b, size_t words) {
+    for (size_t i = 0; i < words; i += BLOCK_WORDS) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        // testc(y, x) == 1, если все биты x есть в y
+        if (!_mm256_testc_si256(y, x)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Подсчет бит по таблице на полубайт через vpshufb, счетчики байтов складываются через vpsadbw
+ */
+__attribute__((target("avx2")))
+size_t Avx2IntersectCount(const uint64_t* a, const uint64_t* b, size_t words) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    for (size_t i = 0; i < words; i += BLOCK_WORDS) {
+        __m256i x = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                                     _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        __m256i low = _mm256_shuffle_epi8(lookup, _mm256_and_si256(x, lowMask));
+        __m256i high = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), lowMask));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256()));
+    }
+    alignas(32) uint64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+size_t Avx2FindCommon(const uint64_t* a, const uint64_t* b, size_t from, size_t words) {
+    size_t i = from;
+    for (; i < words && i % BLOCK_WORDS != 0; ++i) {
+        if ((a[i] & b[i]) != 0) return i;
+    }
+    for (; i < words; i += BLOCK_WORDS) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        if (!_mm256_testz_si256(x, y)) {
+            while ((a[i] & b[i]) == 0) ++i;
+            return i;
+        }
+    }
+    return words;
+}
+
+constexpr Kernels SSE41_KERNELS{"sse4.1", Sse41IntersectAny, Sse41DifferenceAny, PopcntIntersectCount, Sse41FindCommon};
+constexpr Kernels AVX2_KERNELS{"avx2", Avx2IntersectAny, Avx2DifferenceAny, Avx2IntersectCount, Avx2FindCommon};
+#endif
+
+const Kernels& SelectKernels() {
+    const char* forced = std::getenv("TORRENT_SIMD");
+    std::string limit = forced ? forced : "";
+#ifdef TORRENT_BITFIELD_X86
+    __builtin_cpu_init();
+    bool sse41 = __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("popcnt");
+    if (sse41 && __builtin_cpu_supports("avx2") && (limit.empty() || limit == "avx2")) {
+        return AVX2_KERNELS;
+    }
+    if (sse41 && limit != "scalar") {
+        return SSE41_KERNELS;
+    }
+#endif
+    return SCALAR_KERNELS;
+}
+
+const Kernels& ActiveKernels() {
+    static const Kernels& kernels = SelectKernels();
+    return kernels;
+}
+
+size_t WordsFor(size_t size) {
+    size_t words = (size + WORD_BITS - 1) / WORD_BITS;
+    return (words + BLOCK_WORDS - 1) / BLOCK_WORDS * BLOCK_WORDS;
+}
+
+/*
+ * Слова [from, to) диапазона битов в полях из words слов
+ */
+std::pair<size_t, size_t> WordRange(size_t from, size_t to, size_t words) {
+    size_t last = std::min(words, to / WORD_BITS + (to % WORD_BITS != 0));
+    return {std::min(from / WORD_BITS, last), last};
+}
+
+uint64_t LoadBigEndian(const char* bytes) {
+    uint64_t word;
+    std::memcpy(&word, bytes, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+void StoreBigEndian(uint64_t word, char* bytes) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    std::memcpy(bytes, &word, sizeof(word));
+}
+
+uint64_t BitMask(size_t index) {
+    return uint64_t(1) << (WORD_BITS - 1 - index % WORD_BITS);
+}
+}
+
+Bitfield::Bitfield() : size_(0) {}
+
+Bitfield::Bitfield(size_t size) : words_(WordsFor(size), 0), size_(size) {}
+
+Bitfield Bitfield::FromBytes(std::string_view bytes, size_t size) {
+    if (bytes.size() != (size + CHAR_BIT - 1) / CHAR_BIT) {
+        throw std::invalid_argument("Bitfield length " + std::to_string(bytes.size()) + " does not match " +
+                                    std::to_string(size) + " pieces");
+    }
+    Bitfield result(size);
+    size_t fullWords = bytes.size() / sizeof(uint64_t);
+    for (size_t i = 0; i < fullWords; ++i) {
+        result.words_[i] = LoadBigEndian(bytes.data() + i * sizeof(uint64_t));
+    }
+    for (size_t i = fullWords * sizeof(uint64_t); i < bytes.size(); ++i) {
+        result.words_[i / 8] |= uint64_t(static_cast<unsigned char>(bytes[i])) << (56 - 8 * (i % 8));
+    }
+    if (size % WORD_BITS != 0 && (result.words_[size / WORD_BITS] & (~uint64_t(0) >> size % WORD_BITS)) != 0) {
+        throw std::invalid_argument("Bitfield has spare bits set");
+    }
+    return result;
+}
+
+std::string Bitfield::ToBytes() const {
+    std::string bytes((size_ + CHAR_BIT - 1) / CHAR_BIT, 0);
+    size_t fullWords = bytes.size() / sizeof(uint64_t);
+    for (size_t i = 0; i < fullWords; ++i) {
+        StoreBigEndian(words_[i], bytes.data() + i * sizeof(uint64_t));
+    }
+    for (size_t i = fullWords * sizeof(uint64_t); i < bytes.size(); ++i) {
+        bytes[i] = static_cast<char>(words_[i / 8] >> (56 - 8 * (i % 8)));
+    }
+    return bytes;
+}
+
+size_t Bitfield::Size() const {
+    return size_;
+}
+
+void Bitfield::Set(size_t index) {
+    if (index >= size_) {
+        throw std::out_of_range("Bit " + std::to_string(index) + " is out of bitfield of size " + std::to_string(size_));
+    }
+    words_[index / WORD_BITS] |= BitMask(index);
+}
+
+void Bitfield::Reset(size_t index) {
+    if (index < size_) {
+        words_[index / WORD_BITS] &= ~BitMask(index);
+    }
+}
+
+size_t Bitfield::Count() const {
+    return ActiveKernels().intersectCount(words_.data(), words_.data(), words_.size());
+}
+
+size_t Bitfield::FindFirst(size_t from) const {
+    return FindFirstCommon(*this, *this, from);
+}
+
+bool Bitfield::IntersectAny(const Bitfield& a, const Bitfield& b, size_t from, size_t to) {
+    auto [first, last] = WordRange(from, to, std::min(a.words_.size(), b.words_.size()));
+    return ActiveKernels().intersectAny(a.words_.data() + first, b.words_.data() + first, last - first);
+}
+
+bool Bitfield::DifferenceAny(const Bitfield& a, const Bitfield& b) {
+    size_t common = std::min(a.words_.size(), b.words_.size());
+    if (ActiveKernels().differenceAny(a.words_.data(), b.words_.data(), common)) {
+        return true;
+    }
+    // биты a за концом b тоже не выставлены в b
+    if (a.size_ > b.size_) {
+        return a.FindFirst(b.size_) < a.size_;
+    }
+    return false;
+}
+
+size_t Bitfield::IntersectCount(const Bitfield& a, const Bitfield& b) {
+    return ActiveKernels().intersectCount(a.words_.data(), b.words_.data(), std::min(a.words_.size(), b.words_.size()));
+}
+
+size_t Bitfield::FindFirstCommon(const Bitfield& a, const Bitfield& b, size_t from, size_t to) {
+    size_t size = std::min({a.size_, b.size_, to});
+    if (from >= size) {
+        return size;
+    }
+    size_t word = from / WORD_BITS;
+    // в первом слове биты до from не учитываются
+    uint64_t first = a.words_[word] & b.words_[word] & (~uint64_t(0) >> from % WORD_BITS);
+    if (first == 0) {
+        size_t words = WordRange(from, to, std::min(a.words_.size(), b.words_.size())).second;
+        word = ActiveKernels().findCommon(a.words_.data(), b.words_.data(), word + 1, words);
+        if (word == words) {
+            return size;
+        }
+        first = a.words_[word] & b.words_[word];
+    }
+    // за концом меньшего поля его биты нулевые, а to кратен BLOCK_BITS либо не меньше длины
+    return std::min(word * WORD_BITS + __builtin_clzll(first), size);
+}
+
+const char* Bitfield::Implementation() {
+    return ActiveKernels().name;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * Битовое поле частей раздачи. Хранится словами по 64 бита: слово -- восемь байт формата сообщения bitfield,
+ * прочитанные как big-endian, поэтому старший бит слова соответствует части с меньшим номером.
+ * Число слов кратно четырем, а биты за концом поля всегда нулевые, поэтому операции над полями
+ * идут целыми блоками по 256 бит без хвостов. Операции над парами полей векторизованы (AVX2 или SSE4.1),
+ * вариант выбирается при первом использовании по возможностям процессора, есть и скалярный
+ */
+class Bitfield {
+public:
+    static constexpr size_t BLOCK_BITS = 256;
+    static constexpr size_t END = std::numeric_limits<size_t>::max();
+
+    Bitfield();
+
+    explicit Bitfield(size_t size);
+
+    /*
+     * Поле из payload сообщения bitfield. Бросает std::invalid_argument, если длина не соответствует
+     * числу частей или выставлены биты за концом поля
+     */
+    static Bitfield FromBytes(std::string_view bytes, size_t size);
+
+    std::string ToBytes() const;
+
+    size_t Size() const;
+
+    /*
+     * За концом поля бит считается нулевым
+     */
+    bool Test(size_t index) const {
+        return index < size_ && (words_[index / 64] >> (63 - index % 64) & 1) != 0;
+    }
+
+    /*
+     * Бросает std::out_of_range за концом поля
+     */
+    void Set(size_t index);
+
+    void Reset(size_t index);
+
+    size_t Count() const;
+
+    /*
+     * Первый выставленный бит с номером не меньше from, Size(), если таких нет
+     */
+    size_t FindFirst(size_t from = 0) const;
+
+    /*
+     * Операции над парой полей. Поля могут быть разной длины, лишние биты длинного поля не учитываются.
+     * Диапазон [from, to) ограничивает проверяемые биты, его границы кратны BLOCK_BITS, to может быть больше длины
+     */
+
+    // есть ли бит, выставленный в обоих полях
+    static bool IntersectAny(const Bitfield& a, const Bitfield& b, size_t from = 0, size_t to = END);
+
+    // есть ли бит, выставленный в a и не выставленный в b
+    static bool DifferenceAny(const Bitfield& a, const Bitfield& b);
+
+    static size_t IntersectCount(const Bitfield& a, const Bitfield& b);
+
+    // первый бит из [from, to), выставленный в обоих полях, или min(to, длина меньшего поля), если таких нет.
+    // Здесь from может быть любым
+    static size_t FindFirstCommon(const Bitfield& a, const Bitfield& b, size_t from = 0, size_t to = END);
+
+    /*
+     * Вызывает f(index) для каждого выставленного бита из [from, to) по возрастанию, пропуская нулевые слова.
+     * Границы кратны BLOCK_BITS, как у операций над парами полей
+     */
+    template <class F>
+    void ForEachSet(F f, size_t from = 0, size_t to = END) const {
+        size_t end = std::min(words_.size(), to / 64 + (to % 64 != 0));
+        for (size_t word = from / 64; word < end; ++word) {
+            for (uint64_t bits = words_[word]; bits != 0;) {
+                int lead = __builtin_clzll(bits);
+                bits &= ~(uint64_t(1) << (63 - lead));
+                f(word * 64 + lead);
+            }
+        }
+    }
+
+    /*
+     * Используемый вариант операций: "avx2", "sse4.1" или "scalar". Переменная окружения TORRENT_SIMD
+     * с одним из этих значений ограничивает выбор, например, для сравнения в бенчмарке
+     */
+    static const char* Implementation();
+
+private:
+    std::vector<uint64_t> words_;
+    size_t size_;
+};
@@ -16,13 +16,17 @@ int BytesToInt(std::string_view bytes) {
 
 std::string IntToBytes(int value) {
     std::string bytes(4, '\0');
-    bytes[0] = static_cast<char>((value >> 24) & 0xFF);
-    bytes[1] = static_cast<char>((value >> 16) & 0xFF);
-    bytes[2] = static_cast<char>((value >> 8) & 0xFF);
-    bytes[3] = static_cast<char>(value & 0xFF);
+    IntToBytes(value, bytes.data());
     return bytes;
 }
 
+void IntToBytes(int value, char* out) {
+    out[0] = static_cast<char>((value >> 24) & 0xFF);
+    out[1] = static_cast<char>((value >> 16) & 0xFF);
+    out[2] = static_cast<char>((value >> 8) & 0xFF);
+    out[3] = static_cast<char>(value & 0xFF);
+}
+
 std::string CalculateSHA1(const std::string& msg) {
     unsigned char hash[SHA_DIGEST_LENGTH];
 
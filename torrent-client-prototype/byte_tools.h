@@ -5,6 +5,11 @@
 int BytesToInt(std::string_view bytes);
 std::string IntToBytes(int value);
 
+/*
+ * Записать value в 4 байта по адресу out, без выделения памяти
+ */
+void IntToBytes(int value, char* out);
+
 std::string CalculateSHA1(const std::string& msg);
 
 std::string HexEncode(const std::string& input);
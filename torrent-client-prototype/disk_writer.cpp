@@ -0,0 +1,193 @@
+#include "disk_writer.h"
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <stdexcept>
+
+#ifdef TORRENT_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+namespace {
+constexpr size_t URING_QUEUE_DEPTH = 64;
+
+int WriteAll(int fd, const char* data, size_t size, int64_t offset) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t res = pwrite(fd, data + written, size - written, offset + written);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        written += res;
+    }
+    return 0;
+}
+}
+
+DiskWriter::DiskWriter([[maybe_unused]] size_t threadsCount, size_t maxQueueDepth) : maxQueueDepth_(maxQueueDepth), pending_(0), stopped_(false),
+        queueDepthGauge_(MetricsRegistry::Global().GetGauge("torrent_disk_queue_depth", "Disk write requests queued or in progress")),
+        writeLatency_(MetricsRegistry::Global().GetHistogram("torrent_disk_write_seconds", "Time from queueing a disk write to its completion",
+                                                             Histogram::LatencyBounds())) {
+#ifdef TORRENT_HAVE_LIBURING
+    threads_.emplace_back([this] () { RunUring(); });
+#else
+    for (size_t i = 0; i < std::max<size_t>(threadsCount, 1); ++i) {
+        threads_.emplace_back([this] () { RunPwrite(); });
+    }
+#endif
+}
+
+DiskWriter::~DiskWriter() {
+    Stop();
+}
+
+void DiskWriter::Submit(DiskWriteRequest request) {
+    {
+        std::lock_guard lock(mtx_);
+        if (stopped_) {
+            throw std::runtime_error("<DiskWriter> writer is stopped");
+        }
+        request.submittedAt = std::chrono::steady_clock::now();
+        queue_.push_back(std::move(request));
+        ++pending_;
+        queueDepthGauge_.Add(1);
+    }
+    cv_.notify_one();
+}
+
+bool DiskWriter::Full() const {
+    return pending_ >= maxQueueDepth_;
+}
+
+size_t DiskWriter::QueueDepth() const {
+    return pending_;
+}
+
+void DiskWriter::Stop() {
+    {
+        std::lock_guard lock(mtx_);
+        if (stopped_) return;
+        stopped_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+bool DiskWriter::WaitRequests(std::vector<DiskWriteRequest>& batch, size_t maxBatchSize) {
+    std::unique_lock lock(mtx_);
+    cv_.wait(lock, [this] () { return stopped_ || !queue_.empty(); });
+    if (queue_.empty()) {
+        // остановка, все запросы выполнены
+        return false;
+    }
+    while (!queue_.empty() && batch.size() < maxBatchSize) {
+        batch.push_back(std::move(queue_.front()));
+        queue_.pop_front();
+    }
+    return true;
+}
+
+void DiskWriter::Complete(DiskWriteRequest& request, int error) {
+    writeLatency_.Observe(std::chrono::steady_clock::now() - request.submittedAt);
+    if (request.onComplete) {
+        try {
+            request.onComplete(error);
+        } catch (const std::exception& e) {
+            std::cerr << "<DiskWriter> completion failed: " << e.what() << std::endl;
+        }
+    }
+    --pending_;
+    queueDepthGauge_.Add(-1);
+}
+
+void DiskWriter::RunPwrite() {
+    std::vector<DiskWriteRequest> batch;
+    while (WaitRequests(batch, 1)) {
+        for (auto& request : batch) {
+            int error = WriteAll(request.file->Get(), request.data.data(), request.data.size(), request.offset);
+            Complete(request, error);
+        }
+        batch.clear();
+    }
+}
+
+#ifdef TORRENT_HAVE_LIBURING
+void DiskWriter::RunUring() {
+    io_uring ring;
+    if (int res = io_uring_queue_init(URING_QUEUE_DEPTH, &ring, 0); res < 0) {
+        std::cerr << "<DiskWriter> io_uring is not available, falling back to pwrite" << std::endl;
+        RunPwrite();
+        return;
+    }
+
+    struct InFlight {
+        DiskWriteRequest request;
+        size_t written;
+        bool done;
+    };
+
+    std::vector<DiskWriteRequest> batch;
+    while (WaitRequests(batch, URING_QUEUE_DEPTH)) {
+        std::vector<InFlight> inFlight;
+        inFlight.reserve(batch.size());
+        for (auto& request : batch) {
+            inFlight.push_back(InFlight{std::move(request), 0, false});
+        }
+        batch.clear();
+
+        auto prepare = [&ring] (InFlight& write) {
+            io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_write(sqe, write.request.file->Get(), write.request.data.data() + write.written,
+                                write.request.data.size() - write.written, write.request.offset + write.written);
+            io_uring_sqe_set_data(sqe, &write);
+        };
+
+        for (auto& write : inFlight) {
+            prepare(write);
+        }
+        io_uring_submit(&ring);
+
+        size_t remaining = inFlight.size();
+        while (remaining > 0) {
+            io_uring_cqe* cqe;
+            if (int res = io_uring_wait_cqe(&ring, &cqe); res < 0) {
+                if (res == -EINTR) continue;
+                std::cerr << "<DiskWriter> io_uring_wait_cqe failed" << std::endl;
+                break;
+            }
+            auto* write = static_cast<InFlight*>(io_uring_cqe_get_data(cqe));
+            int res = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+
+            if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                Complete(write->request, -res);
+                write->done = true;
+                --remaining;
+                continue;
+            }
+            write->written += std::max(res, 0);
+            if (write->written < write->request.data.size()) {
+                // короткая запись, дописываем остаток
+                prepare(*write);
+                io_uring_submit(&ring);
+                continue;
+            }
+            Complete(write->request, 0);
+            write->done = true;
+            --remaining;
+        }
+
+        for (auto& write : inFlight) {
+            if (!write.done) {
+                Complete(write.request, EIO);
+            }
+        }
+    }
+
+    io_uring_queue_exit(&ring);
+}
+#endif
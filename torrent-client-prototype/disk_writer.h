@@ -0,0 +1,79 @@
+#pragma once
+
+#include "file_storage.h"
+#include "metrics.h"
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/*
+ * Запрос на запись данных в файл по заданному смещению
+ */
+struct DiskWriteRequest {
+    FileHandlePtr file;
+    int64_t offset;
+    std::string_view data;  // должны оставаться доступными до вызова onComplete
+    /*
+     * Вызывается в потоке записи, error -- 0 при успехе, иначе код errno
+     */
+    std::function<void(int error)> onComplete;
+    std::chrono::steady_clock::time_point submittedAt{};  // заполняется в DiskWriter::Submit
+};
+
+/*
+ * Асинхронная запись на диск. Запросы складываются в очередь и выполняются отдельными потоками
+ * через pwrite, либо через io_uring, если проект собран с liburing.
+ * Потоки сети никогда не ждут диск: Submit не блокируется, а заполненность очереди
+ * проверяется через Full() перед тем, как запрашивать у пиров новые данные.
+ */
+class DiskWriter {
+public:
+    /*
+     * threadsCount -- количество потоков записи (для io_uring всегда один поток)
+     * maxQueueDepth -- количество запросов в очереди, после которого Full() возвращает true
+     */
+    DiskWriter(size_t threadsCount, size_t maxQueueDepth);
+    ~DiskWriter();
+
+    DiskWriter(const DiskWriter&) = delete;
+    DiskWriter& operator=(const DiskWriter&) = delete;
+
+    void Submit(DiskWriteRequest request);
+
+    bool Full() const;
+
+    size_t QueueDepth() const;
+
+    /*
+     * Дождаться выполнения всех поставленных запросов и остановить потоки
+     */
+    void Stop();
+
+private:
+    const size_t maxQueueDepth_;
+    std::deque<DiskWriteRequest> queue_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::atomic<size_t> pending_;  // запросы в очереди и в процессе записи
+    bool stopped_;
+    Gauge& queueDepthGauge_;
+    Histogram& writeLatency_;
+    std::vector<std::thread> threads_;
+
+    bool WaitRequests(std::vector<DiskWriteRequest>& batch, size_t maxBatchSize);
+
+    void Complete(DiskWriteRequest& request, int error);
+
+    void RunPwrite();
+
+#ifdef TORRENT_HAVE_LIBURING
+    void RunUring();
+#endif
+};
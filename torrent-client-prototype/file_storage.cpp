@@ -0,0 +1,159 @@
+#include "file_storage.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+FileHandle::FileHandle(int fd) : fd_(fd) {}
+
+FileHandle::~FileHandle() {
+    close(fd_);
+}
+
+int FileHandle::Get() const {
+    return fd_;
+}
+
+FileStorage::FileStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory, size_t maxOpenFiles) :
+        maxOpenFiles_(std::max<size_t>(maxOpenFiles, 1)), used_(tf.files.size(), false), closed_(false) {
+    for (const auto& file : tf.files) {
+        std::filesystem::path path = outputDirectory;
+        for (const auto& component : file.path) {
+            path /= component;
+        }
+        paths_.push_back(std::move(path));
+        lengths_.push_back(file.length);
+        offsets_.push_back(file.offset);
+    }
+}
+
+bool FileStorage::AnyExists() const {
+    return std::any_of(paths_.begin(), paths_.end(), [] (const auto& path) {
+        return std::filesystem::exists(path);
+    });
+}
+
+bool FileStorage::SizesMatch() const {
+    for (size_t fileIndex = 0; fileIndex < paths_.size(); ++fileIndex) {
+        std::error_code error;
+        if (std::filesystem::file_size(paths_[fileIndex], error) != lengths_[fileIndex] || error) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void FileStorage::Allocate() {
+    for (size_t fileIndex = 0; fileIndex < paths_.size(); ++fileIndex) {
+        const auto& path = paths_[fileIndex];
+        if (path.has_parent_path()) {
+            std::filesystem::create_directories(path.parent_path());
+        }
+        if (!std::filesystem::exists(path)) {
+            std::ofstream tmp(path, std::ios::binary);
+            tmp.close();
+        }
+        std::filesystem::resize_file(path, lengths_[fileIndex]);
+        if (std::filesystem::file_size(path) != lengths_[fileIndex]) {
+            throw std::runtime_error("can't expand file " + path.string() + " to " + std::to_string(lengths_[fileIndex]));
+        }
+    }
+}
+
+std::vector<FileSpan> FileStorage::Spans(int64_t offset, size_t length) const {
+    std::vector<FileSpan> spans;
+    // последний файл, начинающийся не позже offset
+    auto it = std::upper_bound(offsets_.begin(), offsets_.end(), offset);
+    size_t fileIndex = it == offsets_.begin() ? 0 : it - offsets_.begin() - 1;
+
+    size_t dataOffset = 0;
+    while (dataOffset < length && fileIndex < paths_.size()) {
+        int64_t position = offset + dataOffset;
+        int64_t fileOffset = position - offsets_[fileIndex];
+        if (fileOffset >= static_cast<int64_t>(lengths_[fileIndex])) {
+            // пустые файлы и файлы, закончившиеся до начала диапазона
+            ++fileIndex;
+            continue;
+        }
+        size_t spanLength = std::min<size_t>(length - dataOffset, lengths_[fileIndex] - fileOffset);
+        spans.push_back(FileSpan{fileIndex, fileOffset, dataOffset, spanLength});
+        dataOffset += spanLength;
+        ++fileIndex;
+    }
+    if (dataOffset < length) {
+        throw std::runtime_error("<FileStorage> range is out of torrent data");
+    }
+    return spans;
+}
+
+FileHandlePtr FileStorage::Open(size_t fileIndex) {
+    std::lock_guard lock(mtx_);
+    if (closed_) {
+        throw std::runtime_error("<FileStorage> storage is closed");
+    }
+
+    auto it = openFiles_.find(fileIndex);
+    if (it != openFiles_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second.position);
+        return it->second.handle;
+    }
+
+    int fd = open(paths_.at(fileIndex).c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error("can't open file " + paths_[fileIndex].string() + ": " + std::strerror(errno));
+    }
+    auto handle = std::make_shared<const FileHandle>(fd);
+
+    if (openFiles_.size() >= maxOpenFiles_) {
+        // дескриптор закроется, когда завершатся записи, которые его держат
+        openFiles_.erase(lru_.back());
+        lru_.pop_back();
+    }
+    lru_.push_front(fileIndex);
+    openFiles_.emplace(fileIndex, CachedFile{handle, lru_.begin()});
+    used_[fileIndex] = true;
+    return handle;
+}
+
+bool FileStorage::Close() {
+    std::unique_lock lock(mtx_);
+    if (closed_) {
+        return false;
+    }
+    std::vector<size_t> usedFiles;
+    for (size_t fileIndex = 0; fileIndex < used_.size(); ++fileIndex) {
+        if (used_[fileIndex]) {
+            usedFiles.push_back(fileIndex);
+        }
+    }
+    lock.unlock();
+
+    // fsync по любому дескриптору сбрасывает все данные файла, в том числе записанные через уже закрытые
+    bool synced = true;
+    for (size_t fileIndex : usedFiles) {
+        try {
+            if (fsync(Open(fileIndex)->Get()) != 0) {
+                synced = false;
+            }
+        } catch (const std::runtime_error&) {
+            synced = false;
+        }
+    }
+
+    lock.lock();
+    closed_ = true;
+    openFiles_.clear();
+    lru_.clear();
+    return synced;
+}
+
+size_t FileStorage::FilesCount() const {
+    return paths_.size();
+}
+
+const std::filesystem::path& FileStorage::FilePath(size_t fileIndex) const {
+    return paths_.at(fileIndex);
+}
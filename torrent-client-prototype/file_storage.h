@@ -0,0 +1,116 @@
+#pragma once
+
+#include "torrent_file.h"
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Открытый файловый дескриптор, закрывается при уничтожении последней ссылки.
+ * Запрос на запись держит ссылку, поэтому вытеснение файла из кеша не закрывает его посреди записи
+ */
+class FileHandle {
+public:
+    explicit FileHandle(int fd);
+    ~FileHandle();
+
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
+
+    int Get() const;
+
+private:
+    const int fd_;
+};
+
+using FileHandlePtr = std::shared_ptr<const FileHandle>;
+
+/*
+ * Участок диапазона данных раздачи, целиком лежащий в одном файле
+ */
+struct FileSpan {
+    size_t fileIndex;
+    int64_t fileOffset;  // смещение внутри файла
+    size_t dataOffset;  // смещение относительно начала диапазона
+    size_t length;
+};
+
+/*
+ * Участок открытого файла, например, для отдачи блока пиру
+ */
+struct FileRegion {
+    FileHandlePtr handle;
+    int64_t offset;
+    size_t length;
+};
+
+/*
+ * Файлы раздачи на диске. Переводит смещения в общем потоке данных раздачи в участки файлов
+ * и держит ограниченный кеш открытых дескрипторов (LRU), чтобы части, пересекающие много мелких файлов,
+ * не открывали и не закрывали файлы на каждую запись
+ */
+class FileStorage {
+public:
+    /*
+     * maxOpenFiles -- сколько дескрипторов держать открытыми
+     */
+    FileStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory, size_t maxOpenFiles);
+
+    FileStorage(const FileStorage&) = delete;
+    FileStorage& operator=(const FileStorage&) = delete;
+
+    /*
+     * Хотя бы один файл раздачи уже есть на диске
+     */
+    bool AnyExists() const;
+
+    /*
+     * Все файлы есть на диске и имеют нужный размер
+     */
+    bool SizesMatch() const;
+
+    /*
+     * Создать недостающие директории и файлы и выставить файлам нужный размер
+     */
+    void Allocate();
+
+    /*
+     * Участки файлов, покрывающие диапазон [offset, offset + length), в порядке возрастания смещения
+     */
+    std::vector<FileSpan> Spans(int64_t offset, size_t length) const;
+
+    /*
+     * Дескриптор файла для чтения и записи. Можно вызывать из разных потоков
+     */
+    FileHandlePtr Open(size_t fileIndex);
+
+    /*
+     * Сбросить на диск все файлы, открывавшиеся для записи, и закрыть кеш. После этого Open бросает исключение.
+     * Возвращает true, если все данные дошли до диска
+     */
+    bool Close();
+
+    size_t FilesCount() const;
+
+    const std::filesystem::path& FilePath(size_t fileIndex) const;
+
+private:
+    struct CachedFile {
+        FileHandlePtr handle;
+        std::list<size_t>::iterator position;
+    };
+
+    std::vector<std::filesystem::path> paths_;
+    std::vector<size_t> lengths_;
+    std::vector<int64_t> offsets_;
+    const size_t maxOpenFiles_;
+    std::mutex mtx_;
+    std::list<size_t> lru_;  // в начале -- последние использованные файлы
+    std::unordered_map<size_t, CachedFile> openFiles_;
+    std::vector<bool> used_;
+    bool closed_;
+};
@@ -0,0 +1,102 @@
+#include "hash_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+double HashStats::Throughput() const {
+    if (secondsHashing == 0) return 0;
+    return bytesHashed / secondsHashing / 1e9;
+}
+
+HashPool::HashPool(size_t threadsCount, size_t maxQueueDepth) :
+        maxQueueDepth_(maxQueueDepth),
+        pending_(0),
+        stopped_(false),
+        bytesHashed_(0),
+        nanosHashing_(0),
+        piecesVerified_(0),
+        piecesFailed_(0),
+        queueDepthGauge_(MetricsRegistry::Global().GetGauge("torrent_hash_queue_depth", "Pieces waiting for or under hash check")),
+        hashLatency_(MetricsRegistry::Global().GetHistogram("torrent_hash_seconds", "Time to verify SHA-1 of a piece",
+                                                            Histogram::LatencyBounds())) {
+    if (threadsCount == 0) {
+        threadsCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    for (size_t i = 0; i < threadsCount; ++i) {
+        threads_.emplace_back([this] () { Run(); });
+    }
+}
+
+HashPool::~HashPool() {
+    Stop();
+}
+
+void HashPool::Submit(PiecePtr piece, Callback callback) {
+    {
+        std::lock_guard lock(mtx_);
+        if (stopped_) {
+            throw std::runtime_error("<HashPool> pool is stopped");
+        }
+        queue_.push_back(Job{std::move(piece), std::move(callback)});
+        ++pending_;
+        queueDepthGauge_.Add(1);
+    }
+    cv_.notify_one();
+}
+
+bool HashPool::Full() const {
+    return pending_ >= maxQueueDepth_;
+}
+
+size_t HashPool::QueueDepth() const {
+    return pending_;
+}
+
+HashStats HashPool::Stats() const {
+    return HashStats{bytesHashed_, nanosHashing_ / 1e9, piecesVerified_, piecesFailed_};
+}
+
+void HashPool::Stop() {
+    {
+        std::lock_guard lock(mtx_);
+        if (stopped_) return;
+        stopped_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void HashPool::Run() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock lock(mtx_);
+            cv_.wait(lock, [this] () { return stopped_ || !queue_.empty(); });
+            if (queue_.empty()) return;
+            job = std::move(queue_.front());
+            queue_.pop_front();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool hashMatches = job.piece->HashMatches();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        hashLatency_.Observe(elapsed);
+
+        // начало части хешируется еще при получении блоков, это время тоже учитывается, иначе скорость
+        // была бы посчитана по всей длине части, а время -- только по хвосту
+        bytesHashed_ += job.piece->GetLength();
+        nanosHashing_ += (std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed) + job.piece->IncrementalHashTime()).count();
+        ++(hashMatches ? piecesVerified_ : piecesFailed_);
+
+        try {
+            job.callback(job.piece, hashMatches);
+        } catch (const std::exception& e) {
+            std::cerr << "<HashPool> callback failed: " << e.what() << std::endl;
+        }
+        --pending_;
+        queueDepthGauge_.Add(-1);
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "metrics.h"
+#include "piece.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Статистика проверки хешей частей
+ */
+struct HashStats {
+    uint64_t bytesHashed;
+    double secondsHashing;  // суммарное время всех потоков, включая хеширование блоков при получении
+    uint64_t piecesVerified;
+    uint64_t piecesFailed;
+
+    /*
+     * Скорость хеширования в ГБ/с в пересчете на один поток
+     */
+    double Throughput() const;
+};
+
+/*
+ * Пул потоков, проверяющих SHA-1 скачанных частей, чтобы не занимать этим потоки сети.
+ * Результат проверки передается в обработчик, который вызывается в потоке пула
+ */
+class HashPool {
+public:
+    using Callback = std::function<void(const PiecePtr& piece, bool hashMatches)>;
+
+    /*
+     * threadsCount == 0 -- по количеству ядер
+     */
+    HashPool(size_t threadsCount, size_t maxQueueDepth);
+    ~HashPool();
+
+    HashPool(const HashPool&) = delete;
+    HashPool& operator=(const HashPool&) = delete;
+
+    void Submit(PiecePtr piece, Callback callback);
+
+    bool Full() const;
+
+    size_t QueueDepth() const;
+
+    HashStats Stats() const;
+
+    /*
+     * Дождаться проверки всех поставленных частей и остановить потоки
+     */
+    void Stop();
+
+private:
+    struct Job {
+        PiecePtr piece;
+        Callback callback;
+    };
+
+    const size_t maxQueueDepth_;
+    std::deque<Job> queue_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::atomic<size_t> pending_;
+    bool stopped_;
+    std::atomic<uint64_t> bytesHashed_, nanosHashing_, piecesVerified_, piecesFailed_;
+    Gauge& queueDepthGauge_;
+    Histogram& hashLatency_;
+    std::vector<std::thread> threads_;
+
+    void Run();
+};
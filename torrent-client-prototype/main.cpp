@@ -1,13 +1,16 @@
 #include "torrent_tracker.h"
 #include "piece_storage.h"
-#include "peer_connect.h"
+#include "peer_manager.h"
 #include "byte_tools.h"
+#include "metrics.h"
 #include <cassert>
+#include <csignal>
 #include <iostream>
 #include <filesystem>
 #include <random>
 #include <thread>
 #include <algorithm>
+#include <optional>
 
 namespace fs = std::filesystem;
 
@@ -25,71 +28,61 @@ std::string RandomString(size_t length) {
 
 const std::string PeerId = "TESTAPPDONTWORRY" + RandomString(4);
 
-bool RunDownloadMultithread(PieceStorage& pieces, const TorrentFile& torrentFile, const std::string& ourId, const TorrentTracker& tracker) {
-    using namespace std::chrono_literals;
-
-    std::vector<std::thread> peerThreads;
-    std::vector<std::shared_ptr<PeerConnect>> peerConnections;
-
-    for (const Peer& peer : tracker.GetPeers()) {
-        peerConnections.emplace_back(std::make_shared<PeerConnect>(peer, torrentFile, ourId, pieces));
-    }
-
-    peerThreads.reserve(peerConnections.size());
-
-    for (auto& peerConnectPtr : peerConnections) {
-        peerThreads.emplace_back(
-                [peerConnectPtr] () {
-                    bool tryAgain = true;
-                    int attempts = 0;
-                    do {
-                        try {
-                            ++attempts;
-                            peerConnectPtr->Run();
-                        } catch (const std::runtime_error& e) {
-                            std::lock_guard<std::mutex> cerrLock(cerrMutex);
-                            std::cerr << "Runtime error: " << e.what() << std::endl;
-                        } catch (const std::exception& e) {
-                            std::lock_guard<std::mutex> cerrLock(cerrMutex);
-                            std::cerr << "Exception: " << e.what() << std::endl;
-                        } catch (...) {
-                            std::lock_guard<std::mutex> cerrLock(cerrMutex);
-                            std::cerr << "Unknown error" << std::endl;
-                        }
-                        tryAgain = peerConnectPtr->Failed() && attempts < 3;
-                    } while (tryAgain);
-                }
-        );
-    }
-
-    for (std::thread& thread : peerThreads) {
-        thread.join();
-    }
-
-    return false;
-}
-
-void DownloadTorrentFile(const TorrentFile& torrentFile, PieceStorage& pieces, const std::string& ourId) {
+/*
+ * Настройки загрузки, задаваемые из командной строки
+ */
+struct DownloadOptions {
+    PipelineConfig pipeline;
+    bool resume = false;
+    std::optional<size_t> endgameThreshold;
+    size_t edgePieces = 0;  // столько первых и последних частей скачивается раньше остальных
+    uint64_t memoryBudget = PieceStorage::DEFAULT_MEMORY_BUDGET;
+    PeerManagerConfig peers;
+    std::optional<fs::path> metricsFile;
+    int listenPort = 12345;
+};
+
+void DownloadTorrentFile(const TorrentFile& torrentFile, PieceStorage& pieces, const std::string& ourId, const DownloadOptions& options) {
     std::cout << "Connecting to tracker " << torrentFile.announce << std::endl;
-    TorrentTracker tracker(torrentFile.announce);
-    bool requestMorePeers = false;
-    do {
-        tracker.UpdatePeers(torrentFile, ourId, 12345);
+    PeerManager peerManager(torrentFile, ourId, pieces, options.pipeline, options.peers);
+    TorrentTracker tracker(torrentFile, ourId, options.listenPort);
+    try {
+        peerManager.Listen(options.listenPort);
+    } catch (const std::runtime_error& e) {
+        // без входящих соединений качать все равно можно
+        std::lock_guard<std::mutex> cerrLock(cerrMutex);
+        std::cerr << e.what() << std::endl;
+    }
 
-        if (tracker.GetPeers().empty()) {
-            std::cerr << "No peers found. Cannot download a file" << std::endl;
+    // анонсы продолжаются всю загрузку, новые пиры добавляются к уже открытым соединениям
+    peerManager.SetPeerSource([&tracker] () {
+        return tracker.RequestPeers();
+    });
+    tracker.Start([&pieces] () {
+        TransferStats stats;
+        stats.uploaded = pieces.BytesUploaded();
+        stats.downloaded = pieces.BytesDownloaded();
+        stats.left = pieces.BytesLeft();
+        return stats;
+    }, [&peerManager] (const std::vector<Peer>& peers) {
+        size_t added = peerManager.AddPeers(peers);
+        if (added > 0) {
+            std::lock_guard<std::mutex> coutLock(coutMutex);
+            std::cout << "Found " << added << " new peers" << std::endl;
         }
+        return added;
+    });
 
-        std::cout << "Found " << tracker.GetPeers().size() << " peers" << std::endl;
-        for (const Peer& peer : tracker.GetPeers()) {
-            std::cout << "Found peer " << peer.ip << ":" << peer.port << std::endl;
-        }
+    peerManager.Run();
+    tracker.Stop();
 
-        requestMorePeers = RunDownloadMultithread(pieces, torrentFile, ourId, tracker);
-    } while (requestMorePeers);
+    if (!pieces.DownloadComplete()) {
+        std::lock_guard<std::mutex> cerrLock(cerrMutex);
+        std::cerr << "No more peers to download from" << std::endl;
+    }
 }
 
-void TestTorrentFile(const fs::path& file, const fs::path& outputDirectory, int percent) {
+void TestTorrentFile(const fs::path& file, const fs::path& outputDirectory, int percent, const DownloadOptions& options) {
     TorrentFile torrentFile;
     try {
         torrentFile = LoadTorrentFile(file);
@@ -99,24 +92,100 @@ void TestTorrentFile(const fs::path& file, const fs::path& outputDirectory, int
         return;
     }
 
+    std::optional<MetricsFileWriter> metricsWriter;
+    if (options.metricsFile) {
+        metricsWriter.emplace(MetricsRegistry::Global(), *options.metricsFile, std::chrono::seconds(1));
+    }
+
     std::filesystem::create_directories(outputDirectory);
-    PieceStorage pieces(torrentFile, outputDirectory, percent);
+    PieceStorage pieces(torrentFile, outputDirectory, percent, options.resume, options.memoryBudget);
+    if (options.endgameThreshold) {
+        pieces.SetEndgameThreshold(*options.endgameThreshold);
+    }
+    // начало и конец файла нужны, например, чтобы открыть видео до окончания загрузки
+    size_t edgePieces = std::min(options.edgePieces, pieces.TotalPiecesCount());
+    for (size_t i = 0; i < edgePieces; ++i) {
+        pieces.SetPiecePriority(i, 1);
+        pieces.SetPiecePriority(pieces.TotalPiecesCount() - 1 - i, 1);
+    }
+
+    DownloadTorrentFile(torrentFile, pieces, PeerId, options);
+    pieces.CloseOutputFile();
 
-    DownloadTorrentFile(torrentFile, pieces, PeerId);
+    HashStats hashStats = pieces.GetHashStats();
+    std::cout << "Verified " << hashStats.piecesVerified << " pieces, " << hashStats.piecesFailed << " failed hash check, "
+              << "verification throughput " << hashStats.Throughput() << " GB/s per thread" << std::endl;
+    EndgameStats endgameStats = pieces.GetEndgameStats();
+    std::cout << "Endgame: " << endgameStats.duplicateBytes << " duplicate bytes received, "
+              << endgameStats.cancelsSent << " requests cancelled" << std::endl;
 
     // CheckDownloadedPiecesIntegrity(outputDirectory / torrentFile.name, torrentFile, pieces);
 
 }
 
+const char* Usage = "Usage: ./torrent-client-prototype -d <output_dir> -p <percent> [options] <.torrent file>\n"
+                    "Options:\n"
+                    "  -w <blocks>   max outstanding block requests per peer\n"
+                    "  -r            resume: keep pieces already downloaded to <output_dir>\n"
+                    "  -f <pieces>   download this many first and last pieces before the rest\n"
+                    "  -e <pieces>   enter endgame when this many pieces are left in progress, 0 disables endgame\n"
+                    "  -c <peers>    max simultaneous peer connections, the slowest peer is periodically replaced\n"
+                    "  -b <MiB>      memory for pieces being downloaded, verified or written (default 512)\n"
+                    "  -m <file>     write metrics in Prometheus text format to <file> every second\n"
+                    "  -u <slots>    how many peers may download from us at once, 0 disables uploading\n"
+                    "  -s <seconds>  keep seeding this long after the download is complete\n"
+                    "  -l <port>     accept incoming peer connections on this port (default 12345)\n";
+
 int main(int argc, char* argv[]) {
-    if (argc != 6 || std::string(argv[1]) != "-d" || std::string(argv[3]) != "-p") {
-        std::cerr << "Usage: ./torrent-client-prototype -d <output_dir> -p <percent> <.torrent file>\n";
+    if (argc < 6 || std::string(argv[1]) != "-d" || std::string(argv[3]) != "-p") {
+        std::cerr << Usage;
         return 1;
     }
 
+    // блоки отдаются через sendfile, у которого нет MSG_NOSIGNAL: разрыв соединения должен приходить ошибкой EPIPE
+    std::signal(SIGPIPE, SIG_IGN);
+
     std::string outputDir = argv[2];
     std::string percentStr = argv[4];
-    std::string torrentPathStr = argv[5];
+    std::string torrentPathStr = argv[argc - 1];
+
+    DownloadOptions options;
+    for (int i = 5; i + 1 < argc; ++i) {
+        std::string flag = argv[i];
+        if (flag == "-r") {
+            options.resume = true;
+            continue;
+        }
+        if (i + 2 >= argc) {
+            std::cerr << Usage;
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (flag == "-w") {
+            options.pipeline.maxWindow = std::max<size_t>(std::stoul(value), 1);
+            options.pipeline.minWindow = std::min(options.pipeline.minWindow, options.pipeline.maxWindow);
+            options.pipeline.initialWindow = std::min(options.pipeline.initialWindow, options.pipeline.maxWindow);
+        } else if (flag == "-f") {
+            options.edgePieces = std::stoul(value);
+        } else if (flag == "-e") {
+            options.endgameThreshold = std::stoul(value);
+        } else if (flag == "-b") {
+            options.memoryBudget = std::max<uint64_t>(std::stoull(value), 1) << 20;
+        } else if (flag == "-m") {
+            options.metricsFile = value;
+        } else if (flag == "-c") {
+            options.peers.maxConnections = std::max<size_t>(std::stoul(value), 1);
+        } else if (flag == "-u") {
+            options.peers.uploadSlots = std::stoul(value);
+        } else if (flag == "-s") {
+            options.peers.seedTime = std::chrono::seconds(std::stoul(value));
+        } else if (flag == "-l") {
+            options.listenPort = std::stoi(value);
+        } else {
+            std::cerr << Usage;
+            return 1;
+        }
+    }
 
     int percent = std::stoi(percentStr);
     if (percent < 1 || percent > 100) {
@@ -130,6 +199,6 @@ int main(int argc, char* argv[]) {
     }
 
     std::filesystem::path outputDirPath(outputDir), torrentPath(torrentPathStr);
-    TestTorrentFile(torrentPath, outputDirPath);
+    TestTorrentFile(torrentPath, outputDirPath, percent, options);
     return 0;
 }
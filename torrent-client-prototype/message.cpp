@@ -5,11 +5,16 @@
 #include <stdexcept>
 
 Message Message::Parse(const std::string& messageString) {
+    auto view = MessageView::Parse(messageString);
+    return Message{view.id, view.messageLength, std::string(view.payload)};
+}
+
+MessageView MessageView::Parse(std::string_view messageString) {
 
     size_t length = messageString.size();
 
     if (length == 0) {
-        return Message{MessageId::KeepAlive, 0, ""};
+        return MessageView{MessageId::KeepAlive, 0, {}};
     }
 
     uint8_t idByte = static_cast<uint8_t>(messageString[0]);
@@ -18,9 +23,7 @@ Message Message::Parse(const std::string& messageString) {
     }
 
     MessageId id = static_cast<MessageId>(idByte);
-    std::string payload = messageString.substr(1);
-
-    return Message{id, length, payload};
+    return MessageView{id, length, messageString.substr(1)};
 }
 
 Message Message::Init(MessageId id, const std::string& payload) {
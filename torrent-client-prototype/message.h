@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
 
 /*
 https://wiki.theory.org/BitTorrentSpecification#Messages
@@ -34,3 +35,18 @@ struct Message {
 
     std::string ToString() const;
 };
+
+/*
+ * Сообщение, payload которого указывает в буфер приема соединения.
+ * Действительно, пока данные не удалены из буфера
+ */
+struct MessageView {
+    MessageId id;
+    size_t messageLength;
+    std::string_view payload;
+
+    /*
+        сообщение без первых 4 байт длины
+    */
+    static MessageView Parse(std::string_view messageString);
+};
@@ -0,0 +1,260 @@
+#include "metrics.h"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+constexpr double LATENCY_MIN_BOUND = 1e-4;
+constexpr size_t LATENCY_BUCKETS = 21;
+
+std::atomic<size_t> nextShard(0);
+
+size_t ThreadShard() {
+    thread_local const size_t shard = nextShard++;
+    return shard;
+}
+
+std::string EscapeLabelValue(const std::string& value) {
+    std::string result;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            result.push_back('\\');
+            result.push_back(c);
+        } else if (c == '\n') {
+            result += "\\n";
+        } else {
+            result.push_back(c);
+        }
+    }
+    return result;
+}
+
+/*
+ * Метки в виде k1="v1",k2="v2" без фигурных скобок
+ */
+std::string FormatLabels(const MetricLabels& labels) {
+    std::string result;
+    for (const auto& [name, value] : labels) {
+        if (!result.empty()) {
+            result.push_back(',');
+        }
+        result += name + "=\"" + EscapeLabelValue(value) + "\"";
+    }
+    return result;
+}
+
+std::string WithBraces(const std::string& labels) {
+    return labels.empty() ? "" : "{" + labels + "}";
+}
+
+std::string FormatValue(double value) {
+    std::ostringstream out;
+    out << std::setprecision(10) << value;
+    return out.str();
+}
+}
+
+void Counter::Add(uint64_t delta) {
+    cells_[ThreadShard() % SHARDS].value.fetch_add(delta, std::memory_order_relaxed);
+}
+
+uint64_t Counter::Value() const {
+    uint64_t result = 0;
+    for (const Cell& cell : cells_) {
+        result += cell.value.load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+void Gauge::Set(int64_t value) {
+    value_.store(value, std::memory_order_relaxed);
+}
+
+void Gauge::Add(int64_t delta) {
+    value_.fetch_add(delta, std::memory_order_relaxed);
+}
+
+int64_t Gauge::Value() const {
+    return value_.load(std::memory_order_relaxed);
+}
+
+Histogram::Histogram(std::vector<double> bounds) :
+        bounds_(std::move(bounds)),
+        buckets_(new std::atomic<uint64_t>[bounds_.size() + 1]),
+        count_(0),
+        sum_(0) {
+    if (!std::is_sorted(bounds_.begin(), bounds_.end())) {
+        throw std::invalid_argument("<Histogram> bounds must be sorted");
+    }
+    for (size_t i = 0; i <= bounds_.size(); ++i) {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::Observe(double value) {
+    size_t bucket = std::lower_bound(bounds_.begin(), bounds_.end(), value) - bounds_.begin();
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    double sum = sum_.load(std::memory_order_relaxed);
+    while (!sum_.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed)) {
+    }
+}
+
+std::vector<double> Histogram::LatencyBounds() {
+    std::vector<double> bounds;
+    double bound = LATENCY_MIN_BOUND;
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+        bounds.push_back(bound);
+        bound *= 2;
+    }
+    return bounds;
+}
+
+const std::vector<double>& Histogram::Bounds() const {
+    return bounds_;
+}
+
+std::vector<uint64_t> Histogram::BucketCounts() const {
+    std::vector<uint64_t> result(bounds_.size() + 1);
+    for (size_t i = 0; i < result.size(); ++i) {
+        result[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+uint64_t Histogram::Count() const {
+    return count_.load(std::memory_order_relaxed);
+}
+
+double Histogram::Sum() const {
+    return sum_.load(std::memory_order_relaxed);
+}
+
+MetricsRegistry& MetricsRegistry::Global() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsRegistry::Family& MetricsRegistry::GetFamily(const std::string& name, const std::string& help, Type type) {
+    auto [it, inserted] = families_.try_emplace(name);
+    if (inserted) {
+        it->second.type = type;
+        it->second.help = help;
+    } else if (it->second.type != type) {
+        throw std::invalid_argument("<MetricsRegistry> metric " + name + " is already registered with another type");
+    }
+    return it->second;
+}
+
+Counter& MetricsRegistry::GetCounter(const std::string& name, const std::string& help, const MetricLabels& labels) {
+    std::lock_guard lock(mtx_);
+    auto& metric = GetFamily(name, help, Type::Counter).counters[FormatLabels(labels)];
+    if (!metric) {
+        metric = std::make_unique<Counter>();
+    }
+    return *metric;
+}
+
+Gauge& MetricsRegistry::GetGauge(const std::string& name, const std::string& help, const MetricLabels& labels) {
+    std::lock_guard lock(mtx_);
+    auto& metric = GetFamily(name, help, Type::Gauge).gauges[FormatLabels(labels)];
+    if (!metric) {
+        metric = std::make_unique<Gauge>();
+    }
+    return *metric;
+}
+
+Histogram& MetricsRegistry::GetHistogram(const std::string& name, const std::string& help, const std::vector<double>& bounds,
+                                         const MetricLabels& labels) {
+    std::lock_guard lock(mtx_);
+    auto& metric = GetFamily(name, help, Type::Histogram).histograms[FormatLabels(labels)];
+    if (!metric) {
+        metric = std::make_unique<Histogram>(bounds);
+    }
+    return *metric;
+}
+
+std::string MetricsRegistry::Render() const {
+    std::lock_guard lock(mtx_);
+    std::ostringstream out;
+    for (const auto& [name, family] : families_) {
+        out << "# HELP " << name << " " << family.help << "\n";
+        switch (family.type) {
+            case Type::Counter:
+                out << "# TYPE " << name << " counter\n";
+                for (const auto& [labels, counter] : family.counters) {
+                    out << name << WithBraces(labels) << " " << counter->Value() << "\n";
+                }
+                break;
+            case Type::Gauge:
+                out << "# TYPE " << name << " gauge\n";
+                for (const auto& [labels, gauge] : family.gauges) {
+                    out << name << WithBraces(labels) << " " << gauge->Value() << "\n";
+                }
+                break;
+            case Type::Histogram:
+                out << "# TYPE " << name << " histogram\n";
+                for (const auto& [labels, histogram] : family.histograms) {
+                    std::string prefix = labels.empty() ? "" : labels + ",";
+                    std::vector<uint64_t> buckets = histogram->BucketCounts();
+                    uint64_t cumulative = 0;
+                    for (size_t i = 0; i < buckets.size(); ++i) {
+                        cumulative += buckets[i];
+                        std::string bound = i < histogram->Bounds().size() ? FormatValue(histogram->Bounds()[i]) : "+Inf";
+                        out << name << "_bucket{" << prefix << "le=\"" << bound << "\"} " << cumulative << "\n";
+                    }
+                    out << name << "_sum" << WithBraces(labels) << " " << FormatValue(histogram->Sum()) << "\n";
+                    out << name << "_count" << WithBraces(labels) << " " << cumulative << "\n";
+                }
+                break;
+        }
+    }
+    return out.str();
+}
+
+MetricsFileWriter::MetricsFileWriter(const MetricsRegistry& registry, std::filesystem::path path, std::chrono::milliseconds interval) :
+        registry_(registry),
+        path_(std::move(path)),
+        interval_(interval),
+        stopped_(false),
+        thread_([this] () { Run(); }) {
+}
+
+MetricsFileWriter::~MetricsFileWriter() {
+    {
+        std::lock_guard lock(mtx_);
+        stopped_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+    Write();
+}
+
+void MetricsFileWriter::Run() {
+    std::unique_lock lock(mtx_);
+    while (!cv_.wait_for(lock, interval_, [this] () { return stopped_; })) {
+        Write();
+    }
+}
+
+void MetricsFileWriter::Write() const {
+    // читатель файла никогда не видит наполовину записанные метрики
+    std::filesystem::path tmpPath = path_;
+    tmpPath += ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::trunc);
+        out << registry_.Render();
+        if (!out) {
+            std::cerr << "<MetricsFileWriter> can't write " << tmpPath << std::endl;
+            return;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(tmpPath, path_, error);
+    if (error) {
+        std::cerr << "<MetricsFileWriter> can't rename " << tmpPath << ": " << error.message() << std::endl;
+    }
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+/*
+ * Монотонный счетчик. Значение разложено по нескольким ячейкам на отдельных кеш-линиях,
+ * каждый поток увеличивает свою ячейку, поэтому частые Add из потоков сети не конкурируют за одну линию
+ */
+class Counter {
+public:
+    void Add(uint64_t delta = 1);
+
+    uint64_t Value() const;
+
+private:
+    static constexpr size_t SHARDS = 16;
+
+    struct alignas(64) Cell {
+        std::atomic<uint64_t> value{0};
+    };
+
+    std::array<Cell, SHARDS> cells_;
+};
+
+/*
+ * Текущее значение, например, глубина очереди
+ */
+class Gauge {
+public:
+    void Set(int64_t value);
+
+    void Add(int64_t delta);
+
+    int64_t Value() const;
+
+private:
+    std::atomic<int64_t> value_{0};
+};
+
+/*
+ * Гистограмма с фиксированными границами корзин, запись без блокировок
+ */
+class Histogram {
+public:
+    /*
+     * bounds -- верхние границы корзин по возрастанию, корзина +Inf добавляется автоматически
+     */
+    explicit Histogram(std::vector<double> bounds);
+
+    void Observe(double value);
+
+    template <class Rep, class Period>
+    void Observe(std::chrono::duration<Rep, Period> duration) {
+        Observe(std::chrono::duration<double>(duration).count());
+    }
+
+    /*
+     * Границы от 100 мкс до ~100 с с шагом в два раза, для задержек в секундах
+     */
+    static std::vector<double> LatencyBounds();
+
+    const std::vector<double>& Bounds() const;
+
+    /*
+     * Количество значений в каждой корзине (не накопительно), последняя -- +Inf
+     */
+    std::vector<uint64_t> BucketCounts() const;
+
+    uint64_t Count() const;
+
+    double Sum() const;
+
+private:
+    const std::vector<double> bounds_;
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+    std::atomic<uint64_t> count_;
+    std::atomic<double> sum_;
+};
+
+/*
+ * Набор именованных метрик процесса. Метрика создается при первом обращении и живет до конца программы,
+ * поэтому ссылку на нее можно получить один раз и дальше обновлять без обращений к реестру
+ */
+class MetricsRegistry {
+public:
+    static MetricsRegistry& Global();
+
+    /*
+     * При повторной регистрации имени с другим типом бросает std::invalid_argument
+     */
+    Counter& GetCounter(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+
+    Gauge& GetGauge(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+
+    Histogram& GetHistogram(const std::string& name, const std::string& help, const std::vector<double>& bounds,
+                            const MetricLabels& labels = {});
+
+    /*
+     * Все метрики в текстовом формате Prometheus
+     */
+    std::string Render() const;
+
+private:
+    enum class Type {
+        Counter,
+        Gauge,
+        Histogram,
+    };
+
+    struct Family {
+        Type type;
+        std::string help;
+        std::map<std::string, std::unique_ptr<Counter>> counters;  // по отформатированным меткам
+        std::map<std::string, std::unique_ptr<Gauge>> gauges;
+        std::map<std::string, std::unique_ptr<Histogram>> histograms;
+    };
+
+    mutable std::mutex mtx_;
+    std::map<std::string, Family> families_;
+
+    Family& GetFamily(const std::string& name, const std::string& help, Type type);
+};
+
+/*
+ * Периодически записывает метрики реестра в файл (запись во временный файл и переименование),
+ * например, для textfile collector node_exporter. При уничтожении записывает итоговые значения
+ */
+class MetricsFileWriter {
+public:
+    MetricsFileWriter(const MetricsRegistry& registry, std::filesystem::path path, std::chrono::milliseconds interval);
+    ~MetricsFileWriter();
+
+    MetricsFileWriter(const MetricsFileWriter&) = delete;
+    MetricsFileWriter& operator=(const MetricsFileWriter&) = delete;
+
+private:
+    const MetricsRegistry& registry_;
+    const std::filesystem::path path_;
+    const std::chrono::milliseconds interval_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stopped_;
+    std::thread thread_;
+
+    void Run();
+
+    void Write() const;
+};
@@ -0,0 +1,554 @@
+#include "bencode.h"
+#include "bitfield.h"
+#include "byte_tools.h"
+#include "message.h"
+#include "peer_pieces_availability.h"
+#include "piece.h"
+#include "piece_buffer_pool.h"
+#include "piece_picker.h"
+#include "piece_storage.h"
+#include "torrent_file.h"
+#include <unistd.h>
+#include <openssl/sha.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Микробенчмарки горячих операций: разбор bencode и сообщений протокола, преобразование чисел,
+ * операции над битовыми полями частей, сохранение и хеширование блоков части и выдача частей из PieceStorage
+ * под конкуренцией потоков. Результаты печатаются в JSON, чтобы сравнивать их между коммитами
+ */
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+constexpr size_t REPETITIONS = 5;
+constexpr size_t BLOCK_SIZE = 1 << 14;
+constexpr size_t METAINFO_PIECES = 8192;
+constexpr size_t METAINFO_FILES = 512;
+constexpr size_t BITFIELD_PIECES = 1 << 20;
+constexpr size_t PICKER_PIECES = 500000;
+constexpr size_t PIECE_LENGTH = 1 << 18;
+constexpr size_t STORAGE_PIECES = 16384;  // 16 сегментов очереди PieceStorage
+constexpr size_t STORAGE_PIECE_LENGTH = 1 << 14;  // буферов в пуле хватает на все части
+constexpr size_t TINY_BUDGET_PIECES = 64;  // по части на поток при самом большом числе потоков
+
+template <class T>
+void DoNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct BenchmarkResult {
+    std::string name;
+    size_t threads;
+    uint64_t iterations;
+    double nsPerOp;  // медиана по повторам
+    double bytesPerOp;
+};
+
+struct BenchmarkOptions {
+    std::chrono::milliseconds minTime{200};
+    std::string filter;
+    fs::path output;
+};
+
+/*
+ * Операция повторяется пачками, пока не наберется minTime, измерение повторяется REPETITIONS раз,
+ * в результат идет медианное время одной операции
+ */
+class BenchmarkRunner {
+public:
+    explicit BenchmarkRunner(BenchmarkOptions options) : options_(std::move(options)) {}
+
+    bool Enabled(const std::string& name) const {
+        return name.find(options_.filter) != std::string::npos;
+    }
+
+    void Run(const std::string& name, double bytesPerOp, const std::function<void()>& op) {
+        if (!Enabled(name)) return;
+        for (int i = 0; i < 16; ++i) op();
+
+        uint64_t batch = 1;
+        std::vector<double> samples;
+        uint64_t iterations = 0;
+        while (samples.size() < REPETITIONS) {
+            auto start = Clock::now();
+            for (uint64_t i = 0; i < batch; ++i) op();
+            auto elapsed = Clock::now() - start;
+            if (elapsed < options_.minTime / REPETITIONS) {
+                batch *= 2;
+                continue;
+            }
+            samples.push_back(std::chrono::duration<double, std::nano>(elapsed).count() / batch);
+            iterations += batch;
+        }
+        Report(BenchmarkResult{name, 1, iterations, Median(samples), bytesPerOp});
+    }
+
+    /*
+     * threads потоков одновременно выполняют op(threadIndex) в течение minTime,
+     * время операции -- общее время, деленное на суммарное количество операций
+     */
+    void RunContended(const std::string& name, size_t threads, const std::function<void(size_t)>& op) {
+        if (!Enabled(name)) return;
+        std::vector<double> samples;
+        uint64_t iterations = 0;
+        for (size_t repetition = 0; repetition < REPETITIONS; ++repetition) {
+            std::atomic<bool> start(false), stop(false);
+            std::atomic<uint64_t> total(0);
+            std::vector<std::thread> workers;
+            for (size_t t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] () {
+                    while (!start) std::this_thread::yield();
+                    uint64_t count = 0;
+                    while (!stop) {
+                        op(t);
+                        ++count;
+                    }
+                    total += count;
+                });
+            }
+            auto begin = Clock::now();
+            start = true;
+            std::this_thread::sleep_for(options_.minTime / REPETITIONS);
+            stop = true;
+            for (auto& worker : workers) worker.join();
+            auto elapsed = Clock::now() - begin;
+            samples.push_back(std::chrono::duration<double, std::nano>(elapsed).count() / std::max<uint64_t>(total, 1));
+            iterations += total;
+        }
+        Report(BenchmarkResult{name, threads, iterations, Median(samples), 0});
+    }
+
+    void WriteJson(std::ostream& out) const {
+        out << "{\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results_.size(); ++i) {
+            const auto& result = results_[i];
+            out << (i ? "," : "") << "\n    {\"name\": \"" << result.name << "\", \"threads\": " << result.threads
+                << ", \"iterations\": " << result.iterations << std::fixed << std::setprecision(3)
+                << ", \"ns_per_op\": " << result.nsPerOp
+                << ", \"ops_per_second\": " << 1e9 / result.nsPerOp;
+            if (result.bytesPerOp > 0) {
+                out << ", \"mb_per_second\": " << result.bytesPerOp / result.nsPerOp * 1e3;
+            }
+            out << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    const BenchmarkOptions options_;
+    std::vector<BenchmarkResult> results_;
+
+    static double Median(std::vector<double> samples) {
+        std::sort(samples.begin(), samples.end());
+        return samples[samples.size() / 2];
+    }
+
+    void Report(BenchmarkResult result) {
+        // ход выполнения в stderr, JSON -- в stdout или файл
+        std::cerr << std::left << std::setw(40) << result.name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(14) << result.nsPerOp << " ns/op" << std::endl;
+        results_.push_back(std::move(result));
+    }
+};
+
+/*
+ * Загрузка .torrent и конструктор хранилища пишут ход работы в stdout, где должен остаться только JSON
+ */
+class SilenceStdout {
+public:
+    SilenceStdout() : saved_(std::cout.rdbuf(&sink_)) {}
+
+    ~SilenceStdout() {
+        std::cout.rdbuf(saved_);
+    }
+
+private:
+    struct NullBuffer : std::streambuf {
+        int overflow(int c) override {
+            return c;
+        }
+    };
+
+    NullBuffer sink_;
+    std::streambuf* saved_;
+};
+
+std::string BencodeString(std::string_view value) {
+    return std::to_string(value.size()) + ":" + std::string(value);
+}
+
+std::string RandomBytes(size_t size, std::mt19937_64& random) {
+    std::string result(size, '\0');
+    for (char& c : result) {
+        c = static_cast<char>(random());
+    }
+    return result;
+}
+
+/*
+ * Метаинформация, похожая на реальную многофайловую раздачу: список трекеров, сотни файлов, тысячи хешей
+ */
+std::string MakeMetainfo(std::mt19937_64& random) {
+    std::ostringstream files;
+    for (size_t i = 0; i < METAINFO_FILES; ++i) {
+        size_t length = (METAINFO_PIECES * PIECE_LENGTH) / METAINFO_FILES;
+        files << "d6:lengthi" << length << "e4:pathl" << BencodeString("disc" + std::to_string(i % 4))
+              << BencodeString("track " + std::to_string(i) + ".flac") << "ee";
+    }
+    std::string info = "d5:filesl" + files.str() + "e4:name" + BencodeString("Benchmark Collection") +
+                       "12:piece lengthi" + std::to_string(PIECE_LENGTH) + "e6:pieces" +
+                       BencodeString(RandomBytes(METAINFO_PIECES * PieceHashes::HASH_SIZE, random)) + "e";
+    std::string announceList = "l";
+    for (size_t i = 0; i < 8; ++i) {
+        announceList += "l" + BencodeString("http://tracker" + std::to_string(i) + ".example.org:6969/announce") + "e";
+    }
+    announceList += "e";
+    return "d8:announce" + BencodeString("http://tracker0.example.org:6969/announce") + "13:announce-list" + announceList +
+           "7:comment" + BencodeString("micro benchmark") + "13:creation datei1700000000e4:info" + info + "e";
+}
+
+std::string MakeSingleFileMetainfo(size_t piecesCount, size_t pieceLength, std::mt19937_64& random) {
+    std::string info = "d6:lengthi" + std::to_string(piecesCount * pieceLength) + "e4:name" + BencodeString("payload.bin") +
+                       "12:piece lengthi" + std::to_string(pieceLength) + "e6:pieces" +
+                       BencodeString(RandomBytes(piecesCount * PieceHashes::HASH_SIZE, random)) + "e";
+    return "d8:announce" + BencodeString("http://127.0.0.1/announce") + "4:info" + info + "e";
+}
+
+void WriteFile(const fs::path& path, const std::string& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << data;
+}
+
+void BenchmarkBencode(BenchmarkRunner& runner, const fs::path& workDir, std::mt19937_64& random) {
+    std::string metainfo = MakeMetainfo(random);
+    runner.Run("bencode/parse_metainfo", metainfo.size(), [&] () {
+        Bencode::Document document(metainfo);
+        DoNotOptimize(document.Root().size);
+    });
+    runner.Run("bencode/parse_and_hash_info", metainfo.size(), [&] () {
+        Bencode::Document document(metainfo);
+        std::string infoHash = Bencode::sha1_raw(document.Root().At("info").raw);
+        DoNotOptimize(infoHash);
+    });
+
+    fs::path torrentPath = workDir / "metainfo.torrent";
+    WriteFile(torrentPath, metainfo);
+    SilenceStdout silence;
+    runner.Run("torrent_file/load", metainfo.size(), [&] () {
+        TorrentFile torrentFile = LoadTorrentFile(torrentPath);
+        DoNotOptimize(torrentFile.pieceHashes.size());
+    });
+}
+
+void BenchmarkMessages(BenchmarkRunner& runner) {
+    std::string request = IntToBytes(7) + IntToBytes(3 * BLOCK_SIZE) + IntToBytes(BLOCK_SIZE);
+    std::string block = std::string(1, static_cast<char>(MessageId::Piece)) + IntToBytes(7) + IntToBytes(0) + std::string(BLOCK_SIZE, 'x');
+    std::string have = std::string(1, static_cast<char>(MessageId::Have)) + IntToBytes(12345);
+
+    runner.Run("message/parse_view_piece", 0, [&] () {
+        MessageView message = MessageView::Parse(block);
+        DoNotOptimize(message.payload.size());
+    });
+    runner.Run("message/parse_have", 0, [&] () {
+        Message message = Message::Parse(have);
+        DoNotOptimize(message.payload.size());
+    });
+    runner.Run("message/parse_piece_copy", block.size(), [&] () {
+        Message message = Message::Parse(block);
+        DoNotOptimize(message.payload.size());
+    });
+    runner.Run("message/request_to_string", 0, [&] () {
+        std::string data = Message::Init(MessageId::Request, request).ToString();
+        DoNotOptimize(data.size());
+    });
+
+    std::string bytes = IntToBytes(0x12345678);
+    int value = 0x1234;
+    runner.Run("bytes/bytes_to_int", 0, [&] () {
+        DoNotOptimize(BytesToInt(bytes));
+    });
+    runner.Run("bytes/int_to_bytes", 0, [&] () {
+        std::string result = IntToBytes(++value);
+        DoNotOptimize(result);
+    });
+}
+
+void BenchmarkAvailability(BenchmarkRunner& runner, std::mt19937_64& random) {
+    PeerPiecesAvailability availability(RandomBytes(BITFIELD_PIECES / 8, random), BITFIELD_PIECES);
+    std::vector<uint32_t> indices(1 << 16);
+    for (auto& index : indices) {
+        index = random() % BITFIELD_PIECES;
+    }
+    size_t position = 0;
+    runner.Run("availability/is_piece_available_random", 0, [&] () {
+        DoNotOptimize(availability.IsPieceAvailable(indices[position++ & (indices.size() - 1)]));
+    });
+    runner.Run("availability/count_available_1m", BITFIELD_PIECES / 8, [&] () {
+        size_t count = 0;
+        for (size_t i = 0; i < BITFIELD_PIECES; ++i) {
+            count += availability.IsPieceAvailable(i);
+        }
+        DoNotOptimize(count);
+    });
+}
+
+/*
+ * Операции над полями из 500k частей: у пира половина частей, нам нужны только последние,
+ * которых у пира нет, поэтому пересечение пустое и проходится целиком
+ */
+void BenchmarkBitfield(BenchmarkRunner& runner, std::mt19937_64& random) {
+    Bitfield peer = Bitfield::FromBytes(RandomBytes((PICKER_PIECES + 7) / 8, random), PICKER_PIECES);
+    Bitfield wanted(PICKER_PIECES);
+    for (size_t i = PICKER_PIECES - 64; i < PICKER_PIECES; ++i) {
+        if (!peer.Test(i)) wanted.Set(i);
+    }
+    std::string prefix = std::string("bitfield/") + Bitfield::Implementation() + "/";
+    runner.Run(prefix + "intersect_any_500k", PICKER_PIECES / 8, [&] () {
+        DoNotOptimize(Bitfield::IntersectAny(peer, wanted));
+    });
+    runner.Run(prefix + "difference_any_500k", PICKER_PIECES / 8, [&] () {
+        DoNotOptimize(Bitfield::DifferenceAny(wanted, peer));
+    });
+    runner.Run(prefix + "intersect_count_500k", PICKER_PIECES / 8, [&] () {
+        DoNotOptimize(Bitfield::IntersectCount(peer, peer));
+    });
+    runner.Run(prefix + "find_first_common_500k", PICKER_PIECES / 8, [&] () {
+        DoNotOptimize(Bitfield::FindFirstCommon(peer, wanted));
+    });
+    runner.Run(prefix + "from_bytes_500k", PICKER_PIECES / 8, [&] () {
+        DoNotOptimize(Bitfield::FromBytes(peer.ToBytes(), PICKER_PIECES).Size());
+    });
+}
+
+/*
+ * Выбор части для пира, у которого всего несколько нужных нам частей из 500k
+ */
+void BenchmarkPicker(BenchmarkRunner& runner, std::mt19937_64& random) {
+    PiecePicker picker(PICKER_PIECES);
+    for (size_t i = 0; i < PICKER_PIECES; ++i) {
+        picker.AddWanted(i);
+    }
+    PeerPiecesAvailability seed(std::string(PICKER_PIECES / 8, '\xff'), PICKER_PIECES);
+    PeerPiecesAvailability sparse(PICKER_PIECES);
+    for (size_t i = 0; i < 16; ++i) {
+        sparse.SetPieceAvailability(random() % PICKER_PIECES);
+    }
+    PeerPiecesAvailability empty(PICKER_PIECES);
+    picker.PeerConnected(seed);
+    picker.PeerConnected(sparse);
+
+    runner.Run("picker/pick_return_seed_500k", 0, [&] () {
+        auto pieceIndex = picker.Pick(seed);
+        picker.Return(*pieceIndex);
+    });
+    runner.Run("picker/pick_return_sparse_peer_500k", 0, [&] () {
+        auto pieceIndex = picker.Pick(sparse);
+        picker.Return(*pieceIndex);
+    });
+    runner.Run("picker/pick_nothing_wanted_500k", 0, [&] () {
+        DoNotOptimize(picker.Pick(empty).has_value());
+    });
+    runner.Run("picker/peer_connected_seed_500k", 0, [&] () {
+        picker.PeerConnected(seed);
+        picker.PeerDisconnected(seed);
+    });
+
+    // части с приоритетом выдаются по убыванию приоритета раньше любых других, даже более редких
+    PiecePicker priorityPicker(PICKER_PIECES);
+    for (size_t i = 0; i < PICKER_PIECES; ++i) {
+        priorityPicker.AddWanted(i);
+    }
+    priorityPicker.PeerConnected(seed);
+    priorityPicker.PeerConnected(seed);
+    priorityPicker.PeerConnected(sparse);
+    const std::vector<std::pair<size_t, int>> priorities = {{PICKER_PIECES - 1, 1}, {0, 3}, {PICKER_PIECES / 2, 2}};
+    for (const auto& [pieceIndex, priority] : priorities) {
+        priorityPicker.SetPriority(pieceIndex, priority);
+    }
+    const std::vector<size_t> expected = {0, PICKER_PIECES / 2, PICKER_PIECES - 1};
+    for (size_t pieceIndex : expected) {
+        if (priorityPicker.Pick(seed) != pieceIndex) {
+            throw std::runtime_error("picker: priority pieces are not picked in priority order");
+        }
+    }
+    // дальше -- самые редкие части, то есть те, которых нет у sparse
+    auto rarest = priorityPicker.Pick(seed);
+    if (!rarest || priorityPicker.Availability(*rarest) != 2) {
+        throw std::runtime_error("picker: rarest-first order is broken after priority pieces");
+    }
+    priorityPicker.Return(*rarest);
+    for (size_t pieceIndex : expected) {
+        priorityPicker.Return(pieceIndex);
+    }
+    runner.Run("picker/pick_return_priority_500k", 0, [&] () {
+        auto pieceIndex = priorityPicker.Pick(seed);
+        priorityPicker.Return(*pieceIndex);
+    });
+}
+
+void BenchmarkPiece(BenchmarkRunner& runner, std::mt19937_64& random) {
+    std::string data = RandomBytes(PIECE_LENGTH, random);
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char*>(data.data()), data.size(), hash);
+
+    PieceBufferPool pool(PIECE_LENGTH, 1);
+    Piece piece(0, PIECE_LENGTH, std::string(reinterpret_cast<char*>(hash), SHA_DIGEST_LENGTH));
+    piece.AttachBuffer(pool.Acquire());
+
+    // все блоки части по порядку, вместе с инкрементальным хешированием
+    runner.Run("piece/save_all_blocks", PIECE_LENGTH, [&] () {
+        piece.Reset();
+        for (size_t offset = 0; offset < PIECE_LENGTH; offset += BLOCK_SIZE) {
+            DoNotOptimize(piece.SaveBlock(offset, std::string_view(data).substr(offset, BLOCK_SIZE)));
+        }
+    });
+    runner.Run("piece/get_data", 0, [&] () {
+        DoNotOptimize(piece.GetData().size());
+    });
+    runner.Run("piece/get_data_hash", 0, [&] () {
+        std::string result = piece.GetDataHash();
+        DoNotOptimize(result);
+    });
+    runner.Run("piece/hash_matches", 0, [&] () {
+        DoNotOptimize(piece.HashMatches());
+    });
+}
+
+/*
+ * Выдача части соединению и возврат ее в очередь, как при отключении пира, и проверки, которые соединение
+ * делает на каждом шаге, из нескольких потоков. Выдача с бюджетом памяти на одну часть на поток (как -b 1)
+ * проверяет, что возвращенные части, занимающие весь бюджет, выдаются снова
+ */
+void BenchmarkStorage(BenchmarkRunner& runner, const fs::path& workDir, std::mt19937_64& random) {
+    if (!runner.Enabled("storage/")) return;
+
+    fs::path torrentPath = workDir / "storage.torrent";
+    WriteFile(torrentPath, MakeSingleFileMetainfo(STORAGE_PIECES, STORAGE_PIECE_LENGTH, random));
+    SilenceStdout silence;
+    TorrentFile torrentFile = LoadTorrentFile(torrentPath);
+    PieceStorage storage(torrentFile, workDir / "storage", 100);
+
+    PeerPiecesAvailability availability(std::string(STORAGE_PIECES / 8, '\xff'), STORAGE_PIECES);
+    for (size_t threads : {1, 2, 4, 8, 16, 32, 64}) {
+        for (size_t t = 0; t < threads; ++t) {
+            storage.PeerConnected(availability);
+        }
+        std::vector<std::vector<PiecePtr>> inProgress(threads);
+        runner.RunContended("storage/checkout_return/threads:" + std::to_string(threads), threads, [&] (size_t thread) {
+            LeaseOwner owner = thread + 1;
+            PiecePtr piece = storage.GetNextPieceToDownload(availability, owner);
+            DoNotOptimize(piece.get());
+            inProgress[thread].assign(1, std::move(piece));
+            storage.ReleaseLeases(owner, inProgress[thread]);
+        });
+        runner.RunContended("storage/request_checks/threads:" + std::to_string(threads), threads, [&] (size_t thread) {
+            DoNotOptimize(storage.QueueIsEmpty());
+            DoNotOptimize(storage.InEndgame());
+            DoNotOptimize(storage.DownloadComplete());
+            DoNotOptimize(storage.HoldsLease(thread, thread + 1));
+        });
+        for (size_t t = 0; t < threads; ++t) {
+            storage.PeerDisconnected(availability);
+        }
+    }
+
+    PieceStorage tinyStorage(torrentFile, workDir / "tiny-storage", 100, false, TINY_BUDGET_PIECES * STORAGE_PIECE_LENGTH);
+    tinyStorage.PeerConnected(availability);
+    std::atomic<uint64_t> stalls(0);
+    for (size_t threads : {1, 4, 16, 64}) {
+        std::vector<std::vector<PiecePtr>> inProgress(threads);
+        runner.RunContended("storage/tiny_budget_checkout_return/threads:" + std::to_string(threads), threads, [&] (size_t thread) {
+            LeaseOwner owner = thread + 1;
+            PiecePtr piece = tinyStorage.GetNextPieceToDownload(availability, owner);
+            if (!piece) {
+                // каждый поток держит не больше одной части, бюджета хватает на всех
+                ++stalls;
+                return;
+            }
+            inProgress[thread].assign(1, std::move(piece));
+            tinyStorage.ReleaseLeases(owner, inProgress[thread]);
+        });
+    }
+    if (stalls > 0) {
+        throw std::runtime_error("storage/tiny_budget: " + std::to_string(stalls) + " checkouts failed with returned pieces in the budget");
+    }
+
+    // последняя часть есть у одного пира из двух и лежит в последнем сегменте, далеком от закрепленного
+    // за соединением 1, но все равно выдается первой
+    PieceStorage rareStorage(torrentFile, workDir / "rare-storage", 100);
+    std::string almostAllBytes(STORAGE_PIECES / 8, '\xff');
+    almostAllBytes.back() = '\xfe';
+    rareStorage.PeerConnected(availability);
+    rareStorage.PeerConnected(PeerPiecesAvailability(almostAllBytes, STORAGE_PIECES));
+    PiecePtr rarest = rareStorage.GetNextPieceToDownload(availability, 1);
+    if (!rarest || rarest->GetIndex() != STORAGE_PIECES - 1) {
+        throw std::runtime_error("storage: the rarest piece of another shard was not picked first");
+    }
+}
+
+const char* Usage = "Usage: micro-benchmark [--filter <substring>] [--min-time <ms>] [--out <file.json>]\n";
+}
+
+int main(int argc, char* argv[]) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string flag = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << Usage;
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (flag == "--filter") {
+            options.filter = value;
+        } else if (flag == "--min-time") {
+            options.minTime = std::chrono::milliseconds(std::stoul(value));
+        } else if (flag == "--out") {
+            options.output = value;
+        } else {
+            std::cerr << Usage;
+            return 1;
+        }
+    }
+
+    fs::path workDir = fs::temp_directory_path() / ("micro-benchmark-" + std::to_string(getpid()));
+    fs::create_directories(workDir);
+    BenchmarkRunner runner(options);
+    std::mt19937_64 random(1);
+    try {
+        BenchmarkBencode(runner, workDir, random);
+        BenchmarkMessages(runner);
+        BenchmarkAvailability(runner, random);
+        BenchmarkBitfield(runner, random);
+        BenchmarkPicker(runner, random);
+        BenchmarkPiece(runner, random);
+        BenchmarkStorage(runner, workDir, random);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        fs::remove_all(workDir);
+        return 1;
+    }
+    fs::remove_all(workDir);
+
+    if (options.output.empty()) {
+        runner.WriteJson(std::cout);
+    } else {
+        std::ofstream out(options.output);
+        runner.WriteJson(out);
+    }
+    return 0;
+}
@@ -1,59 +1,167 @@
 #include "byte_tools.h"
 #include "peer_connect.h"
 #include "message.h"
+#include "bitfield.h"
 #include <iostream>
 #include <sstream>
 #include <utility>
 #include <cassert>
-#include <climits>
+#include <algorithm>
+#include <sys/epoll.h>
 
 using namespace std::chrono_literals;
 
-PeerPiecesAvailability::PeerPiecesAvailability() : bitfield_("") {}
+namespace {
+constexpr auto CONNECT_TIMEOUT = 1s;
+constexpr auto READ_TIMEOUT = 10s;
+constexpr auto INBOUND_HANDSHAKE_TIMEOUT = 5s;
+constexpr int MAX_ATTEMPTS = 3;
+constexpr size_t RECEIVE_BUFFER_SIZE = 1 << 16;
+constexpr size_t MAX_READ_PER_EVENT = 1 << 20;
+constexpr size_t MAX_MESSAGE_LENGTH = 1 << 24;
+constexpr size_t MAX_SEND_PER_EVENT = 1 << 20;
+constexpr size_t SEND_BUFFER_RESERVE = 1 << 13;  // запросы на все окно конвейера помещаются без перевыделения
+constexpr size_t BLOCK_MESSAGE_SIZE = 4 + 1 + 12;  // Request и Cancel: длина, id, номер части, смещение, длина блока
+constexpr size_t MAX_REQUEST_LENGTH = 1 << 17;
+constexpr size_t MAX_UPLOAD_QUEUE = 256;
+constexpr auto BLOCK_REQUEST_TIMEOUT = 15s;
+constexpr auto SNUB_TIMEOUT = 10s;
+const std::string PROTOCOL_NAME = "BitTorrent protocol";
+const size_t HANDSHAKE_SIZE = 1 + PROTOCOL_NAME.size() + 8 + 20 + 20;
 
-PeerPiecesAvailability::PeerPiecesAvailability(std::string bitfield) : bitfield_(std::move(bitfield)) {}
+std::atomic<LeaseOwner> nextConnectionId(1);
 
-bool PeerPiecesAvailability::IsPieceAvailable(size_t pieceIndex) const {
-    size_t byteIndex = pieceIndex / CHAR_BIT;
-    int bitOffset = CHAR_BIT - 1 - (pieceIndex % CHAR_BIT);
-    return (bitfield_[byteIndex] & (1 << bitOffset)) != 0;
+Counter& MessagesReceived(MessageId id) {
+    static const std::vector<Counter*> counters = [] () {
+        const char* names[] = {"choke", "unchoke", "interested", "not_interested", "have", "bitfield",
+                               "request", "piece", "cancel", "port", "keep_alive"};
+        std::vector<Counter*> result;
+        for (const char* name : names) {
+            result.push_back(&MetricsRegistry::Global().GetCounter("torrent_messages_received_total",
+                                                                   "Peer wire messages received by type", {{"type", name}}));
+        }
+        return result;
+    }();
+    return *counters[static_cast<size_t>(id)];
+}
+
+Histogram& BlockLatency() {
+    static Histogram& histogram = MetricsRegistry::Global().GetHistogram(
+            "torrent_block_latency_seconds", "Time from sending a block request to receiving the block", Histogram::LatencyBounds());
+    return histogram;
 }
 
-void PeerPiecesAvailability::SetPieceAvailability(size_t pieceIndex) {
-    size_t byteIndex = pieceIndex / CHAR_BIT;
-    int bitOffset = CHAR_BIT - 1 - (pieceIndex % CHAR_BIT);
+size_t PieceLength(const TorrentFile& tf, size_t pieceIndex) {
+    return std::min(tf.pieceLength, tf.length - pieceIndex * tf.pieceLength);
+}
 
-    bitfield_[byteIndex] |= (1 << bitOffset);
+Gauge& PeersConnected() {
+    static Gauge& gauge = MetricsRegistry::Global().GetGauge("torrent_peers_connected", "Connections past the handshake and bitfield");
+    return gauge;
 }
 
-size_t PeerPiecesAvailability::Size() const {
-    return bitfield_.size() * CHAR_BIT;
+Counter& PeersSnubbed() {
+    static Counter& counter = MetricsRegistry::Global().GetCounter("torrent_peer_snubs_total", "Times a peer stopped sending requested blocks");
+    return counter;
+}
 }
 
-PeerConnect::PeerConnect(const Peer& peer, const TorrentFile &tf, std::string selfPeerId, PieceStorage& pieceStorage) : 
+PeerConnect::PeerConnect(const Peer& peer, const TorrentFile &tf, std::string selfPeerId, PieceStorage& pieceStorage,
+                         const PipelineConfig& pipelineConfig) : 
+                                id_(nextConnectionId++),
                                 tf_(tf), 
-                                socket_(peer.ip, peer.port, 1s, 10s), 
+                                socket_(peer.ip, peer.port, CONNECT_TIMEOUT, READ_TIMEOUT), 
                                 selfPeerId_(selfPeerId), 
                                 peerId_(""),
+                                piecesAvailability_(tf.pieceHashes.size()),
                                 terminated_(false),
                                 choked_(true),
-                                pieceInProgress_(nullptr),
                                 pieceStorage_(pieceStorage),
-                                pendingBlock_(false)  {
+                                pipeline_(pipelineConfig),
+                                failed_(false),
+                                finished_(false),
+                                inbound_(false),
+                                reactor_(nullptr),
+                                state_(State::Finished),
+                                attempts_(0),
+                                registeredEvents_(0),
+                                inBuffer_(RECEIVE_BUFFER_SIZE),
+                                snubbed_(false),
+                                bytesDownloaded_(0),
+                                bytesReceived_(MetricsRegistry::Global().GetCounter(
+                                        "torrent_peer_bytes_received_total", "Bytes received from a peer",
+                                        {{"peer", peer.ip + ":" + std::to_string(peer.port)}})),
+                                peerInterested_(false),
+                                amInterested_(false),
+                                amChoking_(true),
+                                uploadSlot_(false),
+                                haveSent_(0),
+                                bytesUploaded_(0),
+                                bytesSent_(MetricsRegistry::Global().GetCounter(
+                                        "torrent_peer_bytes_sent_total", "Block bytes sent to a peer",
+                                        {{"peer", peer.ip + ":" + std::to_string(peer.port)}})) {
+    outBuffer_.reserve(SEND_BUFFER_RESERVE);
 }
 
-void PeerConnect::Run() {
-    while (!terminated_) {
-        if (EstablishConnection()) {
-            std::cout << "Connection established to peer" << std::endl;
-            MainLoop();
-        } else {
-            std::cerr << "Cannot establish connection to peer" << std::endl;
-            Terminate();
-        }
+void PeerConnect::Accept(int socket) {
+    socket_.Attach(socket);
+    inbound_ = true;
+}
+
+void PeerConnect::Start(Reactor& reactor) {
+    reactor_ = &reactor;
+    attempts_ = 0;
+    if (inbound_) {
+        WaitHandshake();
+    } else {
+        Connect();
     }
 }
 
+void PeerConnect::WaitHandshake() {
+    // к входящему соединению не переподключаемся
+    attempts_ = MAX_ATTEMPTS;
+    ResetSession();
+    state_ = State::Handshake;
+    // полуоткрытые входящие соединения занимают места, поэтому ждем handshake недолго
+    deadline_ = std::chrono::steady_clock::now() + INBOUND_HANDSHAKE_TIMEOUT;
+    registeredEvents_ = EPOLLIN;
+    reactor_->Add(socket_.GetSocket(), registeredEvents_, shared_from_this());
+}
+
+void PeerConnect::Connect() {
+    ++attempts_;
+    ResetSession();
+
+    try {
+        socket_.StartConnection();
+    } catch (const std::exception& e) {
+        Fail(e.what());
+        return;
+    }
+    state_ = State::Connecting;
+    deadline_ = std::chrono::steady_clock::now() + CONNECT_TIMEOUT;
+    registeredEvents_ = EPOLLOUT;
+    reactor_->Add(socket_.GetSocket(), registeredEvents_, shared_from_this());
+}
+
+void PeerConnect::ResetSession() {
+    failed_ = false;
+    finished_ = false;
+    choked_ = true;
+    snubbed_ = false;
+    peerInterested_ = false;
+    amInterested_ = false;
+    amChoking_ = true;
+    haveSent_ = 0;
+    uploadQueue_.clear();
+    upload_.reset();
+    ReleasePieces();
+    pipeline_.Reset(std::chrono::steady_clock::now());
+    inBuffer_.Clear();
+    outBuffer_.clear();
+}
+
 std::string PeerConnect::createHandShakeMessage(const std::string& ProtocolName) {
     std::string handshake;
     handshake.push_back(static_cast<char>(ProtocolName.size())); 
@@ -64,7 +172,7 @@ std::string PeerConnect::createHandShakeMessage(const std::string& ProtocolName)
     return handshake;
 }
 
-bool PeerConnect::isCorrectPeerResponse(const std::string& handshake, const std::string& ProtocolName, const std::string& response) {
+bool PeerConnect::isCorrectPeerResponse(const std::string& handshake, const std::string& ProtocolName, std::string_view response) {
     if (handshake.size() != response.size()) return false;
     int protLen = ProtocolName.size();
     int info_hash_size = tf_.infoHash.size();
@@ -72,93 +180,469 @@ bool PeerConnect::isCorrectPeerResponse(const std::string& handshake, const std:
            tf_.infoHash == response.substr(1 + protLen + 8, info_hash_size);
 }
 
-void PeerConnect::PerformHandshake() {
-    socket_.EstablishConnection();
-
-    const std::string ProtocolName = "BitTorrent protocol";
-    std::string handshake = createHandShakeMessage(ProtocolName); 
-    socket_.SendData(handshake);
-
-    std::string data = socket_.ReceiveData(handshake.size());
-    if (!isCorrectPeerResponse(handshake, ProtocolName, data)) {
-        throw std::runtime_error("Bad answer from peer");
+void PeerConnect::OnEvent(uint32_t events) {
+    try {
+        if (state_ == State::Connecting) {
+            socket_.CheckConnection();
+            state_ = State::Handshake;
+            deadline_ = std::chrono::steady_clock::now() + READ_TIMEOUT;
+            SendData(createHandShakeMessage(PROTOCOL_NAME));
+        } else {
+            if (events & EPOLLOUT) {
+                FlushOutput();
+            }
+            if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                ReceiveAvailable();
+            }
+        }
+        UpdateEvents();
+    } catch (const std::exception& e) {
+        Fail(e.what());
     }
-    peerId_ = data.substr(1 + ProtocolName.size() + 8 + 20, 20);
 }
 
-bool PeerConnect::EstablishConnection() {
+void PeerConnect::OnTick(std::chrono::steady_clock::time_point now) {
+    if (state_ == State::Finished) return;
+    pipeline_.Update(now);
+    PublishStats();
+    if (terminated_) {
+        Close();
+        return;
+    }
+    if (now >= deadline_) {
+        Fail(state_ == State::Connecting ? "can't connect to peer" : "receive timeout exceeded");
+        return;
+    }
+
+    if (state_ != State::Downloading) return;
     try {
-        PerformHandshake();
-        ReceiveBitfield();
-        SendInterested();
-        return true;
+        SendHaves();
+        // после сохранения новых частей у пира может не остаться ничего нужного
+        UpdateInterest();
+        UpdateUploadSlot();
+        ExpireRequests(now);
+        CheckSnubbed(now);
+        CancelRedundantRequests();
+        if (!choked_ && pipeline_.HasFreeSlot()) {
+            // запросы могли быть приостановлены, пока очередь проверки и записи на диск была заполнена
+            RequestPiece();
+            UpdateEvents();
+        } else if (Idle()) {
+            Close();
+        }
     } catch (const std::exception& e) {
-        std::cerr << "Failed to establish connection with peer " << socket_.GetIp() << ":" <<
-            socket_.GetPort() << " -- " << e.what() << std::endl;
-        return false;
+        Fail(e.what());
     }
 }
 
+void PeerConnect::ReceiveAvailable() {
+    size_t total = 0;
+    while (total < MAX_READ_PER_EVENT && state_ != State::Finished) {
+        size_t received = socket_.TryReceive(inBuffer_.WritePtr(), inBuffer_.WritableSize());
+        if (received == 0) break;
+        inBuffer_.Commit(received);
+        total += received;
+        bytesReceived_.Add(received);
+        ProcessInput();
+    }
+    if (total > 0) {
+        deadline_ = std::chrono::steady_clock::now() + READ_TIMEOUT;
+    }
+}
 
-
-void PeerConnect::ReceiveBitfield() {
-    while (true) {
-        auto message = Message::Parse(socket_.ReceiveData(0));
-
-        if (message.id == MessageId::KeepAlive) {
+void PeerConnect::ProcessInput() {
+    while (state_ != State::Finished) {
+        std::string_view data = inBuffer_.Readable();
+        if (state_ == State::Handshake) {
+            if (data.size() < HANDSHAKE_SIZE) break;
+            std::string_view response = data.substr(0, HANDSHAKE_SIZE);
+            if (!isCorrectPeerResponse(createHandShakeMessage(PROTOCOL_NAME), PROTOCOL_NAME, response)) {
+                throw std::runtime_error("Bad answer from peer");
+            }
+            peerId_ = response.substr(1 + PROTOCOL_NAME.size() + 8 + 20, 20);
+            if (peerId_ == selfPeerId_) {
+                throw std::runtime_error("connected to ourselves");
+            }
+            inBuffer_.Consume(HANDSHAKE_SIZE);
+            state_ = State::Bitfield;
+            if (inbound_) {
+                // на входящее соединение отвечаем, только убедившись, что пир пришел за нашей раздачей
+                SendData(createHandShakeMessage(PROTOCOL_NAME));
+            }
+            SendBitfield();
             continue;
         }
 
-        if (message.id == MessageId::Unchoke) {
-            choked_ = false;
-            return;
+        if (data.size() < 4) break;
+        size_t length = BytesToInt(data.substr(0, 4));
+        if (length > MAX_MESSAGE_LENGTH) {
+            throw std::runtime_error("message is too long");
+        }
+        if (data.size() - 4 < length) {
+            // сообщение целиком не помещается в буфер, например, bitfield большой раздачи
+            inBuffer_.Reserve(4 + length);
+            break;
         }
 
-        if (message.id == MessageId::BitField) {
-            piecesAvailability_ = PeerPiecesAvailability(message.payload);
-            return;
+        auto message = MessageView::Parse(data.substr(4, length));
+        MessagesReceived(message.id).Add();
+        if (state_ == State::Bitfield) {
+            ReceiveBitfield(message);
+        } else {
+            HandleMessage(message);
         }
-        
-        throw std::runtime_error("<ReceiveBitfield> undefined messageID");
+        inBuffer_.Consume(4 + length);
     }
 }
 
-void PeerConnect::SendInterested() {
-    try {
-        int mesid = 2;
-        auto message = Message::Init(static_cast<MessageId>(mesid), ""); 
-        socket_.SendData(message.ToString());
-    } catch (const std::exception& e) {
-        throw std::runtime_error("error in send interester");
+void PeerConnect::ReceiveBitfield(const MessageView& message) {
+    if (message.id == MessageId::KeepAlive) {
+        return;
+    }
+
+    if (message.id == MessageId::BitField) {
+        // bitfield неверной длины -- ошибка протокола, соединение закрывается
+        piecesAvailability_ = PeerPiecesAvailability(message.payload, tf_.pieceHashes.size());
+    }
+
+    std::cout << "Connection established to peer" << std::endl;
+    UpdateInterest();
+    state_ = State::Downloading;
+    PeersConnected().Add(1);
+    pieceStorage_.PeerConnected(piecesAvailability_);
+    if (message.id != MessageId::BitField) {
+        // пир без частей может не присылать bitfield и сразу начать с других сообщений
+        HandleMessage(message);
+    } else if (!choked_) {
+        RequestPiece();
+    }
+}
+
+void PeerConnect::UpdateInterest() {
+    bool interested = pieceStorage_.IsInteresting(piecesAvailability_);
+    if (interested != amInterested_) {
+        amInterested_ = interested;
+        SendData(Message::Init(interested ? MessageId::Interested : MessageId::NotInterested, "").ToString());
     }
 }
 
 void PeerConnect::RequestPiece() {
-    if (pieceInProgress_ != nullptr && pieceInProgress_->AllBlocksRetrieved()) {
-        pieceStorage_.PieceProcessed(pieceInProgress_);
-        pieceInProgress_ = nullptr;
-    }
-    while (!pieceInProgress_) {
-        // найти новую часть
-        if (pieceStorage_.QueueIsEmpty()) break;
-        auto piece = pieceStorage_.GetNextPieceToDownload();
-        if (!piecesAvailability_.IsPieceAvailable(piece->GetIndex())) continue;
-        if (piece->AllBlocksRetrieved()) continue;
-        pieceInProgress_ = piece;
-    }
-    
-    if (pieceInProgress_) {
+    auto now = std::chrono::steady_clock::now();
+    while (pipeline_.HasFreeSlot() && !snubbed_) {
+        Block* blockptr = NextBlockToRequest();
+        if (!blockptr) break;
+
         // отправить блок на скачивание
-        Block* blockptr = pieceInProgress_->FirstMissingBlock();
-        std::string data = IntToBytes(blockptr->piece) +
-                           IntToBytes(blockptr->offset) +
-                           IntToBytes(blockptr->length);
-        std::string request = Message::Init(MessageId::Request, data).ToString();
-        socket_.SendData(request);
-        pendingBlock_ = true;
-    } else {
-        // больше нечего получать
-        terminated_ = true;
+        SendBlockMessage(MessageId::Request, blockptr->piece, blockptr->offset, blockptr->length);
+        pipeline_.Add(*blockptr, now);
+    }
+
+    if (Idle()) {
+        // больше нечего получать и отдавать
+        Close();
+    }
+}
+
+bool PeerConnect::NothingToDownload() const {
+    // части, не прошедшие проверку хеша или не записанные на диск, возвращаются в очередь, поэтому ждем записи всех частей
+    return pipeline_.Outstanding() == 0 && piecesInProgress_.empty() && pieceStorage_.DownloadComplete();
+}
+
+bool PeerConnect::Idle() const {
+    return NothingToDownload() && !peerInterested_;
+}
+
+void PeerConnect::SendBitfield() {
+    std::vector<size_t> saved = pieceStorage_.SavedPiecesSince(0);
+    haveSent_ = saved.size();
+    if (saved.empty()) {
+        return;
+    }
+    Bitfield bitfield(tf_.pieceHashes.size());
+    for (size_t pieceIndex : saved) {
+        bitfield.Set(pieceIndex);
+    }
+    SendData(Message::Init(MessageId::BitField, bitfield.ToBytes()).ToString());
+}
+
+void PeerConnect::SendHaves() {
+    for (size_t pieceIndex : pieceStorage_.SavedPiecesSince(haveSent_)) {
+        ++haveSent_;
+        // пиру, у которого часть уже есть, Have не нужен
+        if (!piecesAvailability_.IsPieceAvailable(pieceIndex)) {
+            SendData(Message::Init(MessageId::Have, IntToBytes(pieceIndex)).ToString());
+        }
+    }
+}
+
+void PeerConnect::SetUploadSlot(bool unchoke) {
+    uploadSlot_ = unchoke;
+}
+
+void PeerConnect::UpdateUploadSlot() {
+    bool unchoke = uploadSlot_;
+    if (unchoke != amChoking_) {
+        return;
+    }
+    amChoking_ = !unchoke;
+    if (amChoking_) {
+        // после Choke пир считает все свои запросы отброшенными
+        uploadQueue_.clear();
+    }
+    SendData(Message::Init(unchoke ? MessageId::Unchoke : MessageId::Choke, "").ToString());
+}
+
+void PeerConnect::QueueUpload(const MessageView& message) {
+    if (message.payload.size() != 12) throw std::runtime_error("error in request message");
+    UploadRequest request{
+        static_cast<size_t>(BytesToInt(message.payload.substr(0, 4))),
+        static_cast<size_t>(BytesToInt(message.payload.substr(4, 4))),
+        static_cast<size_t>(BytesToInt(message.payload.substr(8, 4)))
+    };
+    if (request.piece >= tf_.pieceHashes.size() || request.length == 0 || request.length > MAX_REQUEST_LENGTH ||
+        request.offset > PieceLength(tf_, request.piece) || request.length > PieceLength(tf_, request.piece) - request.offset) {
+        throw std::runtime_error("invalid block request");
+    }
+    if (amChoking_ || uploadQueue_.size() >= MAX_UPLOAD_QUEUE || !pieceStorage_.HasPiece(request.piece)) {
+        return;
+    }
+    uploadQueue_.push_back(request);
+    FlushOutput();
+}
+
+void PeerConnect::CancelUpload(const MessageView& message) {
+    if (message.payload.size() != 12) throw std::runtime_error("error in cancel message");
+    size_t pieceIndex = BytesToInt(message.payload.substr(0, 4));
+    size_t offset = BytesToInt(message.payload.substr(4, 4));
+    uploadQueue_.erase(std::remove_if(uploadQueue_.begin(), uploadQueue_.end(), [pieceIndex, offset] (const UploadRequest& request) {
+        return request.piece == pieceIndex && request.offset == offset;
+    }), uploadQueue_.end());
+}
+
+void PeerConnect::StartUpload() {
+    UploadRequest request = uploadQueue_.front();
+    uploadQueue_.pop_front();
+    std::vector<FileRegion> regions = pieceStorage_.GetBlockRegions(request.piece, request.offset, request.length);
+    if (regions.empty()) {
+        return;
+    }
+    std::string header = IntToBytes(9 + request.length) + static_cast<char>(MessageId::Piece) +
+                         IntToBytes(request.piece) + IntToBytes(request.offset);
+    upload_ = Upload{request, std::move(header), std::move(regions)};
+}
+
+size_t PeerConnect::SendUpload() {
+    Upload& upload = *upload_;
+    size_t totalSent = 0;
+    while (upload.headerSent < upload.header.size()) {
+        size_t sent = socket_.TrySend(upload.header.data() + upload.headerSent, upload.header.size() - upload.headerSent);
+        if (sent == 0) return totalSent;
+        upload.headerSent += sent;
+        totalSent += sent;
+    }
+    while (upload.regionIndex < upload.regions.size()) {
+        const FileRegion& region = upload.regions[upload.regionIndex];
+        size_t sent = socket_.TrySendFile(region.handle->Get(), region.offset + upload.regionSent, region.length - upload.regionSent);
+        if (sent == 0) return totalSent;
+        upload.regionSent += sent;
+        totalSent += sent;
+        if (upload.regionSent == region.length) {
+            ++upload.regionIndex;
+            upload.regionSent = 0;
+        }
+    }
+
+    bytesUploaded_ += upload.request.length;
+    bytesSent_.Add(upload.request.length);
+    pieceStorage_.BlockUploaded(upload.request.length);
+    upload_.reset();
+    return totalSent;
+}
+
+Block* PeerConnect::NextBlockToRequest() {
+    for (const auto& piece : piecesInProgress_) {
+        if (Block* block = piece->FirstMissingBlock()) {
+            return block;
+        }
+    }
+
+    bool endgame = pieceStorage_.InEndgame();
+    auto requestedHere = [this] (const Block& block) {
+        return pipeline_.IsRequested(block.piece, block.offset);
+    };
+    if (endgame) {
+        // блоки, запрошенные у других пиров, запрашиваем еще раз, используется первый пришедший
+        for (const auto& piece : piecesInProgress_) {
+            if (Block* block = piece->NextEndgameBlock(requestedHere)) {
+                return block;
+            }
+        }
+    }
+
+    if (pieceStorage_.BacklogFull()) {
+        return nullptr;
+    }
+
+    // найти новую часть
+    if (auto piece = pieceStorage_.GetNextPieceToDownload(piecesAvailability_, id_)) {
+        piecesInProgress_.push_back(piece);
+        return piece->FirstMissingBlock();
+    }
+    if (!endgame) {
+        return nullptr;
+    }
+    while (auto piece = pieceStorage_.GetEndgamePiece(piecesAvailability_, piecesInProgress_)) {
+        piecesInProgress_.push_back(piece);
+        if (Block* block = piece->NextEndgameBlock(requestedHere)) {
+            return block;
+        }
+    }
+    return nullptr;
+}
+
+PiecePtr PeerConnect::FindPieceInProgress(size_t pieceIndex) const {
+    auto it = std::find_if(piecesInProgress_.begin(), piecesInProgress_.end(), [pieceIndex] (const PiecePtr& piece) {
+        return piece->GetIndex() == pieceIndex;
+    });
+    return it == piecesInProgress_.end() ? nullptr : *it;
+}
+
+void PeerConnect::CancelRedundantRequests() {
+    // части, которые докачал другой пир, сброшенные после ошибки проверки хеша или отобранные
+    // по истечении аренды. В endgame соединение качает и чужие части, поэтому аренда не проверяется
+    bool endgame = pieceStorage_.InEndgame();
+    piecesInProgress_.erase(std::remove_if(piecesInProgress_.begin(), piecesInProgress_.end(), [this, endgame] (const PiecePtr& piece) {
+        return !piece->HasBuffer() || piece->AllBlocksRetrieved() ||
+               (!endgame && !pieceStorage_.HoldsLease(piece->GetIndex(), id_));
+    }), piecesInProgress_.end());
+
+    auto redundant = pipeline_.TakeIf([this] (const BlockRequest& request) {
+        PiecePtr piece = FindPieceInProgress(request.piece);
+        return !piece || piece->IsBlockRetrieved(request.offset);
+    });
+    for (const BlockRequest& request : redundant) {
+        SendCancel(request);
+    }
+}
+
+void PeerConnect::ExpireRequests(std::chrono::steady_clock::time_point now) {
+    auto expired = pipeline_.TakeIf([now] (const BlockRequest& request) {
+        return now - request.sentAt > BLOCK_REQUEST_TIMEOUT;
+    });
+    for (const BlockRequest& request : expired) {
+        if (PiecePtr piece = FindPieceInProgress(request.piece)) {
+            piece->ReleaseBlock(request.offset);
+        }
+        SendCancel(request);
+    }
+}
+
+void PeerConnect::SendCancel(const BlockRequest& request) {
+    SendBlockMessage(MessageId::Cancel, request.piece, request.offset, request.length);
+    pieceStorage_.CancelSent();
+}
+
+void PeerConnect::SendBlockMessage(MessageId id, uint32_t piece, uint32_t offset, uint32_t length) {
+    // запрос отправляется на каждый блок, поэтому кадр собирается на стеке, без временных строк
+    char frame[BLOCK_MESSAGE_SIZE];
+    IntToBytes(BLOCK_MESSAGE_SIZE - 4, frame);
+    frame[4] = static_cast<char>(id);
+    IntToBytes(piece, frame + 5);
+    IntToBytes(offset, frame + 9);
+    IntToBytes(length, frame + 13);
+    SendData(std::string_view(frame, sizeof(frame)));
+}
+
+void PeerConnect::CheckSnubbed(std::chrono::steady_clock::time_point now) {
+    if (choked_ || now - lastBlockAt_ < SNUB_TIMEOUT) {
+        return;
+    }
+    if (snubbed_) {
+        // после паузы замолчавшему пиру дается еще одна попытка
+        snubbed_ = false;
+        lastBlockAt_ = now;
+        return;
+    }
+    if (pipeline_.Outstanding() == 0) {
+        return;
+    }
+    // в большом рое таких пиров много, поэтому только счетчик, без строки в лог на каждый случай
+    PeersSnubbed().Add();
+    snubbed_ = true;
+    lastBlockAt_ = now;
+    ReleasePieces();
+}
+
+void PeerConnect::Unchoked() {
+    if (choked_) {
+        // время ожидания блоков отсчитывается с момента, когда пир открыл загрузку
+        lastBlockAt_ = std::chrono::steady_clock::now();
+    }
+    choked_ = false;
+}
+
+void PeerConnect::PublishStats() {
+    std::lock_guard lock(statsMtx_);
+    stats_.downloadRate = pipeline_.Rate();
+    stats_.rtt = pipeline_.SmoothedRtt();
+    stats_.bytesDownloaded = bytesDownloaded_;
+    stats_.unchoked = state_ == State::Downloading && !choked_;
+    stats_.snubbed = snubbed_;
+    stats_.interested = state_ == State::Downloading && peerInterested_;
+    stats_.bytesUploaded = bytesUploaded_;
+    stats_.handshakeCompleted = state_ == State::Bitfield || state_ == State::Downloading;
+}
+
+PeerStats PeerConnect::GetStats() const {
+    std::lock_guard lock(statsMtx_);
+    return stats_;
+}
+
+void PeerConnect::ReleasePieces() {
+    ReleaseRequests();
+    pieceStorage_.ReleaseLeases(id_, piecesInProgress_);
+    piecesInProgress_.clear();
+}
+
+void PeerConnect::ReleaseRequests() {
+    for (const BlockRequest& request : pipeline_.TakeAll()) {
+        for (const auto& piece : piecesInProgress_) {
+            if (piece->GetIndex() == request.piece) {
+                piece->ReleaseBlock(request.offset);
+            }
+        }
+    }
+}
+
+void PeerConnect::ReceiveBlock(const MessageView& message) {
+    if (message.payload.size() < 8) throw std::runtime_error("error in piece message"); 
+    size_t pieceIndex = BytesToInt(message.payload.substr(0, 4));
+    size_t blockOffset = BytesToInt(message.payload.substr(4, 4));
+    auto now = std::chrono::steady_clock::now();
+    if (auto request = pipeline_.Complete(pieceIndex, blockOffset, now)) {
+        BlockLatency().Observe(now - request->sentAt);
+    }
+    std::string_view data = message.payload.substr(8);
+    lastBlockAt_ = now;
+    snubbed_ = false;
+    bytesDownloaded_ += data.size();
+
+    auto it = std::find_if(piecesInProgress_.begin(), piecesInProgress_.end(), [pieceIndex] (const PiecePtr& piece) {
+        return piece->GetIndex() == pieceIndex;
+    });
+    if (it == piecesInProgress_.end()) {
+        // блок, который мы не запрашивали или уже получили, например, ответ на отмененный запрос
+        pieceStorage_.DuplicateBlockReceived(data.size());
+        return;
+    }
+
+    PiecePtr piece = *it;
+    auto result = piece->SaveBlock(blockOffset, data);
+    if (result == Piece::SaveResult::Duplicate) {
+        pieceStorage_.DuplicateBlockReceived(data.size());
+    } else if (result == Piece::SaveResult::PieceCompleted) {
+        piecesInProgress_.erase(it);
+        pieceStorage_.PieceProcessed(piece);
     }
 }
 
@@ -167,32 +651,110 @@ void PeerConnect::Terminate() {
     terminated_ = true;
 }
 
-void PeerConnect::MainLoop() {
-    while (!terminated_) {
-        auto message = Message::Parse(socket_.ReceiveData());
-        // std::cout << "Parse message" << std::endl;
-        if (message.id == MessageId::Choke) {
-            choked_ = true;
-        } else if (message.id == MessageId::Unchoke) {
-            choked_ = false;
-        } else if (message.id == MessageId::Have) {
-            int64_t pieceIdx = BytesToInt(message.payload);
+void PeerConnect::HandleMessage(const MessageView& message) {
+    if (message.id == MessageId::Choke) {
+        // пир отбрасывает все неотвеченные запросы, когда закрывает для нас загрузку,
+        // а части отдаем другим соединениям, чтобы не ждать, пока этот пир снова откроет загрузку
+        choked_ = true;
+        ReleasePieces();
+    } else if (message.id == MessageId::Unchoke) {
+        Unchoked();
+    } else if (message.id == MessageId::Have) {
+        size_t pieceIdx = BytesToInt(message.payload);
+        if (pieceIdx < tf_.pieceHashes.size() && !piecesAvailability_.IsPieceAvailable(pieceIdx)) {
             piecesAvailability_.SetPieceAvailability(pieceIdx);
-        } else if (message.id == MessageId::Piece) {
-            if (message.payload.size() < 8) throw std::runtime_error("error in piece message"); 
-            int64_t pieceIndex = BytesToInt(message.payload.substr(0, 4));
-            if (pieceIndex != pieceInProgress_->GetIndex()) throw std::runtime_error("peice of another index");
-            int64_t blockOffset = BytesToInt(message.payload.substr(4, 4));
-            std::string data = message.payload.substr(8);
-            pieceInProgress_->SaveBlock(blockOffset, data);
-            pendingBlock_ = false;
-        }
-        if (!choked_ && !pendingBlock_) {
-            RequestPiece();
+            pieceStorage_.PieceAvailable(pieceIdx);
+            UpdateInterest();
+        }
+    } else if (message.id == MessageId::Piece) {
+        ReceiveBlock(message);
+    } else if (message.id == MessageId::Interested) {
+        peerInterested_ = true;
+    } else if (message.id == MessageId::NotInterested) {
+        peerInterested_ = false;
+    } else if (message.id == MessageId::Request) {
+        QueueUpload(message);
+    } else if (message.id == MessageId::Cancel) {
+        CancelUpload(message);
+    }
+    if (!choked_) {
+        RequestPiece();
+    }
+}
+
+void PeerConnect::SendData(std::string_view data) {
+    outBuffer_.append(data);
+    FlushOutput();
+}
+
+void PeerConnect::FlushOutput() {
+    // начатый блок нельзя прерывать другими сообщениями, а между блоками
+    // служебные сообщения отправляются раньше следующего блока
+    size_t totalSent = 0;
+    while (totalSent < MAX_SEND_PER_EVENT) {
+        if (upload_) {
+            totalSent += SendUpload();
+            if (upload_) break;
+        } else if (!outBuffer_.empty()) {
+            size_t sent = socket_.TrySend(outBuffer_.data(), outBuffer_.size());
+            if (sent == 0) break;
+            outBuffer_.erase(0, sent);
+            totalSent += sent;
+        } else if (!uploadQueue_.empty()) {
+            StartUpload();
+        } else {
+            break;
         }
     }
 }
 
+void PeerConnect::UpdateEvents() {
+    if (state_ == State::Finished) return;
+    uint32_t events = EPOLLIN;
+    if (!outBuffer_.empty() || upload_ || !uploadQueue_.empty()) {
+        events |= EPOLLOUT;
+    }
+    if (events != registeredEvents_) {
+        reactor_->Modify(socket_.GetSocket(), events);
+        registeredEvents_ = events;
+    }
+}
+
+void PeerConnect::Fail(const std::string& reason) {
+    std::cerr << "Failed connection with peer " << socket_.GetIp() << ":" <<
+        socket_.GetPort() << " -- " << reason << std::endl;
+    failed_ = true;
+    CloseSocket();
+    if (attempts_ < MAX_ATTEMPTS) {
+        Connect();
+    } else {
+        Close();
+    }
+}
+
+void PeerConnect::CloseSocket() {
+    if (state_ == State::Downloading) {
+        PeersConnected().Add(-1);
+        pieceStorage_.PeerDisconnected(piecesAvailability_);
+    }
+    piecesAvailability_ = PeerPiecesAvailability(tf_.pieceHashes.size());
+    ReleasePieces();
+    if (socket_.GetSocket() >= 0) {
+        reactor_->Remove(socket_.GetSocket());
+        socket_.CloseConnection();
+    }
+    state_ = State::Finished;
+}
+
+void PeerConnect::Close() {
+    CloseSocket();
+    finished_ = true;
+}
+
 bool PeerConnect::Failed() const {
     return failed_;
-}
\ No newline at end of file
+}
+
+bool PeerConnect::Finished() const {
+    return finished_;
+}
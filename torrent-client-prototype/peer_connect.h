@@ -2,44 +2,108 @@
 
 #include "tcp_connect.h"
 #include "peer.h"
+#include "peer_pieces_availability.h"
 #include "torrent_file.h"
 #include "piece_storage.h"
+#include "message.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "request_pipeline.h"
+#include "ring_buffer.h"
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
 
 /*
-Структура, хранящая информацию о доступности частей скачиваемого файла у данного пира
-*/
-class PeerPiecesAvailability {
-public:
-    PeerPiecesAvailability();
-
-    /*
-    bitfield -- массив байтов, в котором i-й бит означает наличие или отсутствие i-й части файла у пира
-    */
-    explicit PeerPiecesAvailability(std::string bitfield);
-
-    bool IsPieceAvailable(size_t pieceIndex) const;
-
-    void SetPieceAvailability(size_t pieceIndex);
-
-    size_t Size() const;
-private:
-    std::string bitfield_;
+ * Показатели соединения с пиром. Обновляются при каждом срабатывании таймера реактора
+ */
+struct PeerStats {
+    double downloadRate = 0;  // байт в секунду
+    std::chrono::microseconds rtt{0};  // сглаженная задержка ответа на запрос блока
+    uint64_t bytesDownloaded = 0;
+    bool unchoked = false;
+    bool snubbed = false;  // пир открыл нам загрузку, но давно не присылает блоки
+    bool interested = false;  // пир хочет скачивать у нас
+    bool handshakeCompleted = false;
+    uint64_t bytesUploaded = 0;
 };
 
 /*
 Класс, представляющий соединение с одним пиром.
+Соединение является конечным автоматом (подключение -> handshake -> bitfield -> основной цикл),
+который продвигается событиями реактора и не блокирует поток.
 */
-class PeerConnect {
+class PeerConnect : public EventHandler, public std::enable_shared_from_this<PeerConnect> {
 public:
-    PeerConnect(const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage);
+    PeerConnect(const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage,
+                const PipelineConfig& pipelineConfig = PipelineConfig());
 
-    void Run();
+    /*
+     * Входящее соединение на уже подключенном сокете, соединение становится его владельцем.
+     * Вызывается до Start, после чего соединение ждет handshake от пира и проверяет в нем infohash
+     */
+    void Accept(int socket);
+
+    /*
+     * Начать подключение к пиру. Вызывается в потоке реактора
+     */
+    void Start(Reactor& reactor);
+
+    void OnEvent(uint32_t events) override;
 
+    void OnTick(std::chrono::steady_clock::time_point now) override;
+
+    /*
+     * Можно вызывать из любого потока, соединение будет закрыто при ближайшем срабатывании таймера реактора
+     */
     void Terminate();
 
+    /*
+     * Разрешить или запретить пиру скачивать у нас (Unchoke/Choke). Можно вызывать из любого потока,
+     * сообщение отправляется при ближайшем срабатывании таймера реактора
+     */
+    void SetUploadSlot(bool unchoke);
+
     bool Failed() const;
+
+    bool Finished() const;
+
+    /*
+     * Можно вызывать из любого потока
+     */
+    PeerStats GetStats() const;
 private:
+    enum class State {
+        Connecting,
+        Handshake,
+        Bitfield,
+        Downloading,
+        Finished,
+    };
+
+    struct UploadRequest {
+        size_t piece;
+        size_t offset;
+        size_t length;
+    };
+
+    /*
+     * Блок, который отправляется пиру: заголовок сообщения Piece из памяти, данные -- из файлов через sendfile
+     */
+    struct Upload {
+        UploadRequest request;
+        std::string header;
+        std::vector<FileRegion> regions;
+        size_t headerSent = 0;
+        size_t regionIndex = 0;
+        size_t regionSent = 0;
+    };
+
+    const LeaseOwner id_;  // владелец выданных соединению частей
     const TorrentFile& tf_;
     TcpConnect socket_; 
     const std::string selfPeerId_;  
@@ -47,22 +111,143 @@ private:
     PeerPiecesAvailability piecesAvailability_;
     std::atomic<bool> terminated_; 
     bool choked_;  
-    PiecePtr pieceInProgress_;
+    std::vector<PiecePtr> piecesInProgress_;
     PieceStorage& pieceStorage_;
-    bool pendingBlock_;  
+    RequestPipeline pipeline_;
     std::atomic<bool> failed_; 
-
-    bool isCorrectPeerResponse(const std::string& handshake, const std::string& ProtocolName, const std::string& response);
+    std::atomic<bool> finished_;
+    bool inbound_;
+
+    Reactor* reactor_;
+    State state_;
+    int attempts_;
+    uint32_t registeredEvents_;
+    std::chrono::steady_clock::time_point deadline_;
+    RingBuffer inBuffer_;
+    std::string outBuffer_;
+    std::chrono::steady_clock::time_point lastBlockAt_;
+    bool snubbed_;
+    uint64_t bytesDownloaded_;
+    mutable std::mutex statsMtx_;
+    PeerStats stats_;
+    Counter& bytesReceived_;
+    bool peerInterested_;
+    bool amInterested_;
+    bool amChoking_;
+    std::atomic<bool> uploadSlot_;
+    size_t haveSent_;  // сколько сохраненных частей уже сообщено пиру
+    std::deque<UploadRequest> uploadQueue_;
+    std::optional<Upload> upload_;
+    uint64_t bytesUploaded_;
+    Counter& bytesSent_;
+
+    bool isCorrectPeerResponse(const std::string& handshake, const std::string& ProtocolName, std::string_view response);
     std::string createHandShakeMessage(const std::string& ProtocolName);
-    void PerformHandshake();
 
-    bool EstablishConnection();
+    void Connect();
+
+    void WaitHandshake();
+
+    /*
+     * Сбросить состояние прошлой попытки подключения
+     */
+    void ResetSession();
 
-    void ReceiveBitfield();
+    void ReceiveBitfield(const MessageView& message);
 
-    void SendInterested();
+    /*
+     * Отправить Interested или NotInterested, если у пира появились нужные нам части или их не осталось
+     */
+    void UpdateInterest();
 
     void RequestPiece();
 
-    void MainLoop();
+    Block* NextBlockToRequest();
+
+    bool NothingToDownload() const;
+
+    /*
+     * Скачивать у пира нечего, и сам он у нас ничего не хочет
+     */
+    bool Idle() const;
+
+    void SendBitfield();
+
+    /*
+     * Сообщить пиру о частях, сохраненных после отправки bitfield
+     */
+    void SendHaves();
+
+    void UpdateUploadSlot();
+
+    /*
+     * Проверить запрос блока и поставить его в очередь отдачи. Запросы за границами раздачи -- ошибка протокола,
+     * запросы, пока пир закрыт, частей, которых у нас нет, и сверх длины очереди отбрасываются
+     */
+    void QueueUpload(const MessageView& message);
+
+    void CancelUpload(const MessageView& message);
+
+    void StartUpload();
+
+    /*
+     * Продолжить отправку текущего блока, возвращает количество отправленных байт
+     */
+    size_t SendUpload();
+
+    void ReleaseRequests();
+
+    /*
+     * Вернуть в хранилище все части, выданные соединению, вместе с неотвеченными запросами их блоков
+     */
+    void ReleasePieces();
+
+    /*
+     * Отменить запросы, ответ на которые не пришел за отведенное время, блоки смогут запросить снова
+     */
+    void ExpireRequests(std::chrono::steady_clock::time_point now);
+
+    void SendCancel(const BlockRequest& request);
+
+    /*
+     * Отправить Request или Cancel для блока
+     */
+    void SendBlockMessage(MessageId id, uint32_t piece, uint32_t offset, uint32_t length);
+
+    /*
+     * Пир, открывший загрузку, не присылает блоки дольше таймаута: его части отдаются другим соединениям,
+     * а сам он на время таймаута остается без запросов, чтобы сразу не забрать их обратно
+     */
+    void CheckSnubbed(std::chrono::steady_clock::time_point now);
+
+    void Unchoked();
+
+    void PublishStats();
+
+    /*
+     * Отменить запросы блоков, которые уже получены от других пиров, и забыть скачанные ими части
+     */
+    void CancelRedundantRequests();
+
+    PiecePtr FindPieceInProgress(size_t pieceIndex) const;
+
+    void ReceiveBlock(const MessageView& message);
+
+    void HandleMessage(const MessageView& message);
+
+    void ProcessInput();
+
+    void ReceiveAvailable();
+
+    void SendData(std::string_view data);
+
+    void FlushOutput();
+
+    void UpdateEvents();
+
+    void Fail(const std::string& reason);
+
+    void CloseSocket();
+
+    void Close();
 };
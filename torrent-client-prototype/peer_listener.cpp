@@ -0,0 +1,88 @@
+#include "peer_listener.h"
+#include "metrics.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+constexpr int LISTEN_BACKLOG = 128;
+constexpr size_t MAX_ACCEPT_PER_EVENT = 64;
+
+Counter& InboundConnections(bool accepted) {
+    static Counter& acceptedCounter = MetricsRegistry::Global().GetCounter(
+            "torrent_inbound_connections_total", "Inbound peer connections by admission result", {{"result", "accepted"}});
+    static Counter& rejectedCounter = MetricsRegistry::Global().GetCounter(
+            "torrent_inbound_connections_total", "Inbound peer connections by admission result", {{"result", "rejected"}});
+    return accepted ? acceptedCounter : rejectedCounter;
+}
+}
+
+PeerListener::PeerListener(int port, AcceptCallback onAccept) :
+        sock_(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)),
+        onAccept_(std::move(onAccept)),
+        reactor_(nullptr),
+        paused_(false) {
+    if (sock_ == -1) {
+        throw std::runtime_error(std::string("<PeerListener> socket() failed: ") + std::strerror(errno));
+    }
+    int reuse = 1;
+    setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sock_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 || listen(sock_, LISTEN_BACKLOG) == -1) {
+        std::string error = std::strerror(errno);
+        close(sock_);
+        throw std::runtime_error("<PeerListener> can't listen on port " + std::to_string(port) + ": " + error);
+    }
+}
+
+PeerListener::~PeerListener() {
+    close(sock_);
+}
+
+void PeerListener::Start(Reactor& reactor) {
+    reactor_ = &reactor;
+    reactor_->Add(sock_, EPOLLIN, shared_from_this());
+}
+
+void PeerListener::OnEvent(uint32_t) {
+    for (size_t i = 0; i < MAX_ACCEPT_PER_EVENT; ++i) {
+        sockaddr_in addr{};
+        socklen_t addrLength = sizeof(addr);
+        int client = accept4(sock_, reinterpret_cast<sockaddr*>(&addr), &addrLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // соединение остается в очереди, и без паузы реактор будет будить нас непрерывно
+                std::cerr << "<PeerListener> accept() failed: " << std::strerror(errno) << ", pausing" << std::endl;
+                reactor_->Modify(sock_, 0);
+                paused_ = true;
+            }
+            return;
+        }
+
+        char ip[INET_ADDRSTRLEN] = {};
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        bool accepted = onAccept_(client, Peer{ip, ntohs(addr.sin_port)});
+        InboundConnections(accepted).Add();
+        if (!accepted) {
+            close(client);
+        }
+    }
+}
+
+void PeerListener::OnTick(std::chrono::steady_clock::time_point) {
+    if (paused_) {
+        paused_ = false;
+        reactor_->Modify(sock_, EPOLLIN);
+    }
+}
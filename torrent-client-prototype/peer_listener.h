@@ -0,0 +1,41 @@
+#pragma once
+
+#include "peer.h"
+#include "reactor.h"
+#include <chrono>
+#include <functional>
+#include <memory>
+
+/*
+ * Слушающий сокет для входящих соединений пиров, обслуживается реактором.
+ * Принятый неблокирующий сокет передается в onAccept, если тот вернул false, соединение сразу закрывается.
+ * Когда у процесса кончаются дескрипторы, прием приостанавливается до следующего срабатывания таймера реактора
+ */
+class PeerListener : public EventHandler, public std::enable_shared_from_this<PeerListener> {
+public:
+    using AcceptCallback = std::function<bool(int socket, const Peer& peer)>;
+
+    /*
+     * Если порт занят, бросает std::runtime_error
+     */
+    PeerListener(int port, AcceptCallback onAccept);
+    ~PeerListener();
+
+    PeerListener(const PeerListener&) = delete;
+    PeerListener& operator=(const PeerListener&) = delete;
+
+    /*
+     * Вызывается в потоке реактора
+     */
+    void Start(Reactor& reactor);
+
+    void OnEvent(uint32_t events) override;
+
+    void OnTick(std::chrono::steady_clock::time_point now) override;
+
+private:
+    int sock_;
+    AcceptCallback onAccept_;
+    Reactor* reactor_;
+    bool paused_;
+};
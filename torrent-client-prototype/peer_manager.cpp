@@ -0,0 +1,315 @@
+#include "peer_manager.h"
+#include <algorithm>
+#include <iostream>
+#include <optional>
+
+using namespace std::chrono_literals;
+
+namespace {
+constexpr auto POLL_INTERVAL = 200ms;
+constexpr auto RECHOKE_INTERVAL = 10s;
+constexpr size_t OPTIMISTIC_UNCHOKE_ROUNDS = 3;  // место по очереди переходит к следующему пиру раз в столько пересмотров
+
+/*
+ * Все соединения с пирами обслуживаются несколькими потоками-реакторами
+ */
+size_t ReactorThreadsCount() {
+    return std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 4);
+}
+
+std::string PeerKey(const Peer& peer) {
+    return peer.ip + ":" + std::to_string(peer.port);
+}
+
+Counter& PeersReplaced() {
+    static Counter& counter = MetricsRegistry::Global().GetCounter("torrent_peers_replaced_total",
+                                                                  "Slow or snubbing connections closed to make room for untried peers");
+    return counter;
+}
+}
+
+PeerManager::PeerManager(const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage,
+                         const PipelineConfig& pipelineConfig, const PeerManagerConfig& config) :
+        tf_(tf),
+        selfPeerId_(std::move(selfPeerId)),
+        pieceStorage_(pieceStorage),
+        pipelineConfig_(pipelineConfig),
+        config_(config),
+        nextReactor_(0),
+        rechokeRound_(0),
+        inboundCount_(0),
+        halfOpen_(0),
+        accepting_(true) {
+    for (size_t i = 0; i < ReactorThreadsCount(); ++i) {
+        reactors_.emplace_back(std::make_unique<Reactor>());
+    }
+    for (auto& reactor : reactors_) {
+        reactorThreads_.emplace_back([&reactor] () {
+            try {
+                reactor->Run();
+            } catch (const std::exception& e) {
+                std::cerr << "Reactor error: " << e.what() << std::endl;
+            }
+        });
+    }
+}
+
+PeerManager::~PeerManager() {
+    StopReactors();
+}
+
+size_t PeerManager::AddPeers(const std::vector<Peer>& peers) {
+    std::lock_guard lock(mtx_);
+    size_t added = 0;
+    for (const Peer& peer : peers) {
+        if (known_.insert(PeerKey(peer)).second) {
+            untried_.push_back(peer);
+            ++added;
+        }
+    }
+    return added;
+}
+
+void PeerManager::SetPeerSource(std::function<bool()> requestPeers) {
+    requestPeers_ = std::move(requestPeers);
+}
+
+void PeerManager::Listen(int port) {
+    listener_ = std::make_shared<PeerListener>(port, [this] (int socket, const Peer& peer) {
+        return AcceptInbound(socket, peer);
+    });
+    Reactor& reactor = *reactors_.front();
+    reactor.Post([listener = listener_, &reactor] () {
+        listener->Start(reactor);
+    });
+}
+
+bool PeerManager::AcceptInbound(int socket, const Peer& peer) {
+    std::lock_guard lock(mtx_);
+    auto perIp = inboundPerIp_.find(peer.ip);
+    if (!accepting_ || inboundCount_ >= config_.maxInbound || halfOpen_ >= config_.maxHalfOpen ||
+        (perIp != inboundPerIp_.end() && perIp->second >= config_.maxInboundPerIp)) {
+        return false;
+    }
+    ++inboundCount_;
+    ++halfOpen_;
+    ++inboundPerIp_[peer.ip];
+
+    auto connect = std::make_shared<PeerConnect>(peer, tf_, selfPeerId_, pieceStorage_, pipelineConfig_);
+    connect->Accept(socket);
+    Reactor& reactor = *reactors_[nextReactor_++ % reactors_.size()];
+    reactor.Post([connect, &reactor] () {
+        connect->Start(reactor);
+    });
+    accepted_.push_back(Connection{peer, connect, std::chrono::steady_clock::now(), false, true});
+    return true;
+}
+
+void PeerManager::TakeAcceptedConnections() {
+    std::lock_guard lock(mtx_);
+    for (Connection& connection : accepted_) {
+        connections_.push_back(std::move(connection));
+    }
+    accepted_.clear();
+    halfOpen_ = std::count_if(connections_.begin(), connections_.end(), [] (const Connection& connection) {
+        return connection.inbound && !connection.connect->Finished() && !connection.connect->GetStats().handshakeCompleted;
+    });
+}
+
+size_t PeerManager::OutboundCount() const {
+    return std::count_if(connections_.begin(), connections_.end(), [] (const Connection& connection) {
+        return !connection.inbound;
+    });
+}
+
+void PeerManager::Run() {
+    auto lastReplace = std::chrono::steady_clock::now();
+    auto lastRechoke = lastReplace;
+    std::optional<std::chrono::steady_clock::time_point> completedAt;
+    bool seedingStopped = false;
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        // части зависших соединений отдаются другим пирам
+        pieceStorage_.ReclaimExpiredLeases(now);
+
+        TakeAcceptedConnections();
+        RemoveFinishedConnections();
+
+        if (now - lastReplace >= config_.replaceInterval) {
+            ReplaceSlowestPeer();
+            lastReplace = now;
+        }
+        StartConnections();
+
+        bool rechoke = now - lastRechoke >= RECHOKE_INTERVAL;
+        UpdateUploadSlots(rechoke);
+        if (rechoke) {
+            lastRechoke = now;
+        }
+
+        if (DownloadComplete() && !seedingStopped) {
+            if (!completedAt) {
+                completedAt = now;
+            }
+            if (now - *completedAt >= config_.seedTime) {
+                std::lock_guard lock(mtx_);
+                accepting_ = false;
+                TerminateAll();
+                seedingStopped = true;
+            }
+        }
+
+        // раздача продолжается и без соединений: пиры могут подключиться сами.
+        // Досрочный анонс нужен, только когда качать не у кого, иначе трекеры опрашивались бы на каждом шаге
+        bool done = DownloadComplete() ? seedingStopped : connections_.empty() && (!requestPeers_ || !requestPeers_());
+        if (connections_.empty() && done) {
+            break;
+        }
+        std::this_thread::sleep_for(POLL_INTERVAL);
+    }
+
+    // соединения, принятые после последней проверки, закрываются вместе с реакторами
+    std::lock_guard lock(mtx_);
+    accepting_ = false;
+}
+
+bool PeerManager::DownloadComplete() const {
+    return pieceStorage_.DownloadComplete();
+}
+
+void PeerManager::RemoveFinishedConnections() {
+    std::lock_guard lock(mtx_);
+    connections_.erase(std::remove_if(connections_.begin(), connections_.end(), [this] (const Connection& connection) {
+        if (!connection.connect->Finished()) {
+            return false;
+        }
+        if (connection.inbound) {
+            --inboundCount_;
+            if (--inboundPerIp_[connection.peer.ip] == 0) {
+                inboundPerIp_.erase(connection.peer.ip);
+            }
+        } else if (connection.connect->GetStats().bytesDownloaded > 0) {
+            known_.erase(PeerKey(connection.peer));
+        }
+        return true;
+    }), connections_.end());
+}
+
+void PeerManager::StartConnections() {
+    if (DownloadComplete()) {
+        return;
+    }
+    std::lock_guard lock(mtx_);
+    size_t outbound = OutboundCount();
+    for (; outbound < config_.maxConnections && !untried_.empty(); ++outbound) {
+        Peer peer = untried_.front();
+        untried_.pop_front();
+
+        auto connect = std::make_shared<PeerConnect>(peer, tf_, selfPeerId_, pieceStorage_, pipelineConfig_);
+        Reactor& reactor = *reactors_[nextReactor_++ % reactors_.size()];
+        reactor.Post([connect, &reactor] () {
+            connect->Start(reactor);
+        });
+        connections_.push_back(Connection{peer, connect, std::chrono::steady_clock::now()});
+    }
+}
+
+void PeerManager::ReplaceSlowestPeer() {
+    {
+        std::lock_guard lock(mtx_);
+        if (untried_.empty() || OutboundCount() < config_.maxConnections) {
+            // заменять некем, либо для новых пиров и так есть свободные места
+            return;
+        }
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    const Connection* slowest = nullptr;
+    PeerStats slowestStats;
+    for (const auto& connection : connections_) {
+        // входящие соединения не занимают мест исходящих, и заменять их некем
+        if (connection.inbound || now - connection.startedAt < config_.minPeerAge) continue;
+        PeerStats stats = connection.connect->GetStats();
+        // пир, который не присылает блоки, хуже любого медленного
+        if (!slowest || std::make_pair(!stats.snubbed, stats.downloadRate) < std::make_pair(!slowestStats.snubbed, slowestStats.downloadRate)) {
+            slowest = &connection;
+            slowestStats = stats;
+        }
+    }
+    if (!slowest) {
+        return;
+    }
+
+    PeersReplaced().Add();
+    slowest->connect->Terminate();
+}
+
+void PeerManager::UpdateUploadSlots(bool rechoke) {
+    if (config_.uploadSlots == 0) {
+        return;
+    }
+    std::vector<std::pair<Connection*, PeerStats>> interested;
+    size_t unchoked = 0;
+    for (auto& connection : connections_) {
+        PeerStats stats = connection.connect->GetStats();
+        if (!stats.interested) {
+            SetUploadSlot(connection, false);
+            continue;
+        }
+        interested.emplace_back(&connection, stats);
+        unchoked += connection.uploadSlot;
+    }
+
+    if (!rechoke) {
+        // свободные места занимаются сразу, не дожидаясь пересмотра
+        for (auto& [connection, stats] : interested) {
+            if (unchoked >= config_.uploadSlots) break;
+            if (!connection->uploadSlot) {
+                SetUploadSlot(*connection, true);
+                ++unchoked;
+            }
+        }
+        return;
+    }
+
+    // после окончания загрузки скорость скачивания у пиров ничего не говорит,
+    // и места по очереди получают те, кому мы отдали меньше всего
+    bool seeding = DownloadComplete();
+    std::stable_sort(interested.begin(), interested.end(), [seeding] (const auto& a, const auto& b) {
+        return seeding ? a.second.bytesUploaded < b.second.bytesUploaded : a.second.downloadRate > b.second.downloadRate;
+    });
+    // одно из мест переходит по очереди; если место всего одно, обычных мест нет совсем
+    size_t regular = config_.uploadSlots - 1;
+    size_t optimistic = interested.size();
+    if (interested.size() > regular) {
+        optimistic = regular + rechokeRound_ / OPTIMISTIC_UNCHOKE_ROUNDS % (interested.size() - regular);
+    }
+    ++rechokeRound_;
+    for (size_t i = 0; i < interested.size(); ++i) {
+        SetUploadSlot(*interested[i].first, i < regular || i == optimistic);
+    }
+}
+
+void PeerManager::SetUploadSlot(Connection& connection, bool unchoke) {
+    if (connection.uploadSlot != unchoke) {
+        connection.uploadSlot = unchoke;
+        connection.connect->SetUploadSlot(unchoke);
+    }
+}
+
+void PeerManager::TerminateAll() {
+    for (const auto& connection : connections_) {
+        connection.connect->Terminate();
+    }
+}
+
+void PeerManager::StopReactors() {
+    for (auto& reactor : reactors_) {
+        reactor->Stop();
+    }
+    for (std::thread& thread : reactorThreads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "peer.h"
+#include "peer_connect.h"
+#include "peer_listener.h"
+#include "piece_storage.h"
+#include "reactor.h"
+#include "request_pipeline.h"
+#include "torrent_file.h"
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/*
+ * Параметры управления соединениями с пирами
+ */
+struct PeerManagerConfig {
+    size_t maxConnections = 30;  // количество одновременно открытых соединений
+    std::chrono::seconds replaceInterval{10};  // как часто самый медленный пир заменяется новым
+    std::chrono::seconds minPeerAge{10};  // соединения моложе этого не оцениваются
+    size_t uploadSlots = 4;  // скольким пирам одновременно открыта отдача, 0 -- не отдавать
+    std::chrono::seconds seedTime{0};  // сколько продолжать отдавать после окончания загрузки
+    size_t maxInbound = 50;  // входящие соединения, не считаются в maxConnections
+    size_t maxInboundPerIp = 4;
+    size_t maxHalfOpen = 16;  // входящие соединения, от которых еще не пришел handshake
+};
+
+/*
+ * Набор соединений с пирами. Соединения обслуживаются несколькими потоками-реакторами и распределяются
+ * между ними по кругу. Одновременно открыто не больше maxConnections соединений, остальные пиры ждут в очереди.
+ * Периодически самое медленное соединение (в первую очередь -- пир, который открыл загрузку, но не присылает блоки)
+ * закрывается, а на его место подключается еще не опробованный пир, так что набор соединений
+ * постепенно сходится к самым быстрым пирам раздачи.
+ * Отдача открывается uploadSlots заинтересованным пирам: тем, от кого мы быстрее всего скачиваем,
+ * и одному пиру по очереди, чтобы находить новых быстрых пиров.
+ * Входящие соединения принимаются, пока не превышены общий лимит, лимит на один IP и лимит соединений,
+ * ожидающих handshake, остальные сразу закрываются, так что поток входящих соединений не исчерпает дескрипторы
+ */
+class PeerManager {
+public:
+    PeerManager(const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage,
+                const PipelineConfig& pipelineConfig, const PeerManagerConfig& config);
+    ~PeerManager();
+
+    PeerManager(const PeerManager&) = delete;
+    PeerManager& operator=(const PeerManager&) = delete;
+
+    /*
+     * Добавить пиров в очередь на подключение, уже известные пиры пропускаются. Возвращает количество
+     * добавленных. Можно вызывать из любого потока
+     */
+    size_t AddPeers(const std::vector<Peer>& peers);
+
+    /*
+     * Источник новых пиров, который опрашивается, когда подключаться больше не к кому. Возвращает false,
+     * если новых пиров не будет, тогда Run завершается
+     */
+    void SetPeerSource(std::function<bool()> requestPeers);
+
+    /*
+     * Принимать входящие соединения на порту. Если порт занят, бросает std::runtime_error
+     */
+    void Listen(int port);
+
+    /*
+     * Подключаться к пирам и заменять медленные соединения, пока есть что скачивать и к кому подключаться.
+     * Возвращается, когда все соединения закрыты. Пир, от которого удалось что-то скачать, после закрытия
+     * соединения забывается, так что повторный анонс может вернуть его в очередь
+     */
+    void Run();
+
+private:
+    struct Connection {
+        Peer peer;
+        std::shared_ptr<PeerConnect> connect;
+        std::chrono::steady_clock::time_point startedAt;
+        bool uploadSlot = false;
+        bool inbound = false;
+    };
+
+    const TorrentFile& tf_;
+    const std::string selfPeerId_;
+    PieceStorage& pieceStorage_;
+    const PipelineConfig pipelineConfig_;
+    const PeerManagerConfig config_;
+
+    std::vector<std::unique_ptr<Reactor>> reactors_;
+    std::vector<std::thread> reactorThreads_;
+    size_t nextReactor_;
+    size_t rechokeRound_;
+    std::function<bool()> requestPeers_;
+
+    std::mutex mtx_;
+    std::deque<Peer> untried_;
+    std::unordered_set<std::string> known_;
+
+    std::vector<Connection> connections_;
+
+    std::shared_ptr<PeerListener> listener_;
+    std::vector<Connection> accepted_;  // входящие соединения, еще не перенесенные в connections_
+    std::unordered_map<std::string, size_t> inboundPerIp_;
+    size_t inboundCount_;
+    size_t halfOpen_;
+    bool accepting_;
+
+    /*
+     * Вызывается в потоке реактора слушающего сокета
+     */
+    bool AcceptInbound(int socket, const Peer& peer);
+
+    void TakeAcceptedConnections();
+
+    size_t OutboundCount() const;
+
+    void RemoveFinishedConnections();
+
+    bool DownloadComplete() const;
+
+    void StartConnections();
+
+    void ReplaceSlowestPeer();
+
+    /*
+     * rechoke -- пересмотреть, кому открыта отдача, иначе только занять свободные места
+     */
+    void UpdateUploadSlots(bool rechoke);
+
+    void SetUploadSlot(Connection& connection, bool unchoke);
+
+    void TerminateAll();
+
+    void StopReactors();
+};
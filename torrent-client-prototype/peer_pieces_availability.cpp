@@ -0,0 +1,24 @@
+#include "peer_pieces_availability.h"
+
+PeerPiecesAvailability::PeerPiecesAvailability() = default;
+
+PeerPiecesAvailability::PeerPiecesAvailability(size_t piecesCount) : pieces_(piecesCount) {}
+
+PeerPiecesAvailability::PeerPiecesAvailability(std::string_view bitfield, size_t piecesCount) :
+        pieces_(Bitfield::FromBytes(bitfield, piecesCount)) {}
+
+bool PeerPiecesAvailability::IsPieceAvailable(size_t pieceIndex) const {
+    return pieces_.Test(pieceIndex);
+}
+
+void PeerPiecesAvailability::SetPieceAvailability(size_t pieceIndex) {
+    pieces_.Set(pieceIndex);
+}
+
+size_t PeerPiecesAvailability::Size() const {
+    return pieces_.Size();
+}
+
+const Bitfield& PeerPiecesAvailability::Pieces() const {
+    return pieces_;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "bitfield.h"
+#include <string_view>
+
+/*
+Структура, хранящая информацию о доступности частей скачиваемого файла у данного пира
+*/
+class PeerPiecesAvailability {
+public:
+    PeerPiecesAvailability();
+
+    /*
+    Пир, у которого пока нет ни одной из piecesCount частей
+    */
+    explicit PeerPiecesAvailability(size_t piecesCount);
+
+    /*
+    bitfield -- массив байтов, в котором i-й бит означает наличие или отсутствие i-й части файла у пира.
+    Бросает std::invalid_argument, если его длина не соответствует числу частей
+    */
+    PeerPiecesAvailability(std::string_view bitfield, size_t piecesCount);
+
+    bool IsPieceAvailable(size_t pieceIndex) const;
+
+    /*
+    Бросает std::out_of_range для номера за пределами раздачи
+    */
+    void SetPieceAvailability(size_t pieceIndex);
+
+    size_t Size() const;
+
+    const Bitfield& Pieces() const;
+private:
+    Bitfield pieces_;
+};
@@ -7,7 +7,11 @@ namespace {
 constexpr size_t BLOCK_SIZE = 1 << 14;
 }
 
-Piece::Piece(size_t index, size_t length, std::string hash) : index_(index), length_(length), hash_(hash) {
+Piece::Piece(size_t index, size_t length, std::string hash) : index_(index), length_(length), hash_(hash), buffer_(nullptr, PieceBufferDeleter{nullptr}), sha_(EVP_MD_CTX_new(), &EVP_MD_CTX_free), hashedBlocks_(0), incrementalHashTime_(0) {
+    if (!sha_ || EVP_DigestInit_ex(sha_.get(), EVP_sha1(), nullptr) != 1) {
+        throw std::runtime_error("can't initialize SHA-1 context");
+    }
+
     int64_t lastBlockLength = length % BLOCK_SIZE;
     int64_t blockCount = length / BLOCK_SIZE + 1;
     if (lastBlockLength == 0) {
@@ -18,38 +22,147 @@ Piece::Piece(size_t index, size_t length, std::string hash) : index_(index), len
     blocks_.resize(blockCount);
     for (int blocknum = 0; blocknum < blockCount; ++blocknum) {
         blocks_[blocknum].piece = index;
-        blocks_[blocknum].length = (blocknum == (int)length - 1 ? lastBlockLength : BLOCK_SIZE);
+        blocks_[blocknum].length = (blocknum == blockCount - 1 ? lastBlockLength : BLOCK_SIZE);
         blocks_[blocknum].offset = blocknum * BLOCK_SIZE;
         blocks_[blocknum].status = Block::Status::Missing;
     }
 };
 
 bool Piece::HashMatches() const {
-    return hash_ == GetHash();
+    return hash_ == GetDataHash();
+}
+
+std::chrono::nanoseconds Piece::IncrementalHashTime() const {
+    std::lock_guard lock(mtx_);
+    return incrementalHashTime_;
 }
 
 Block* Piece::FirstMissingBlock() {
+    std::lock_guard lock(mtx_);
+    if (!buffer_) return nullptr;
     for (auto& block : blocks_) {
         if (block.status == Block::Status::Missing) {
             block.status = Block::Status::Pending;
             return &block;
         }
     }
-    throw std::runtime_error("<FirstMissingBlock> have not missing blocks");
+    return nullptr;
+}
+
+Block* Piece::NextEndgameBlock(const std::function<bool(const Block&)>& alreadyRequested) {
+    std::lock_guard lock(mtx_);
+    if (!buffer_) return nullptr;
+    for (auto& block : blocks_) {
+        if (block.status != Block::Status::Retrieved && !alreadyRequested(block)) {
+            block.status = Block::Status::Pending;
+            return &block;
+        }
+    }
+    return nullptr;
+}
+
+bool Piece::IsBlockRetrieved(size_t blockOffset) const {
+    std::lock_guard lock(mtx_);
+    size_t blockIdx = blockOffset / BLOCK_SIZE;
+    return blockIdx < blocks_.size() && blocks_[blockIdx].status == Block::Status::Retrieved;
+}
+
+size_t Piece::GetLength() const {
+    return length_;
+}
+
+bool Piece::HasMissingBlocks() const {
+    std::lock_guard lock(mtx_);
+    return buffer_ && std::any_of(blocks_.begin(), blocks_.end(), [] (const Block& block) {
+        return block.status == Block::Status::Missing;
+    });
+}
+
+void Piece::ReleaseBlock(size_t blockOffset) {
+    std::lock_guard lock(mtx_);
+    size_t blockIdx = blockOffset / BLOCK_SIZE;
+    if (blockIdx < blocks_.size() && blocks_[blockIdx].status == Block::Status::Pending) {
+        blocks_[blockIdx].status = Block::Status::Missing;
+    }
+}
+
+void Piece::ReleasePendingBlocks() {
+    std::lock_guard lock(mtx_);
+    for (auto& block : blocks_) {
+        if (block.status == Block::Status::Pending) {
+            block.status = Block::Status::Missing;
+        }
+    }
+}
+
+std::chrono::steady_clock::time_point Piece::LastProgress() const {
+    std::lock_guard lock(mtx_);
+    return lastProgress_;
+}
+
+void Piece::Touch(std::chrono::steady_clock::time_point now) {
+    std::lock_guard lock(mtx_);
+    lastProgress_ = std::max(lastProgress_, now);
+}
+
+std::chrono::steady_clock::time_point Piece::StartedAt() const {
+    std::lock_guard lock(mtx_);
+    return startedAt_;
 }
 
 size_t Piece::GetIndex() const {
     return index_;
 }
 
-void Piece::SaveBlock(size_t blockOffset, std::string data) {
-    int blockIdx = blockOffset / BLOCK_SIZE;
+void Piece::AttachBuffer(PieceBuffer buffer) {
+    std::lock_guard lock(mtx_);
+    buffer_ = std::move(buffer);
+    startedAt_ = std::chrono::steady_clock::now();
+}
+
+void Piece::ReleaseBuffer() {
+    std::lock_guard lock(mtx_);
+    buffer_.reset();
+}
+
+bool Piece::HasBuffer() const {
+    std::lock_guard lock(mtx_);
+    return buffer_ != nullptr;
+}
+
+Piece::SaveResult Piece::SaveBlock(size_t blockOffset, std::string_view data) {
+    std::lock_guard lock(mtx_);
+    size_t blockIdx = blockOffset / BLOCK_SIZE;
+    if (blockIdx >= blocks_.size() || blocks_[blockIdx].offset != blockOffset) throw std::runtime_error("try to safe block with wrong offset");
     if (blocks_[blockIdx].length != data.size()) throw std::runtime_error("try to safe block of another size");
-    blocks_[blockIdx].data = data;
+    // часть уже скачана и записана или сброшена после ошибки проверки
+    if (!buffer_ || blocks_[blockIdx].status == Block::Status::Retrieved) return SaveResult::Duplicate;
+    std::copy(data.begin(), data.end(), buffer_.get() + blockOffset);
     blocks_[blockIdx].status = Block::Status::Retrieved;
+    lastProgress_ = std::chrono::steady_clock::now();
+    HashRetrievedPrefix();
+    return AllBlocksRetrievedLocked() ? SaveResult::PieceCompleted : SaveResult::Saved;
+}
+
+void Piece::HashRetrievedPrefix() {
+    if (hashedBlocks_ >= blocks_.size() || blocks_[hashedBlocks_].status != Block::Status::Retrieved) {
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (hashedBlocks_ < blocks_.size() && blocks_[hashedBlocks_].status == Block::Status::Retrieved) {
+        const Block& block = blocks_[hashedBlocks_];
+        EVP_DigestUpdate(sha_.get(), buffer_.get() + block.offset, block.length);
+        ++hashedBlocks_;
+    }
+    incrementalHashTime_ += std::chrono::steady_clock::now() - start;
 }
 
 bool Piece::AllBlocksRetrieved() const {
+    std::lock_guard lock(mtx_);
+    return AllBlocksRetrievedLocked();
+}
+
+bool Piece::AllBlocksRetrievedLocked() const {
     for (const auto& block : blocks_) {
         if (block.status == Block::Status::Missing || block.status == Block::Status::Pending) {
             return false;
@@ -58,16 +171,26 @@ bool Piece::AllBlocksRetrieved() const {
     return true;
 }
 
-std::string Piece::GetData() const {
-    std::string fullData;
-    for (const auto& block : blocks_) {
-        fullData += block.data;
-    }
-    return fullData;
+std::string_view Piece::GetData() const {
+    std::lock_guard lock(mtx_);
+    return std::string_view(buffer_.get(), buffer_ ? length_ : 0);
 }
 
 std::string Piece::GetDataHash() const {
-    return CalculateSHA1(GetData());
+    std::lock_guard lock(mtx_);
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> sha(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+    if (!sha || EVP_MD_CTX_copy_ex(sha.get(), sha_.get()) != 1) {
+        throw std::runtime_error("can't copy SHA-1 context");
+    }
+    if (hashedBlocks_ < blocks_.size()) {
+        size_t tailOffset = blocks_[hashedBlocks_].offset;
+        EVP_DigestUpdate(sha.get(), buffer_.get() + tailOffset, length_ - tailOffset);
+    }
+
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hashLength = 0;
+    EVP_DigestFinal_ex(sha.get(), hash, &hashLength);
+    return std::string(reinterpret_cast<char*>(hash), hashLength);
 }
 
 const std::string& Piece::GetHash() const {
@@ -75,8 +198,11 @@ const std::string& Piece::GetHash() const {
 }
 
 void Piece::Reset() {
+    std::lock_guard lock(mtx_);
     for (auto& block : blocks_) {
-        block.data.clear();
         block.status = Block::Status::Missing;
     }
+    EVP_DigestInit_ex(sha_.get(), EVP_sha1(), nullptr);
+    hashedBlocks_ = 0;
+    incrementalHashTime_ = std::chrono::nanoseconds(0);
 }
@@ -1,9 +1,15 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
 #include <memory>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <openssl/evp.h>
+#include "piece_buffer_pool.h"
 
 struct Block {
 
@@ -17,14 +23,22 @@ struct Block {
     uint32_t offset;  // смещение начала блока относительно начала части файла в байтах
     uint32_t length;  // длина блока в байтах
     Status status;  // статус загрузки данного блока
-    std::string data;  // бинарные данные
 };
 
 /*
- * Часть скачиваемого файла
+ * Часть скачиваемого файла. Данные всех блоков хранятся в одном непрерывном буфере из PieceBufferPool,
+ * буфер выдается части на время загрузки.
+ * В режиме endgame одну часть качают несколько соединений из разных потоков, поэтому состояние блоков
+ * защищено мьютексом
  */
 class Piece {
 public:
+    enum class SaveResult {
+        Duplicate,  // блок уже получен от другого пира или часть больше не скачивается
+        Saved,
+        PieceCompleted,  // получен последний недостающий блок части
+    };
+
     /*
      * index -- номер части файла, нумерация начинается с 0
      * length -- длина части файла. Все части, кроме последней, имеют длину, равную `torrentFile.pieceLength`
@@ -34,16 +48,75 @@ public:
 
     bool HashMatches() const;
 
+    /*
+     * Время, потраченное на хеширование блоков при их получении в SaveBlock, с последнего Reset
+     */
+    std::chrono::nanoseconds IncrementalHashTime() const;
+
+    /*
+     * Первый не запрошенный блок, он переводится в состояние Pending. nullptr, если таких блоков нет
+     */
     Block* FirstMissingBlock();
 
+    /*
+     * Endgame: первый еще не полученный блок, который не запрошен у этого пира (alreadyRequested == false).
+     * Блок может быть уже запрошен у других пиров, его статус не меняется
+     */
+    Block* NextEndgameBlock(const std::function<bool(const Block&)>& alreadyRequested);
+
+    bool IsBlockRetrieved(size_t blockOffset) const;
+
+    bool HasMissingBlocks() const;
+
+    /*
+     * Вернуть запрошенный, но не полученный блок в состояние Missing, чтобы запросить его снова
+     */
+    void ReleaseBlock(size_t blockOffset);
+
+    /*
+     * Вернуть все запрошенные, но не полученные блоки в состояние Missing, когда часть забирают у соединения
+     */
+    void ReleasePendingBlocks();
+
+    /*
+     * Время получения последнего нового блока части или выдачи части соединению
+     */
+    std::chrono::steady_clock::time_point LastProgress() const;
+
+    void Touch(std::chrono::steady_clock::time_point now);
+
+    /*
+     * Время, когда части был выделен буфер, то есть началась ее загрузка
+     */
+    std::chrono::steady_clock::time_point StartedAt() const;
+
     size_t GetIndex() const;
 
-    void SaveBlock(size_t blockOffset, std::string data);
+    size_t GetLength() const;
+
+    void AttachBuffer(PieceBuffer buffer);
+
+    /*
+     * Вернуть буфер в пул, после этого данные части недоступны
+     */
+    void ReleaseBuffer();
+
+    bool HasBuffer() const;
+
+    /*
+     * Данные копируются в буфер части по смещению блока. Из нескольких копий одного блока сохраняется первая,
+     * PieceCompleted возвращается ровно одному вызову
+     */
+    SaveResult SaveBlock(size_t blockOffset, std::string_view data);
 
     bool AllBlocksRetrieved() const;
 
-    std::string GetData() const;
+    std::string_view GetData() const;
 
+    /*
+     * Хеш данных части. Блоки хешируются по мере того, как растет непрерывный префикс полученных блоков,
+     * поэтому к моменту получения последнего блока остается дохешировать только хвост
+     */
     std::string GetDataHash() const;
 
     const std::string& GetHash() const;
@@ -54,6 +127,17 @@ private:
     const size_t index_, length_;
     const std::string hash_;
     std::vector<Block> blocks_;
+    PieceBuffer buffer_;
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> sha_;
+    size_t hashedBlocks_;  // количество первых блоков, уже учтенных в sha_
+    std::chrono::nanoseconds incrementalHashTime_;
+    mutable std::mutex mtx_;
+    std::chrono::steady_clock::time_point lastProgress_;
+    std::chrono::steady_clock::time_point startedAt_;
+
+    bool AllBlocksRetrievedLocked() const;
+
+    void HashRetrievedPrefix();
 };
 
 using PiecePtr = std::shared_ptr<Piece>;
@@ -0,0 +1,84 @@
+#include "piece_buffer_pool.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+constexpr uint64_t INDEX_MASK = 0xffffffff;
+}
+
+void PieceBufferDeleter::operator()(char* buffer) const {
+    pool->Release(buffer);
+}
+
+PieceBufferPool::PieceBufferPool(size_t bufferSize, size_t maxBuffers) :
+        memory_(nullptr),
+        bufferSize_(0),
+        maxBuffers_(maxBuffers),
+        freshBuffers_(0),
+        freeHead_(0),
+        next_(new std::atomic<uint32_t>[maxBuffers]),
+        inUse_(0) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    bufferSize_ = (bufferSize + pageSize - 1) / pageSize * pageSize;
+
+    void* memory = mmap(nullptr, bufferSize_ * maxBuffers_, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        throw std::runtime_error(std::string("<PieceBufferPool> mmap failed: ") + std::strerror(errno));
+    }
+    memory_ = static_cast<char*>(memory);
+}
+
+PieceBufferPool::~PieceBufferPool() {
+    munmap(memory_, bufferSize_ * maxBuffers_);
+}
+
+PieceBuffer PieceBufferPool::Acquire() {
+    uint64_t head = freeHead_.load(std::memory_order_acquire);
+    while ((head & INDEX_MASK) != 0) {
+        uint32_t index = (head & INDEX_MASK) - 1;
+        uint64_t newHead = ((head >> 32) + 1) << 32 | next_[index].load(std::memory_order_relaxed);
+        if (freeHead_.compare_exchange_weak(head, newHead, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            ++inUse_;
+            return PieceBuffer(memory_ + index * bufferSize_, PieceBufferDeleter{this});
+        }
+    }
+
+    // свободных буферов нет, берем еще не использованный
+    uint32_t fresh = freshBuffers_.load(std::memory_order_relaxed);
+    while (fresh < maxBuffers_) {
+        if (freshBuffers_.compare_exchange_weak(fresh, fresh + 1, std::memory_order_relaxed)) {
+            ++inUse_;
+            return PieceBuffer(memory_ + fresh * bufferSize_, PieceBufferDeleter{this});
+        }
+    }
+    return PieceBuffer(nullptr, PieceBufferDeleter{this});
+}
+
+void PieceBufferPool::Release(char* buffer) {
+    if (!buffer) return;
+    uint32_t index = (buffer - memory_) / bufferSize_;
+    uint64_t head = freeHead_.load(std::memory_order_relaxed);
+    uint64_t newHead;
+    do {
+        next_[index].store(head & INDEX_MASK, std::memory_order_relaxed);
+        newHead = ((head >> 32) + 1) << 32 | (index + 1);
+    } while (!freeHead_.compare_exchange_weak(head, newHead, std::memory_order_release, std::memory_order_relaxed));
+    --inUse_;
+}
+
+size_t PieceBufferPool::BufferSize() const {
+    return bufferSize_;
+}
+
+size_t PieceBufferPool::Capacity() const {
+    return maxBuffers_;
+}
+
+size_t PieceBufferPool::InUse() const {
+    return inUse_;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+class PieceBufferPool;
+
+struct PieceBufferDeleter {
+    PieceBufferPool* pool;
+
+    void operator()(char* buffer) const;
+};
+
+/*
+ * Непрерывный буфер под данные одной части, при уничтожении возвращается в пул
+ */
+using PieceBuffer = std::unique_ptr<char[], PieceBufferDeleter>;
+
+/*
+ * Пул буферов одинакового размера для скачиваемых частей.
+ * Вся память пула резервируется одним отображением, буферы выровнены по границе страницы,
+ * физическая память выделяется при первом обращении. Количество буферов ограничено,
+ * поэтому пул задает жесткий предел памяти под скачиваемые части.
+ * Освобожденные буферы хранятся в lock-free стеке, Acquire и Release можно вызывать из любых потоков.
+ */
+class PieceBufferPool {
+public:
+    PieceBufferPool(size_t bufferSize, size_t maxBuffers);
+    ~PieceBufferPool();
+
+    PieceBufferPool(const PieceBufferPool&) = delete;
+    PieceBufferPool& operator=(const PieceBufferPool&) = delete;
+
+    /*
+     * Пустой указатель, если все буферы заняты
+     */
+    PieceBuffer Acquire();
+
+    size_t BufferSize() const;
+
+    size_t Capacity() const;
+
+    size_t InUse() const;
+
+private:
+    friend struct PieceBufferDeleter;
+
+    char* memory_;
+    size_t bufferSize_;  // размер буфера, округленный до размера страницы
+    const uint32_t maxBuffers_;
+    std::atomic<uint32_t> freshBuffers_;  // сколько буферов уже выдавалось хотя бы раз
+    std::atomic<uint64_t> freeHead_;  // старшие 32 бита -- счетчик против ABA, младшие -- номер буфера + 1
+    std::unique_ptr<std::atomic<uint32_t>[]> next_;
+    std::atomic<size_t> inUse_;
+
+    void Release(char* buffer);
+};
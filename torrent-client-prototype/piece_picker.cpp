@@ -0,0 +1,220 @@
+#include "piece_picker.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+// столько частей из корзин проверяется, прежде чем перейти к перебору общих с пиром частей
+constexpr size_t MAX_BUCKET_PROBES = 128;
+}
+
+PiecePicker::PiecePicker(size_t piecesCount) : PiecePicker(piecesCount, 0, piecesCount) {
+}
+
+PiecePicker::PiecePicker(size_t piecesCount, size_t firstPiece, size_t endPiece) :
+        first_(firstPiece),
+        end_(std::min(endPiece, piecesCount)),
+        wanted_(piecesCount),
+        availability_(end_ - first_, 0),
+        positions_(end_ - first_, 0),
+        states_(end_ - first_, PieceState::NotWanted),
+        priorities_(end_ - first_, 0),
+        buckets_(1),
+        wantedCount_(0),
+        random_(std::random_device()()) {
+}
+
+void PiecePicker::AddWanted(size_t pieceIndex) {
+    if (states_.at(pieceIndex - first_) != PieceState::NotWanted) return;
+    states_[pieceIndex - first_] = PieceState::Wanted;
+    wanted_.Set(pieceIndex);
+    ++wantedCount_;
+    Insert(pieceIndex);
+}
+
+std::optional<size_t> PiecePicker::Pick(const PeerPiecesAvailability& peer) {
+    auto pieceIndex = Find(peer);
+    if (pieceIndex) {
+        PickPiece(*pieceIndex);
+    }
+    return pieceIndex;
+}
+
+std::optional<size_t> PiecePicker::Find(const PeerPiecesAvailability& peer) {
+    // частый случай ближе к концу загрузки: у пира нет ничего нужного, это видно за один проход по словам
+    if (!Bitfield::IntersectAny(peer.Pieces(), wanted_, first_, end_)) {
+        return std::nullopt;
+    }
+
+    for (auto it = priorityPieces_.begin(); it != priorityPieces_.end(); ++it) {
+        size_t pieceIndex = it->second;
+        if (states_[pieceIndex - first_] == PieceState::Wanted && peer.IsPieceAvailable(pieceIndex)) {
+            return pieceIndex;
+        }
+    }
+
+    // в корзине 0 лежат части, которых нет ни у одного пира, в том числе и у этого
+    size_t probes = 0;
+    for (size_t count = 1; count < buckets_.size(); ++count) {
+        for (uint32_t pieceIndex : buckets_[count]) {
+            if (peer.IsPieceAvailable(pieceIndex)) {
+                return pieceIndex;
+            }
+            if (++probes == MAX_BUCKET_PROBES) {
+                return FindRarestCommon(peer);
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+void PiecePicker::Return(size_t pieceIndex) {
+    if (states_.at(pieceIndex - first_) != PieceState::Picked) return;
+    states_[pieceIndex - first_] = PieceState::Wanted;
+    wanted_.Set(pieceIndex);
+    ++wantedCount_;
+    Insert(pieceIndex);
+}
+
+bool PiecePicker::Take(size_t pieceIndex) {
+    if (states_.at(pieceIndex - first_) != PieceState::Wanted) return false;
+    PickPiece(pieceIndex);
+    return true;
+}
+
+void PiecePicker::PeerConnected(const PeerPiecesAvailability& peer) {
+    peer.Pieces().ForEachSet([this] (size_t pieceIndex) {
+        ChangeAvailability(pieceIndex, 1);
+    }, first_, end_);
+}
+
+void PiecePicker::PeerDisconnected(const PeerPiecesAvailability& peer) {
+    peer.Pieces().ForEachSet([this] (size_t pieceIndex) {
+        ChangeAvailability(pieceIndex, -1);
+    }, first_, end_);
+}
+
+void PiecePicker::PieceAvailable(size_t pieceIndex) {
+    if (pieceIndex >= first_ && pieceIndex < end_) {
+        ChangeAvailability(pieceIndex, 1);
+    }
+}
+
+void PiecePicker::SetPriority(size_t pieceIndex, int priority) {
+    bool wanted = states_.at(pieceIndex - first_) == PieceState::Wanted;
+    if (wanted) Erase(pieceIndex);
+    priorities_[pieceIndex - first_] = priority;
+    if (wanted) Insert(pieceIndex);
+}
+
+size_t PiecePicker::Availability(size_t pieceIndex) const {
+    return availability_.at(pieceIndex - first_);
+}
+
+size_t PiecePicker::WantedCount() const {
+    return wantedCount_;
+}
+
+int64_t PiecePicker::Rank(size_t pieceIndex) const {
+    if (IsPrioritized(pieceIndex)) {
+        return -static_cast<int64_t>(priorities_[pieceIndex - first_]);
+    }
+    return availability_.at(pieceIndex - first_);
+}
+
+int64_t PiecePicker::MinRank() const {
+    if (!priorityPieces_.empty()) {
+        return -static_cast<int64_t>(priorityPieces_.begin()->first);
+    }
+    for (size_t count = 1; count < buckets_.size(); ++count) {
+        if (!buckets_[count].empty()) {
+            return count;
+        }
+    }
+    return NO_RANK;
+}
+
+bool PiecePicker::IsPrioritized(size_t pieceIndex) const {
+    return priorities_[pieceIndex - first_] > 0;
+}
+
+size_t PiecePicker::PickPiece(size_t pieceIndex) {
+    Erase(pieceIndex);
+    states_[pieceIndex - first_] = PieceState::Picked;
+    wanted_.Reset(pieceIndex);
+    --wantedCount_;
+    return pieceIndex;
+}
+
+std::optional<size_t> PiecePicker::FindRarestCommon(const PeerPiecesAvailability& peer) {
+    const Bitfield& pieces = peer.Pieces();
+    size_t end = std::min(pieces.Size(), end_);
+    if (end <= first_) {
+        return std::nullopt;
+    }
+    // со случайного места, чтобы разные соединения не выбирали одни и те же части
+    size_t start = std::uniform_int_distribution<size_t>(first_, end - 1)(random_);
+    std::optional<size_t> rarest;
+    auto scan = [&] (size_t from, size_t to) {
+        for (size_t pieceIndex = Bitfield::FindFirstCommon(pieces, wanted_, from, to); pieceIndex < to;
+             pieceIndex = Bitfield::FindFirstCommon(pieces, wanted_, pieceIndex + 1, to)) {
+            if (!rarest || availability_[pieceIndex - first_] < availability_[*rarest - first_]) {
+                rarest = pieceIndex;
+                // реже, чем у одного этого пира, не бывает
+                if (availability_[pieceIndex - first_] <= 1) return;
+            }
+        }
+    };
+    scan(start, end);
+    if (!rarest || availability_[*rarest - first_] > 1) {
+        scan(first_, start);
+    }
+    return rarest;
+}
+
+void PiecePicker::Insert(size_t pieceIndex) {
+    if (IsPrioritized(pieceIndex)) {
+        priorityPieces_.emplace(priorities_[pieceIndex - first_], pieceIndex);
+        return;
+    }
+
+    size_t count = availability_[pieceIndex - first_];
+    if (count >= buckets_.size()) {
+        buckets_.resize(count + 1);
+    }
+    auto& bucket = buckets_[count];
+    bucket.push_back(pieceIndex);
+    positions_[pieceIndex - first_] = bucket.size() - 1;
+
+    // случайная позиция внутри корзины, чтобы разные пиры не выбирали одни и те же части
+    size_t randomPosition = std::uniform_int_distribution<size_t>(0, bucket.size() - 1)(random_);
+    std::swap(bucket[randomPosition], bucket.back());
+    positions_[bucket[randomPosition] - first_] = randomPosition;
+    positions_[bucket.back() - first_] = bucket.size() - 1;
+}
+
+void PiecePicker::Erase(size_t pieceIndex) {
+    if (IsPrioritized(pieceIndex)) {
+        auto range = priorityPieces_.equal_range(priorities_[pieceIndex - first_]);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == pieceIndex) {
+                priorityPieces_.erase(it);
+                break;
+            }
+        }
+        return;
+    }
+
+    auto& bucket = buckets_[availability_[pieceIndex - first_]];
+    uint32_t position = positions_[pieceIndex - first_];
+    bucket[position] = bucket.back();
+    positions_[bucket[position] - first_] = position;
+    bucket.pop_back();
+}
+
+void PiecePicker::ChangeAvailability(size_t pieceIndex, int delta) {
+    if (delta < 0 && availability_[pieceIndex - first_] == 0) return;
+    bool wanted = states_[pieceIndex - first_] == PieceState::Wanted;
+    if (wanted) Erase(pieceIndex);
+    availability_[pieceIndex - first_] += delta;
+    if (wanted) Insert(pieceIndex);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "bitfield.h"
+#include "peer_pieces_availability.h"
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <optional>
+#include <random>
+#include <vector>
+
+/*
+ * Выбор следующей части для загрузки по принципу "сначала самые редкие".
+ * Для каждой части хранится число пиров, у которых она есть. Нужные нам части разложены по корзинам
+ * по этому числу, внутри корзины порядок случайный, так что поиск самой редкой части, которая есть у пира,
+ * обычно заканчивается на первых элементах первой непустой корзины. Если у пира мало нужных частей,
+ * вместо обхода корзин перебираются только общие части по пересечению битовых полей.
+ * Части с ненулевым приоритетом выдаются раньше всех остальных, независимо от их редкости.
+ * Выбор может вестись только среди части раздачи, номера частей при этом остаются общими.
+ * Класс не потокобезопасен.
+ */
+class PiecePicker {
+public:
+    static constexpr int64_t NO_RANK = std::numeric_limits<int64_t>::max();
+
+    explicit PiecePicker(size_t piecesCount);
+
+    /*
+     * Выбор среди частей [firstPiece, endPiece) раздачи из piecesCount частей. Границы кратны Bitfield::BLOCK_BITS,
+     * endPiece может быть не меньше piecesCount
+     */
+    PiecePicker(size_t piecesCount, size_t firstPiece, size_t endPiece);
+
+    /*
+     * Отметить часть как нужную для загрузки
+     */
+    void AddWanted(size_t pieceIndex);
+
+    /*
+     * Выбрать самую редкую из нужных частей, которые есть у пира, и снять ее с учета
+     */
+    std::optional<size_t> Pick(const PeerPiecesAvailability& peer);
+
+    /*
+     * То же, что Pick, но часть остается на учете: взять ее можно через Take
+     */
+    std::optional<size_t> Find(const PeerPiecesAvailability& peer);
+
+    /*
+     * Вернуть выданную часть обратно, например, если пир отключился, не докачав ее
+     */
+    void Return(size_t pieceIndex);
+
+    /*
+     * Снять нужную часть с учета без выбора, например, если ее докачало соединение, у которого ее уже забрали.
+     * false, если часть не была нужной
+     */
+    bool Take(size_t pieceIndex);
+
+    void PeerConnected(const PeerPiecesAvailability& peer);
+
+    void PeerDisconnected(const PeerPiecesAvailability& peer);
+
+    void PieceAvailable(size_t pieceIndex);
+
+    void SetPriority(size_t pieceIndex, int priority);
+
+    size_t Availability(size_t pieceIndex) const;
+
+    size_t WantedCount() const;
+
+    /*
+     * Порядок выдачи части: меньше -- раньше. Для части с приоритетом это минус приоритет,
+     * для остальных -- число пиров, у которых она есть
+     */
+    int64_t Rank(size_t pieceIndex) const;
+
+    /*
+     * Наименьший Rank среди нужных частей, которые есть хотя бы у одного пира, NO_RANK, если таких нет
+     */
+    int64_t MinRank() const;
+
+private:
+    enum class PieceState : uint8_t {
+        NotWanted,
+        Wanted,
+        Picked,
+    };
+
+    const size_t first_;
+    const size_t end_;
+    Bitfield wanted_;
+    // по номерам частей, отсчитанным от first_
+    std::vector<uint32_t> availability_;
+    std::vector<uint32_t> positions_;  // позиция части внутри своей корзины
+    std::vector<PieceState> states_;
+    std::vector<int> priorities_;
+    std::vector<std::vector<uint32_t>> buckets_;  // buckets_[k] -- нужные части, которые есть ровно у k пиров
+    std::multimap<int, size_t, std::greater<>> priorityPieces_;
+    size_t wantedCount_;
+    std::mt19937 random_;
+
+    bool IsPrioritized(size_t pieceIndex) const;
+
+    size_t PickPiece(size_t pieceIndex);
+
+    /*
+     * Самая редкая из общих с пиром нужных частей, перебор начинается со случайной части
+     */
+    std::optional<size_t> FindRarestCommon(const PeerPiecesAvailability& peer);
+
+    void Insert(size_t pieceIndex);
+
+    void Erase(size_t pieceIndex);
+
+    void ChangeAvailability(size_t pieceIndex, int delta);
+};
@@ -4,63 +4,404 @@
 #include <fstream>
 #include <filesystem>
 #include <iostream>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <thread>
+#include <atomic>
+
+namespace {
+constexpr size_t DISK_WRITER_THREADS = 2;
+constexpr size_t DISK_QUEUE_DEPTH = 64;
+constexpr size_t HASH_QUEUE_DEPTH = 64;
+constexpr size_t MAX_OPEN_FILES = 64;
+constexpr size_t ENDGAME_THRESHOLD = 16;
+constexpr auto PIECE_LEASE_TIMEOUT = std::chrono::seconds(30);
+constexpr size_t MAX_SHARDS = 16;
+constexpr size_t MIN_SHARD_PIECES = 1024;
+constexpr size_t MAX_PICK_ATTEMPTS = 4;
+
+/*
+ * Буферов столько, сколько целых частей помещается в бюджет, но хотя бы один
+ */
+size_t PieceBuffersCount(const TorrentFile& tf, uint64_t memoryBudget) {
+    return std::max<uint64_t>(memoryBudget / tf.pieceLength, 1);
+}
+
+/*
+ * Длина сегмента очереди, кратная Bitfield::BLOCK_BITS, чтобы сегменты проверялись по целым блокам битового поля.
+ * Небольшая раздача целиком помещается в один сегмент
+ */
+size_t ShardLength(size_t piecesCount) {
+    size_t shards = std::clamp<size_t>(piecesCount / MIN_SHARD_PIECES, 1, MAX_SHARDS);
+    size_t length = std::max<size_t>((piecesCount + shards - 1) / shards, 1);
+    return (length + Bitfield::BLOCK_BITS - 1) / Bitfield::BLOCK_BITS * Bitfield::BLOCK_BITS;
+}
+}
+
+PieceStorage::Shard::Shard(size_t piecesCount, size_t firstPiece, size_t endPiece) :
+        picker(piecesCount, firstPiece, endPiece),
+        wanted(0),
+        leased(0),
+        returnedCount(0),
+        minRank(PiecePicker::NO_RANK) {
+}
+
+void PieceStorage::Shard::PublishCounts() {
+    wanted = picker.WantedCount();
+    leased = leases.size();
+    returnedCount = returned.size();
+    minRank = picker.MinRank();
+}
+
+PieceStorage::PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory, int percent, bool resume, uint64_t memoryBudget) : bufferPool_(tf.pieceLength, PieceBuffersCount(tf, memoryBudget)), shardLength_(ShardLength(tf.pieceHashes.size())), leaseOwners_(new std::atomic<LeaseOwner>[tf.pieceHashes.size()]), files_(tf, outputDirectory, MAX_OPEN_FILES), pieceLength_(tf.pieceLength), readingCounter_(0), memoryBudget_(memoryBudget), memoryUsed_(0), piecesLeft_(0), totalPiecesCount_(tf.pieceHashes.size()), totalLength_(tf.length), havePieces_(tf.pieceHashes.size()), bytesLeft_(tf.length), bytesDownloaded_(0), endgameThreshold_(ENDGAME_THRESHOLD), duplicateBytes_(0), cancelsSent_(0), piecesInProgressGauge_(MetricsRegistry::Global().GetGauge("torrent_pieces_in_progress", "Pieces with an attached buffer that are not yet saved")), leasesExpired_(MetricsRegistry::Global().GetCounter("torrent_piece_leases_expired_total", "Pieces returned to the queue because their connection stopped receiving blocks")), memoryUsedGauge_(MetricsRegistry::Global().GetGauge("torrent_piece_memory_bytes", "Bytes reserved for pieces being downloaded, verified or written")), memoryStalls_(MetricsRegistry::Global().GetCounter("torrent_piece_memory_stalls_total", "Times a new piece was not started because the memory budget was exhausted")), pieceDownloadTime_(MetricsRegistry::Global().GetHistogram("torrent_piece_download_seconds", "Time from starting a piece to its successful hash check", Histogram::LatencyBounds())), bytesUploaded_(MetricsRegistry::Global().GetCounter("torrent_bytes_uploaded_total", "Block bytes sent to peers")), diskWriter_(DISK_WRITER_THREADS, DISK_QUEUE_DEPTH), hashPool_(0, HASH_QUEUE_DEPTH) {
+    for (size_t first = 0; first < tf.pieceHashes.size(); first += shardLength_) {
+        shards_.push_back(std::make_unique<Shard>(tf.pieceHashes.size(), first, first + shardLength_));
+    }
+    for (size_t pieceIdx = 0; pieceIdx < tf.pieceHashes.size(); ++pieceIdx) {
+        leaseOwners_[pieceIdx] = 0;
+    }
+    MetricsRegistry::Global().GetGauge("torrent_piece_memory_budget_bytes", "Memory budget for pieces being downloaded, verified or written").Set(memoryBudget);
+
+    if (!std::filesystem::exists(outputDirectory)) {
+        std::filesystem::create_directories(outputDirectory);
+        std::cout << "Creat directories" << std::endl;
+    } else {
+        std::cout << "Have directories" << std::endl;
+    }
+
+    bool outputExists = files_.AnyExists();
+    bool sizesMatch = files_.SizesMatch();
+    files_.Allocate();
+
+    // битовая карта скачанных частей ведется всегда, но используется только в режиме продолжения загрузки
+    resume_ = std::make_unique<ResumeData>(outputDirectory / (tf.name + ".resume"), tf);
+    std::vector<bool> completed(tf.pieceHashes.size(), false);
+    if (resume && outputExists) {
+        if (resume_->WasClean() && sizesMatch) {
+            for (size_t pieceIdx = 0; pieceIdx < completed.size(); ++pieceIdx) {
+                completed[pieceIdx] = resume_->IsCompleted(pieceIdx);
+            }
+        } else {
+            std::cout << "Rechecking existing data" << std::endl;
+            completed = ResumeData::Recheck(files_, tf, std::max(std::thread::hardware_concurrency(), 1u));
+            resume_->Assign(completed);
+        }
+    } else {
+        resume_->Clear();
+    }
 
-PieceStorage::PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory, int percent) : pieceLength_(tf.pieceLength), readingCounter_(0), totalPiecesCount_(tf.pieceHashes.size()) {
     int64_t lastPieceLength = tf.length % tf.pieceLength;
     if (lastPieceLength == 0) lastPieceLength = tf.pieceLength;
 
     int countPieces = (double)percent * (double)tf.pieceHashes.size() / 100.0;
     std::cout << "Count Pieces = " << countPieces << std::endl;
+    pieces_.resize(tf.pieceHashes.size());
     for (int pieceIdx = 0; pieceIdx < countPieces; ++pieceIdx) {
-        remainPieces_.push(std::make_shared<Piece>(
+        if (completed[pieceIdx]) {
+            savedPieceId_.push_back(pieceIdx);
+            havePieces_.Set(pieceIdx);
+            bytesLeft_ -= PieceLength(pieceIdx);
+            continue;
+        }
+        pieces_[pieceIdx] = std::make_shared<Piece>(
             pieceIdx, 
             (pieceIdx == (int)tf.pieceHashes.size() - 1 ? lastPieceLength : tf.pieceLength), 
-            tf.pieceHashes[pieceIdx]
-        ));
-    } 
+            std::string(tf.pieceHashes[pieceIdx])
+        );
+        ShardOf(pieceIdx).picker.AddWanted(pieceIdx);
+        ++piecesLeft_;
+    }
+    for (auto& shard : shards_) {
+        shard->PublishCounts();
+    }
+    if (!savedPieceId_.empty()) {
+        std::cout << "Resuming, " << savedPieceId_.size() << " pieces are already downloaded" << std::endl;
+    }
 
-    if (!std::filesystem::exists(outputDirectory)) {
-        std::filesystem::create_directories(outputDirectory);
-        std::cout << "Creat directories" << std::endl;
-    } else {
-        std::cout << "Have directories" << std::endl;
+    std::cout << "Files = " << files_.FilesCount() << ", total size = " << tf.length << std::endl;
+}
+
+PiecePtr PieceStorage::GetNextPieceToDownload(const PeerPiecesAvailability& availability, LeaseOwner owner) {
+    // возвращенные части держат буфер и память из бюджета, их выгоднее докачать, чем начинать новые:
+    // иначе при исчерпанном бюджете выдавать будет нечего
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        Shard& shard = *shards_[(owner + i) % shards_.size()];
+        if (shard.returnedCount == 0) {
+            continue;
+        }
+        std::lock_guard lock(shard.mtx);
+        if (auto pieceIndex = TakeReturnedPiece(shard, availability)) {
+            return LeasePiece(shard, *pieceIndex, owner);
+        }
     }
 
-    // create file and expand file size
-    std::filesystem::path outputFilePath = outputDirectory / tf.name;
+    // самая редкая часть по всей раздаче. Сегменты перебираются по возрастанию нижней границы редкости их частей,
+    // при равенстве -- начиная с закрепленного за owner, чтобы разные соединения обычно не ждали друг друга.
+    // Перебор заканчивается, как только в оставшихся сегментах не может быть части реже уже найденной
+    std::array<std::pair<int64_t, size_t>, MAX_SHARDS> order;
+    size_t shardsCount = 0;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        const Shard& shard = *shards_[(owner + i) % shards_.size()];
+        if (shard.wanted > 0) {
+            order[shardsCount++] = {shard.minRank, i};
+        }
+    }
+    std::sort(order.begin(), order.begin() + shardsCount);
 
-    if (!std::filesystem::exists(outputFilePath)) {
-        std::ofstream tmp(outputFilePath, std::ios::binary);
-        tmp.close();
+    for (size_t attempt = 0; attempt < MAX_PICK_ATTEMPTS; ++attempt) {
+        Shard* bestShard = nullptr;
+        size_t bestPiece = 0;
+        int64_t bestRank = PiecePicker::NO_RANK;
+        for (size_t k = 0; k < shardsCount && order[k].first < bestRank; ++k) {
+            Shard& shard = *shards_[(owner + order[k].second) % shards_.size()];
+            std::lock_guard lock(shard.mtx);
+            auto pieceIndex = shard.picker.Find(availability);
+            if (!pieceIndex || shard.picker.Rank(*pieceIndex) >= bestRank) {
+                continue;
+            }
+            int64_t rank = shard.picker.Rank(*pieceIndex);
+            if (k + 1 == shardsCount || order[k + 1].first >= rank) {
+                // в остальных сегментах части не реже этой, берем ее, не отпуская блокировку
+                shard.picker.Take(*pieceIndex);
+                return LeasePiece(shard, *pieceIndex, owner);
+            }
+            bestShard = &shard;
+            bestPiece = *pieceIndex;
+            bestRank = rank;
+        }
+        if (!bestShard) {
+            return nullptr;
+        }
+        std::lock_guard lock(bestShard->mtx);
+        if (bestShard->picker.Take(bestPiece)) {
+            return LeasePiece(*bestShard, bestPiece, owner);
+        }
+        // часть успели выдать другому соединению, ищем заново
     }
+    return nullptr;
+}
 
-    std::filesystem::resize_file(outputFilePath, tf.length);
-    outputFile_.open(outputFilePath, std::ios::binary | std::ios::in | std::ios::out);
+PiecePtr PieceStorage::LeasePiece(Shard& shard, size_t pieceIndex, LeaseOwner owner) {
+    const PiecePtr& piece = pieces_[pieceIndex];
+    // часть, возвращенная другим соединением, уже имеет буфер с частью данных
+    if (!piece->HasBuffer()) {
+        if (!ReserveMemory(piece->GetLength())) {
+            memoryStalls_.Add();
+            shard.picker.Return(pieceIndex);
+            return nullptr;
+        }
+        PieceBuffer buffer = bufferPool_.Acquire();
+        if (!buffer) {
+            ReleaseMemory(piece->GetLength());
+            shard.picker.Return(pieceIndex);
+            return nullptr;
+        }
+        piecesInProgressGauge_.Set(++readingCounter_);
+        piece->AttachBuffer(std::move(buffer));
+    }
+    piece->Touch(std::chrono::steady_clock::now());
+    shard.leases[pieceIndex] = owner;
+    leaseOwners_[pieceIndex] = owner;
+    shard.PublishCounts();
+    return piece;
+}
 
-    std::cout << "File size = " << std::filesystem::file_size(outputFilePath) << std::endl;
-    if (std::filesystem::file_size(outputFilePath) != tf.length) {
-        throw std::runtime_error(std::string("can't expand file size to ") + std::to_string(tf.length));
+bool PieceStorage::HoldsLease(size_t pieceIndex, LeaseOwner owner) const {
+    return pieceIndex < pieces_.size() && leaseOwners_[pieceIndex] == owner;
+}
+
+void PieceStorage::ReleaseLeases(LeaseOwner owner, const std::vector<PiecePtr>& pieces) {
+    for (const PiecePtr& piece : pieces) {
+        size_t pieceIndex = piece->GetIndex();
+        if (leaseOwners_[pieceIndex] != owner) {
+            continue;
+        }
+        Shard& shard = ShardOf(pieceIndex);
+        std::lock_guard lock(shard.mtx);
+        auto it = shard.leases.find(pieceIndex);
+        if (it != shard.leases.end() && it->second == owner) {
+            shard.leases.erase(it);
+            ReturnPiece(shard, pieceIndex);
+            shard.PublishCounts();
+        }
     }
 }
 
-PiecePtr PieceStorage::GetNextPieceToDownload() {
-    std::lock_guard lock(mtx_);
-    readingCounter_++;
-    auto result = remainPieces_.front();
-    remainPieces_.pop();
-    return result;
+size_t PieceStorage::ReclaimExpiredLeases(std::chrono::steady_clock::time_point now) {
+    size_t reclaimed = 0;
+    for (auto& shard : shards_) {
+        if (shard->leased == 0) {
+            continue;
+        }
+        std::lock_guard lock(shard->mtx);
+        for (auto it = shard->leases.begin(); it != shard->leases.end();) {
+            if (now - pieces_[it->first]->LastProgress() > PIECE_LEASE_TIMEOUT) {
+                size_t pieceIndex = it->first;
+                it = shard->leases.erase(it);
+                ReturnPiece(*shard, pieceIndex);
+                ++reclaimed;
+                leasesExpired_.Add();
+            } else {
+                ++it;
+            }
+        }
+        shard->PublishCounts();
+    }
+    return reclaimed;
+}
+
+PieceStorage::Shard& PieceStorage::ShardOf(size_t pieceIndex) {
+    return *shards_[pieceIndex / shardLength_];
+}
+
+void PieceStorage::ReturnPiece(Shard& shard, size_t pieceIndex) {
+    // блоки, запрошенные прежним владельцем, снова доступны, полученные данные остаются в буфере
+    leaseOwners_[pieceIndex] = 0;
+    pieces_[pieceIndex]->ReleasePendingBlocks();
+    shard.picker.Return(pieceIndex);
+    if (pieces_[pieceIndex]->HasBuffer() &&
+        std::find(shard.returned.begin(), shard.returned.end(), pieceIndex) == shard.returned.end()) {
+        shard.returned.push_back(pieceIndex);
+    }
+}
+
+std::optional<size_t> PieceStorage::TakeReturnedPiece(Shard& shard, const PeerPiecesAvailability& availability) {
+    for (auto it = shard.returned.begin(); it != shard.returned.end();) {
+        size_t pieceIndex = *it;
+        if (!availability.IsPieceAvailable(pieceIndex)) {
+            ++it;
+            continue;
+        }
+        it = shard.returned.erase(it);
+        // часть могли выбрать обычным путем или докачать после возврата, тогда запись устарела
+        if (shard.picker.Take(pieceIndex)) {
+            return pieceIndex;
+        }
+    }
+    return std::nullopt;
+}
+
+bool PieceStorage::InEndgame() const {
+    size_t threshold = endgameThreshold_;
+    size_t leased = 0;
+    for (const auto& shard : shards_) {
+        if (shard->wanted > 0) {
+            return false;
+        }
+        leased += shard->leased;
+    }
+    return threshold > 0 && leased > 0 && leased <= threshold;
+}
+
+PiecePtr PieceStorage::GetEndgamePiece(const PeerPiecesAvailability& availability, const std::vector<PiecePtr>& exclude) {
+    if (!InEndgame()) {
+        return nullptr;
+    }
+    for (auto& shard : shards_) {
+        std::lock_guard lock(shard->mtx);
+        for (const auto& [pieceIndex, owner] : shard->leases) {
+            const PiecePtr& piece = pieces_[pieceIndex];
+            if (!availability.IsPieceAvailable(pieceIndex) || std::find(exclude.begin(), exclude.end(), piece) != exclude.end()) {
+                continue;
+            }
+            return piece;
+        }
+    }
+    return nullptr;
+}
+
+void PieceStorage::SetEndgameThreshold(size_t pieces) {
+    endgameThreshold_ = pieces;
+}
+
+void PieceStorage::DuplicateBlockReceived(size_t bytes) {
+    duplicateBytes_ += bytes;
+}
+
+void PieceStorage::CancelSent() {
+    ++cancelsSent_;
+}
+
+EndgameStats PieceStorage::GetEndgameStats() const {
+    return EndgameStats{duplicateBytes_, cancelsSent_};
+}
+
+PieceStorage::~PieceStorage() {
+    CloseOutputFile();
 }
 
 void PieceStorage::PieceProcessed(const PiecePtr& piece) {
-    std::lock_guard lock(mtx_);
-    readingCounter_--;
-    savedPieceId_.push_back(piece->GetIndex());
-    SavePieceToDisk(piece);
+    {
+        Shard& shard = ShardOf(piece->GetIndex());
+        std::lock_guard lock(shard.mtx);
+        shard.leases.erase(piece->GetIndex());
+        leaseOwners_[piece->GetIndex()] = 0;
+        // часть могли вернуть в очередь по истечении аренды, а прежний владелец все же ее докачал
+        shard.picker.Take(piece->GetIndex());
+        shard.PublishCounts();
+    }
+    hashPool_.Submit(piece, [this] (const PiecePtr& piece, bool hashMatches) {
+        PieceVerified(piece, hashMatches);
+    });
+}
+
+bool PieceStorage::BacklogFull() const {
+    return hashPool_.Full() || diskWriter_.Full();
+}
+
+uint64_t PieceStorage::MemoryUsed() const {
+    return memoryUsed_;
+}
+
+bool PieceStorage::ReserveMemory(uint64_t bytes) {
+    uint64_t used = memoryUsed_;
+    do {
+        // одна часть выдается всегда, даже если она больше бюджета, иначе загрузка остановится
+        if (used != 0 && used + bytes > memoryBudget_) {
+            return false;
+        }
+    } while (!memoryUsed_.compare_exchange_weak(used, used + bytes));
+    memoryUsedGauge_.Add(static_cast<int64_t>(bytes));
+    return true;
+}
+
+void PieceStorage::ReleaseMemory(uint64_t bytes) {
+    memoryUsed_ -= bytes;
+    memoryUsedGauge_.Add(-static_cast<int64_t>(bytes));
+}
+
+HashStats PieceStorage::GetHashStats() const {
+    return hashPool_.Stats();
+}
+
+void PieceStorage::PieceVerified(const PiecePtr& piece, bool hashMatches) {
+    if (hashMatches) {
+        pieceDownloadTime_.Observe(std::chrono::steady_clock::now() - piece->StartedAt());
+        SavePieceToDisk(piece);
+        piecesInProgressGauge_.Set(--readingCounter_);
+        return;
+    }
+
+    std::cerr << "Hash mismatch for piece " << piece->GetIndex() << std::endl;
+    piecesInProgressGauge_.Set(--readingCounter_);
+    Shard& shard = ShardOf(piece->GetIndex());
+    std::lock_guard lock(shard.mtx);
+    piece->Reset();
+    piece->ReleaseBuffer();
+    ReleaseMemory(piece->GetLength());
+    shard.picker.Return(piece->GetIndex());
+    shard.PublishCounts();
 }
 
 bool PieceStorage::QueueIsEmpty() const {
-    std::lock_guard lock(mtx_);
-    return remainPieces_.empty();
+    return std::all_of(shards_.begin(), shards_.end(), [] (const auto& shard) {
+        return shard->wanted == 0;
+    });
+}
+
+bool PieceStorage::DownloadComplete() const {
+    return piecesLeft_ == 0;
 }
 
 size_t PieceStorage::TotalPiecesCount() const {
@@ -69,9 +410,13 @@ size_t PieceStorage::TotalPiecesCount() const {
 }
 
 void PieceStorage::CloseOutputFile() {
-    std::lock_guard lock(mtx_);
-    if (outputFile_.is_open()) {
-        outputFile_.close();
+    // дожидаемся проверки и записи всех частей, обработчики завершения сами захватывают mtx_
+    hashPool_.Stop();
+    diskWriter_.Stop();
+    // битовой карте можно доверять только после того, как данные дошли до диска
+    if (files_.Close()) {
+        std::lock_guard lock(mtx_);
+        resume_->CloseClean();
     }
 }
 
@@ -81,22 +426,171 @@ const std::vector<size_t>& PieceStorage::GetPiecesSavedToDiscIndices() const {
 }
 
 size_t PieceStorage::PiecesInProgressCount() const {
-    std::lock_guard lock(mtx_);
     return readingCounter_;
 }
 
+void PieceStorage::PeerConnected(const PeerPiecesAvailability& availability) {
+    for (auto& shard : shards_) {
+        std::lock_guard lock(shard->mtx);
+        shard->picker.PeerConnected(availability);
+        shard->PublishCounts();
+    }
+}
+
+void PieceStorage::PeerDisconnected(const PeerPiecesAvailability& availability) {
+    for (auto& shard : shards_) {
+        std::lock_guard lock(shard->mtx);
+        shard->picker.PeerDisconnected(availability);
+        shard->PublishCounts();
+    }
+}
+
+void PieceStorage::PieceAvailable(size_t pieceIndex) {
+    if (pieceIndex >= pieces_.size()) {
+        return;
+    }
+    Shard& shard = ShardOf(pieceIndex);
+    std::lock_guard lock(shard.mtx);
+    shard.picker.PieceAvailable(pieceIndex);
+    shard.PublishCounts();
+}
+
+void PieceStorage::SetPiecePriority(size_t pieceIndex, int priority) {
+    Shard& shard = *shards_.at(pieceIndex / shardLength_);
+    std::lock_guard lock(shard.mtx);
+    shard.picker.SetPriority(pieceIndex, priority);
+    shard.PublishCounts();
+}
+
 size_t PieceStorage::PiecesSavedToDiscCount() const {
     std::lock_guard lock(mtx_);
     return savedPieceId_.size();
 }
 
+uint64_t PieceStorage::BytesDownloaded() const {
+    std::lock_guard lock(mtx_);
+    return bytesDownloaded_;
+}
+
+uint64_t PieceStorage::BytesLeft() const {
+    std::lock_guard lock(mtx_);
+    return bytesLeft_;
+}
+
+bool PieceStorage::HasPiece(size_t pieceIndex) const {
+    std::lock_guard lock(mtx_);
+    return havePieces_.Test(pieceIndex);
+}
+
+bool PieceStorage::IsInteresting(const PeerPiecesAvailability& availability) const {
+    std::lock_guard lock(mtx_);
+    return Bitfield::DifferenceAny(availability.Pieces(), havePieces_);
+}
+
+std::vector<size_t> PieceStorage::SavedPiecesSince(size_t from) const {
+    std::lock_guard lock(mtx_);
+    if (from >= savedPieceId_.size()) {
+        return {};
+    }
+    return std::vector<size_t>(savedPieceId_.begin() + from, savedPieceId_.end());
+}
+
+std::vector<FileRegion> PieceStorage::GetBlockRegions(size_t pieceIndex, size_t offset, size_t length) {
+    if (!HasPiece(pieceIndex) || offset + length > static_cast<size_t>(PieceLength(pieceIndex))) {
+        return {};
+    }
+    std::vector<FileRegion> regions;
+    try {
+        for (const FileSpan& span : files_.Spans(static_cast<int64_t>(pieceIndex) * pieceLength_ + offset, length)) {
+            regions.push_back(FileRegion{files_.Open(span.fileIndex), span.fileOffset, span.length});
+        }
+    } catch (const std::runtime_error& e) {
+        return {};
+    }
+    return regions;
+}
+
+void PieceStorage::BlockUploaded(size_t bytes) {
+    bytesUploaded_.Add(bytes);
+}
+
+uint64_t PieceStorage::BytesUploaded() const {
+    return bytesUploaded_.Value();
+}
+
+int64_t PieceStorage::PieceLength(size_t pieceIndex) const {
+    return std::min<int64_t>(pieceLength_, totalLength_ - static_cast<int64_t>(pieceIndex) * pieceLength_);
+}
+
 void PieceStorage::SavePieceToDisk(const PiecePtr& piece) {
-    if (outputFile_.is_open()) {
-        outputFile_.seekp(piece->GetIndex() * pieceLength_);
-        auto data = piece->GetData();
-        outputFile_.write(data.c_str(), data.size());
-        std::cout << "Download piece : " << piece->GetIndex() << std::endl;
-    } else {
-        throw std::runtime_error("output file closed");
+    size_t pieceIndex = piece->GetIndex();
+    std::string_view data = piece->GetData();
+
+    // дескрипторы открываются до постановки запросов, чтобы при ошибке не осталось частично записанной части
+    std::vector<FileSpan> spans;
+    std::vector<FileHandlePtr> handles;
+    try {
+        spans = files_.Spans(static_cast<int64_t>(pieceIndex) * pieceLength_, data.size());
+        for (const auto& span : spans) {
+            handles.push_back(files_.Open(span.fileIndex));
+        }
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        PieceSaved(pieceIndex, EIO);
+        return;
     }
+
+    // часть, пересекающая границы файлов, пишется несколькими запросами, по одному на файл.
+    // Часть считается сохраненной, когда завершится последний из них
+    struct SaveState {
+        std::atomic<size_t> remaining;
+        std::atomic<int> error;
+    };
+    auto state = std::make_shared<SaveState>();
+    state->remaining = spans.size();
+    state->error = 0;
+
+    // данные пишутся прямо из буфера части, буфер освобождается после окончания записи
+    for (size_t spanIdx = 0; spanIdx < spans.size(); ++spanIdx) {
+        const FileSpan& span = spans[spanIdx];
+        diskWriter_.Submit(DiskWriteRequest{
+            std::move(handles[spanIdx]),
+            span.fileOffset,
+            data.substr(span.dataOffset, span.length),
+            [this, pieceIndex, state] (int error) {
+                if (error != 0) {
+                    state->error = error;
+                }
+                if (--state->remaining == 0) {
+                    PieceSaved(pieceIndex, state->error);
+                }
+            }
+        });
+    }
+}
+
+void PieceStorage::PieceSaved(size_t pieceIndex, int error) {
+    if (error != 0) {
+        // данные потеряны, часть придется скачать заново
+        std::cerr << "Failed to save piece " << pieceIndex << ": " << std::strerror(error) << std::endl;
+        Shard& shard = ShardOf(pieceIndex);
+        std::lock_guard lock(shard.mtx);
+        pieces_[pieceIndex]->Reset();
+        pieces_[pieceIndex]->ReleaseBuffer();
+        ReleaseMemory(pieces_[pieceIndex]->GetLength());
+        shard.picker.Return(pieceIndex);
+        shard.PublishCounts();
+        return;
+    }
+
+    std::lock_guard lock(mtx_);
+    pieces_[pieceIndex]->ReleaseBuffer();
+    ReleaseMemory(pieces_[pieceIndex]->GetLength());
+    resume_->MarkCompleted(pieceIndex);
+    savedPieceId_.push_back(pieceIndex);
+    havePieces_.Set(pieceIndex);
+    bytesDownloaded_ += pieces_[pieceIndex]->GetLength();
+    bytesLeft_ -= pieces_[pieceIndex]->GetLength();
+    --piecesLeft_;
+    std::cout << "Download piece : " << pieceIndex << std::endl;
 }
@@ -2,45 +2,277 @@
 
 #include "torrent_file.h"
 #include "piece.h"
-#include <queue>
+#include "piece_picker.h"
+#include "bitfield.h"
+#include "peer_pieces_availability.h"
+#include "disk_writer.h"
+#include "hash_pool.h"
+#include "piece_buffer_pool.h"
+#include "resume_data.h"
+#include "file_storage.h"
+#include "metrics.h"
 #include <string>
-#include <unordered_set>
+#include <unordered_map>
+#include <chrono>
 #include <mutex>
-#include <fstream>
+#include <atomic>
 #include <filesystem>
+#include <memory>
+#include <optional>
+#include <vector>
 
 /*
- * Хранилище информации о частях скачиваемого файла.
- * В этом классе отслеживается информация о том, какие части файла осталось скачать
+ * Идентификатор соединения, которому выдана часть
+ */
+using LeaseOwner = uint64_t;
+
+/*
+ * Статистика режима endgame
+ */
+struct EndgameStats {
+    uint64_t duplicateBytes = 0;  // получено блоков, которые уже были скачаны у других пиров
+    uint64_t cancelsSent = 0;
+};
+
+/*
+ * Хранилище информации о частях скачиваемой раздачи.
+ * В этом классе отслеживается информация о том, какие части файла осталось скачать,
+ * и у скольких пиров есть каждая из частей.
+ * Очередь частей разбита на сегменты по диапазонам номеров, у каждого сегмента своя блокировка, так что соединения,
+ * берущие и возвращающие части, обычно не мешают друг другу. Счетчики и владельцы аренды читаются без блокировок
  */
 class PieceStorage {
 public:
-    PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory, int percent);
+    static constexpr uint64_t DEFAULT_MEMORY_BUDGET = 512 << 20;
+
+    /*
+     * resume -- продолжить загрузку: части, уже скачанные в outputDirectory, берутся из битовой карты
+     * (если прошлый запуск завершился корректно) или из проверки хешей существующего файла.
+     * memoryBudget -- сколько байт могут занимать части от выдачи соединению до записи на диск,
+     * включая запрошенные блоки, очередь проверки хешей и очередь записи
+     */
+    PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory, int percent, bool resume = false,
+                 uint64_t memoryBudget = DEFAULT_MEMORY_BUDGET);
+    ~PieceStorage();
+
+    /*
+     * Часть, возвращенная в очередь с уже полученными данными, иначе
+     * самая редкая из оставшихся частей, которая есть у пира, или nullptr, если у пира нет нужных нам частей
+     * или исчерпан бюджет памяти под скачиваемые части. Редкость сравнивается по всей раздаче, из равных по редкости
+     * частей берется часть из сегмента, закрепленного за owner, или ближайшего к нему. Части выдается буфер из пула, а ее длина резервируется в бюджете памяти,
+     * и то и другое возвращается после записи на диск или неудачной проверки хеша.
+     * Часть выдается в аренду соединению owner: если соединение закрылось, получило Choke или долго не получает
+     * блоков части, часть возвращается в очередь вместе с уже полученными блоками
+     */
+    PiecePtr GetNextPieceToDownload(const PeerPiecesAvailability& availability, LeaseOwner owner);
 
-    PiecePtr GetNextPieceToDownload();
+    bool HoldsLease(size_t pieceIndex, LeaseOwner owner) const;
 
+    /*
+     * Вернуть в очередь части из pieces, выданные соединению owner, остальные пропускаются. Соединение передает
+     * все части, которые качает; аренда, о которой оно забыло, истечет по таймауту
+     */
+    void ReleaseLeases(LeaseOwner owner, const std::vector<PiecePtr>& pieces);
+
+    /*
+     * Вернуть в очередь части, новых блоков которых не было дольше таймаута аренды. Вызывается периодически,
+     * возвращает количество возвращенных частей
+     */
+    size_t ReclaimExpiredLeases(std::chrono::steady_clock::time_point now);
+
+    /*
+     * Поставить скачанную часть в очередь на проверку хеша и запись. Обе операции выполняются асинхронно,
+     * часть попадает в GetPiecesSavedToDiscIndices после того, как данные проверены и записаны.
+     * Часть с неверным хешем сбрасывается и снова становится доступной для загрузки
+     */
     void PieceProcessed(const PiecePtr& piece);
 
+    /*
+     * Очередь проверки хешей или записи на диск заполнена, новые части запрашивать не нужно
+     */
+    bool BacklogFull() const;
+
+    /*
+     * Байты, занятые частями от выдачи соединению до записи на диск
+     */
+    uint64_t MemoryUsed() const;
+
+    HashStats GetHashStats() const;
+
+    /*
+     * Все нужные части выданы соединениям. Только подсказка: часть может вернуться в очередь сразу после проверки,
+     * GetNextPieceToDownload сам сообщает, что выдавать нечего
+     */
     bool QueueIsEmpty() const;
 
+    /*
+     * Все части проверены и записаны на диск
+     */
+    bool DownloadComplete() const;
+
     size_t PiecesSavedToDiscCount() const;
 
+    /*
+     * Байты частей, скачанных и сохраненных за этот запуск
+     */
+    uint64_t BytesDownloaded() const;
+
+    /*
+     * Байты раздачи, которых еще нет на диске, включая части, не выбранные для скачивания
+     */
+    uint64_t BytesLeft() const;
+
+    /*
+     * Часть проверена и сохранена на диск, ее можно отдавать пирам
+     */
+    bool HasPiece(size_t pieceIndex) const;
+
+    /*
+     * У пира есть часть, которой у нас еще нет
+     */
+    bool IsInteresting(const PeerPiecesAvailability& availability) const;
+
+    /*
+     * Сохраненные части, начиная с from-й в порядке сохранения, для рассылки Have
+     */
+    std::vector<size_t> SavedPiecesSince(size_t from) const;
+
+    /*
+     * Участки файлов с блоком сохраненной части для отдачи пиру. Пустой результат, если части нет на диске,
+     * блок выходит за границы части или файлы уже закрыты
+     */
+    std::vector<FileRegion> GetBlockRegions(size_t pieceIndex, size_t offset, size_t length);
+
+    void BlockUploaded(size_t bytes);
+
+    uint64_t BytesUploaded() const;
+
     size_t TotalPiecesCount() const;
 
     void CloseOutputFile();
 
     const std::vector<size_t>& GetPiecesSavedToDiscIndices() const;
 
+    /*
+     * Количество частей, которые скачиваются или проверяются
+     */
     size_t PiecesInProgressCount() const;
 
+    void PeerConnected(const PeerPiecesAvailability& availability);
+
+    void PeerDisconnected(const PeerPiecesAvailability& availability);
+
+    void PieceAvailable(size_t pieceIndex);
+
+    /*
+     * Endgame: все оставшиеся части уже розданы соединениям, и их не больше порога.
+     * В этом режиме недополученные блоки запрашиваются у всех пиров, у которых они есть
+     */
+    bool InEndgame() const;
+
+    /*
+     * Часть, которую уже качает другое соединение, для повторного запроса ее блоков в режиме endgame.
+     * Части из exclude не выдаются. nullptr, если режим endgame не включен или подходящих частей нет
+     */
+    PiecePtr GetEndgamePiece(const PeerPiecesAvailability& availability, const std::vector<PiecePtr>& exclude);
+
+    /*
+     * Порог входа в endgame в частях, 0 -- не использовать endgame
+     */
+    void SetEndgameThreshold(size_t pieces);
+
+    void DuplicateBlockReceived(size_t bytes);
+
+    void CancelSent();
+
+    EndgameStats GetEndgameStats() const;
+
+    /*
+     * Части с положительным приоритетом скачиваются раньше остальных, большее значение -- раньше
+     */
+    void SetPiecePriority(size_t pieceIndex, int priority);
+
 private:
-    std::queue<PiecePtr> remainPieces_;
-    std::fstream outputFile_; 
+    /*
+     * Сегмент очереди: части [firstPiece, firstPiece + длина сегмента). Выбор части и аренды под блокировкой mtx,
+     * копии счетчиков для чтения без нее обновляются в PublishCounts
+     */
+    struct Shard {
+        Shard(size_t piecesCount, size_t firstPiece, size_t endPiece);
+
+        std::mutex mtx;
+        PiecePicker picker;
+        std::unordered_map<size_t, LeaseOwner> leases;  // выданные соединениям части, не все блоки которых получены
+        std::vector<size_t> returned;  // возвращенные в очередь части с буфером, записи могут устареть
+        std::atomic<size_t> wanted;
+        std::atomic<size_t> leased;
+        std::atomic<size_t> returnedCount;
+        std::atomic<int64_t> minRank;  // PiecePicker::MinRank, нижняя граница редкости частей сегмента
+
+        void PublishCounts();
+    };
+
+    PieceBufferPool bufferPool_;
+    std::vector<PiecePtr> pieces_;
+    size_t shardLength_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::unique_ptr<std::atomic<LeaseOwner>[]> leaseOwners_;  // 0 -- часть никому не выдана
+    FileStorage files_;
     const int64_t pieceLength_;
     std::vector<size_t> savedPieceId_;
-    int64_t readingCounter_;
+    std::atomic<int64_t> readingCounter_;
+    const uint64_t memoryBudget_;
+    std::atomic<uint64_t> memoryUsed_;  // длины частей с буферами, резервируются целиком при выдаче
+    std::atomic<size_t> piecesLeft_;  // части, еще не записанные на диск
     const int64_t totalPiecesCount_;
-    mutable std::mutex mtx_;
+    const int64_t totalLength_;
+    Bitfield havePieces_;  // сохраненные части, то же, что savedPieceId_
+    uint64_t bytesLeft_;
+    uint64_t bytesDownloaded_;
+    mutable std::mutex mtx_;  // сохраненные части и учет скачанного, не очередь
+    std::unique_ptr<ResumeData> resume_;
+    std::atomic<size_t> endgameThreshold_;
+    std::atomic<uint64_t> duplicateBytes_;
+    std::atomic<uint64_t> cancelsSent_;
+    Gauge& piecesInProgressGauge_;
+    Counter& leasesExpired_;
+    Gauge& memoryUsedGauge_;
+    Counter& memoryStalls_;
+    Histogram& pieceDownloadTime_;
+    Counter& bytesUploaded_;
+    DiskWriter diskWriter_;
+    HashPool hashPool_;
+
+    Shard& ShardOf(size_t pieceIndex);
+
+    /*
+     * Вернуть часть в очередь, вызывается под блокировкой ее сегмента
+     */
+    void ReturnPiece(Shard& shard, size_t pieceIndex);
+
+    /*
+     * Выдать соединению часть, снятую с учета в picker сегмента: выделить буфер и записать аренду.
+     * Вызывается под блокировкой сегмента, при исчерпанном бюджете памяти часть возвращается в очередь
+     */
+    PiecePtr LeasePiece(Shard& shard, size_t pieceIndex, LeaseOwner owner);
+
+    /*
+     * Возвращенная часть с буфером, которая есть у пира, вызывается под блокировкой сегмента
+     */
+    std::optional<size_t> TakeReturnedPiece(Shard& shard, const PeerPiecesAvailability& availability);
+
+    /*
+     * Занять bytes из бюджета, false, если не помещаются. Пока бюджет пуст, резервирование удается всегда
+     */
+    bool ReserveMemory(uint64_t bytes);
+
+    void ReleaseMemory(uint64_t bytes);
+
+    int64_t PieceLength(size_t pieceIndex) const;
+
+    void PieceVerified(const PiecePtr& piece, bool hashMatches);
 
     void SavePieceToDisk(const PiecePtr& piece);
+
+    void PieceSaved(size_t pieceIndex, int error);
 };
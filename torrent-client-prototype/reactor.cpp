@@ -0,0 +1,144 @@
+#include "reactor.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+constexpr int MAX_EVENTS = 256;
+}
+
+Reactor::Reactor(std::chrono::milliseconds tickInterval) : epollFd_(-1), wakeupFd_(-1), tickInterval_(tickInterval), stopped_(false) {
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ == -1) {
+        throw std::runtime_error(std::string("<Reactor> epoll_create1 failed: ") + std::strerror(errno));
+    }
+
+    wakeupFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeupFd_ == -1) {
+        close(epollFd_);
+        throw std::runtime_error(std::string("<Reactor> eventfd failed: ") + std::strerror(errno));
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeupFd_;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeupFd_, &ev);
+}
+
+Reactor::~Reactor() {
+    close(wakeupFd_);
+    close(epollFd_);
+}
+
+void Reactor::Add(int fd, uint32_t events, std::shared_ptr<EventHandler> handler) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        throw std::runtime_error(std::string("<Reactor> epoll_ctl add failed: ") + std::strerror(errno));
+    }
+    handlers_[fd] = std::move(handler);
+}
+
+void Reactor::Modify(int fd, uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        throw std::runtime_error(std::string("<Reactor> epoll_ctl mod failed: ") + std::strerror(errno));
+    }
+}
+
+void Reactor::Remove(int fd) {
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+    handlers_.erase(fd);
+}
+
+void Reactor::Post(std::function<void()> task) {
+    {
+        std::lock_guard lock(tasksMtx_);
+        tasks_.push_back(std::move(task));
+    }
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t res = write(wakeupFd_, &one, sizeof(one));
+}
+
+void Reactor::Run() {
+    using Clock = std::chrono::steady_clock;
+    epoll_event events[MAX_EVENTS];
+    auto nextTick = Clock::now() + tickInterval_;
+
+    while (!stopped_) {
+        RunPendingTasks();
+
+        auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(nextTick - Clock::now()).count();
+        int count = epoll_wait(epollFd_, events, MAX_EVENTS, std::max<int64_t>(timeout, 0));
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("<Reactor> epoll_wait failed: ") + std::strerror(errno));
+        }
+
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wakeupFd_) {
+                uint64_t value;
+                [[maybe_unused]] ssize_t res = read(wakeupFd_, &value, sizeof(value));
+                continue;
+            }
+            auto it = handlers_.find(fd);
+            if (it == handlers_.end()) continue;
+            // обработчик может удалить себя из реактора во время обработки события
+            auto handler = it->second;
+            try {
+                handler->OnEvent(events[i].events);
+            } catch (const std::exception& e) {
+                std::cerr << "<Reactor> unhandled exception: " << e.what() << std::endl;
+            }
+        }
+
+        if (Clock::now() >= nextTick) {
+            Tick();
+            nextTick = Clock::now() + tickInterval_;
+        }
+    }
+}
+
+void Reactor::Stop() {
+    stopped_ = true;
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t res = write(wakeupFd_, &one, sizeof(one));
+}
+
+void Reactor::RunPendingTasks() {
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard lock(tasksMtx_);
+        tasks.swap(tasks_);
+    }
+    for (auto& task : tasks) {
+        task();
+    }
+}
+
+void Reactor::Tick() {
+    std::vector<std::shared_ptr<EventHandler>> handlers;
+    handlers.reserve(handlers_.size());
+    for (const auto& [fd, handler] : handlers_) {
+        handlers.push_back(handler);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    for (auto& handler : handlers) {
+        try {
+            handler->OnTick(now);
+        } catch (const std::exception& e) {
+            std::cerr << "<Reactor> unhandled exception: " << e.what() << std::endl;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Обработчик событий одного файлового дескриптора, зарегистрированного в реакторе
+ */
+class EventHandler {
+public:
+    virtual ~EventHandler() = default;
+
+    /*
+     * events -- маска событий epoll (EPOLLIN, EPOLLOUT, EPOLLERR, EPOLLHUP)
+     */
+    virtual void OnEvent(uint32_t events) = 0;
+
+    /*
+     * Вызывается периодически для всех зарегистрированных обработчиков, используется для проверки таймаутов
+     */
+    virtual void OnTick(std::chrono::steady_clock::time_point now) = 0;
+};
+
+/*
+ * Цикл обработки событий на основе epoll. Один реактор обслуживается одним потоком,
+ * все методы, кроме Post и Stop, должны вызываться из этого потока.
+ */
+class Reactor {
+public:
+    explicit Reactor(std::chrono::milliseconds tickInterval = std::chrono::milliseconds(100));
+    ~Reactor();
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    void Add(int fd, uint32_t events, std::shared_ptr<EventHandler> handler);
+
+    void Modify(int fd, uint32_t events);
+
+    void Remove(int fd);
+
+    /*
+     * Поставить задачу на выполнение в потоке реактора. Можно вызывать из любого потока
+     */
+    void Post(std::function<void()> task);
+
+    void Run();
+
+    void Stop();
+
+private:
+    int epollFd_;
+    int wakeupFd_;
+    const std::chrono::milliseconds tickInterval_;
+    std::unordered_map<int, std::shared_ptr<EventHandler>> handlers_;
+    std::mutex tasksMtx_;
+    std::vector<std::function<void()>> tasks_;
+    std::atomic<bool> stopped_;
+
+    void RunPendingTasks();
+
+    void Tick();
+};
@@ -0,0 +1,253 @@
+#include "byte_tools.h"
+#include "message.h"
+#include "peer_connect.h"
+#include "piece_storage.h"
+#include "reactor.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Проверка, что прием блоков в установившемся режиме не выделяет память в куче. Настоящий PeerConnect
+ * подключен через socketpair к пиру, которого играет проверка: пир отвечает блоками на запросы соединения,
+ * а соединение разбирает их, сохраняет в часть и отправляет следующие запросы. operator new подменен счетчиком,
+ * который считает выделения в OnEvent после прогрева. Код возврата 1, если выделения были
+ */
+
+namespace fs = std::filesystem;
+
+namespace {
+std::atomic<size_t> allocations(0);
+// у проверки хешей и записи на диск свои потоки, считаются только выделения в потоке соединения
+thread_local bool counting = false;
+
+constexpr size_t PIECE_LENGTH = 1 << 22;
+constexpr size_t BLOCK_SIZE = 1 << 14;
+constexpr size_t BLOCKS = PIECE_LENGTH / BLOCK_SIZE;
+constexpr size_t WARMUP_BLOCKS = 32;
+// последние блоки части не измеряются: готовая часть уходит на проверку хеша, соединение ищет следующую
+constexpr size_t TAIL_BLOCKS = 32;
+constexpr size_t HANDSHAKE_SIZE = 68;
+constexpr auto SAVE_TIMEOUT = std::chrono::seconds(10);
+const std::string PROTOCOL_NAME = "BitTorrent protocol";
+
+void* Allocate(size_t size) {
+    if (counting) {
+        ++allocations;
+    }
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+struct Request {
+    size_t piece;
+    size_t offset;
+    size_t length;
+};
+
+/*
+ * Сторона пира: раздает одну часть data и разбирает то, что присылает соединение
+ */
+class Seeder {
+public:
+    Seeder(int socket, const std::string& data) : socket_(socket), data_(data), handshakeReceived_(false) {
+    }
+
+    void Send(const std::string& bytes) {
+        for (size_t sent = 0; sent < bytes.size();) {
+            ssize_t result = send(socket_, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+            if (result < 0) {
+                throw std::runtime_error("seeder: send failed");
+            }
+            sent += result;
+        }
+    }
+
+    /*
+     * Прочитать все, что соединение успело отправить, запросы блоков складываются в очередь
+     */
+    void Receive() {
+        char buffer[1 << 14];
+        ssize_t received;
+        while ((received = recv(socket_, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+            input_.append(buffer, received);
+        }
+        if (!handshakeReceived_) {
+            if (input_.size() < HANDSHAKE_SIZE) return;
+            input_.erase(0, HANDSHAKE_SIZE);
+            handshakeReceived_ = true;
+        }
+        while (input_.size() >= 4) {
+            size_t length = BytesToInt(std::string_view(input_).substr(0, 4));
+            if (input_.size() - 4 < length) break;
+            MessageView message = MessageView::Parse(std::string_view(input_).substr(4, length));
+            if (message.id == MessageId::Request) {
+                requests_.push_back(Request{static_cast<size_t>(BytesToInt(message.payload.substr(0, 4))),
+                                            static_cast<size_t>(BytesToInt(message.payload.substr(4, 4))),
+                                            static_cast<size_t>(BytesToInt(message.payload.substr(8, 4)))});
+            }
+            input_.erase(0, 4 + length);
+        }
+    }
+
+    /*
+     * Ответить блоком на самый старый запрос
+     */
+    void SendBlock() {
+        if (requests_.empty()) {
+            throw std::runtime_error("seeder: connection stopped requesting blocks");
+        }
+        Request request = requests_.front();
+        requests_.pop_front();
+        if (request.piece != 0 || request.offset + request.length > data_.size() || request.length != BLOCK_SIZE) {
+            throw std::runtime_error("seeder: bad block request");
+        }
+        Send(IntToBytes(9 + request.length) + static_cast<char>(MessageId::Piece) + IntToBytes(request.piece) +
+             IntToBytes(request.offset) + data_.substr(request.offset, request.length));
+    }
+
+private:
+    int socket_;
+    const std::string& data_;
+    bool handshakeReceived_;
+    std::string input_;
+    std::deque<Request> requests_;
+};
+
+/*
+ * Обработать у соединения все пришедшие данные, measure -- считать выделения памяти
+ */
+void Deliver(PeerConnect& connect, Seeder& seeder, bool measure) {
+    counting = measure;
+    connect.OnEvent(EPOLLIN);
+    counting = false;
+    seeder.Receive();
+}
+
+TorrentFile MakeTorrent(const std::string& data) {
+    TorrentFile tf;
+    tf.name = "payload.bin";
+    tf.pieceLength = PIECE_LENGTH;
+    tf.length = data.size();
+    auto hashes = std::make_shared<const std::string>(CalculateSHA1(data));
+    tf.pieceHashes = PieceHashes(hashes, *hashes);
+    tf.files.push_back(TorrentFileEntry{{tf.name}, tf.length, 0});
+    tf.infoHash = std::string(20, 'i');
+    return tf;
+}
+
+/*
+ * Скачать часть через соединение, возвращает количество выделений памяти на измеряемых блоках
+ */
+size_t Download(const TorrentFile& tf, const std::string& data, PieceStorage& storage) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+        throw std::runtime_error("socketpair failed");
+    }
+    // сокет соединения неблокирующий, как после accept4 в PeerListener
+    fcntl(sockets[0], F_SETFL, fcntl(sockets[0], F_GETFL) | O_NONBLOCK);
+    Seeder seeder(sockets[1], data);
+    Reactor reactor;
+    auto connect = std::make_shared<PeerConnect>(Peer{"127.0.0.1", 0}, tf, std::string(20, 'c'), storage);
+    connect->Accept(sockets[0]);
+    connect->Start(reactor);
+
+    std::string handshake = static_cast<char>(PROTOCOL_NAME.size()) + PROTOCOL_NAME + std::string(8, '\0') +
+                            tf.infoHash + std::string(20, 'p');
+    seeder.Send(handshake + Message::Init(MessageId::BitField, "\x80").ToString() +
+                Message::Init(MessageId::Unchoke, "").ToString());
+    Deliver(*connect, seeder, false);
+
+    size_t before = 0;
+    for (size_t block = 0; block < BLOCKS; ++block) {
+        if (block == WARMUP_BLOCKS) {
+            before = allocations;
+        }
+        seeder.SendBlock();
+        Deliver(*connect, seeder, block >= WARMUP_BLOCKS && block < BLOCKS - TAIL_BLOCKS);
+    }
+    size_t allocated = allocations - before;
+
+    connect->Terminate();
+    connect->OnTick(std::chrono::steady_clock::now());
+    close(sockets[1]);
+    return allocated;
+}
+}
+
+void* operator new(size_t size) {
+    return Allocate(size);
+}
+
+void* operator new[](size_t size) {
+    return Allocate(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+int main() {
+    std::mt19937_64 random(1);
+    std::string data(PIECE_LENGTH, '\0');
+    for (char& c : data) {
+        c = static_cast<char>(random());
+    }
+
+    fs::path workDir = fs::temp_directory_path() / ("receive-alloc-check-" + std::to_string(getpid()));
+    fs::create_directories(workDir);
+    int code = 0;
+    try {
+        TorrentFile tf = MakeTorrent(data);
+        PieceStorage storage(tf, workDir, 100);
+        size_t allocated = Download(tf, data, storage);
+
+        // полученная часть должна пройти проверку хеша и попасть на диск
+        auto deadline = std::chrono::steady_clock::now() + SAVE_TIMEOUT;
+        while (!storage.DownloadComplete() && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        size_t measured = BLOCKS - WARMUP_BLOCKS - TAIL_BLOCKS;
+        std::cout << "Received " << measured << " blocks (" << measured * BLOCK_SIZE << " bytes), "
+                  << allocated << " heap allocations" << std::endl;
+        if (!storage.DownloadComplete()) {
+            std::cerr << "piece was not saved" << std::endl;
+            code = 1;
+        } else if (allocated != 0) {
+            std::cerr << "receive path must not allocate in steady state" << std::endl;
+            code = 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        code = 1;
+    }
+    fs::remove_all(workDir);
+    return code;
+}
@@ -0,0 +1,120 @@
+#include "request_pipeline.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+constexpr auto RATE_INTERVAL = std::chrono::seconds(1);
+constexpr double RATE_SMOOTHING = 0.3;
+// окно держится в два раза больше BDP, чтобы пир не простаивал, пока наши запросы идут к нему
+constexpr double WINDOW_HEADROOM = 2.0;
+constexpr double BLOCK_SIZE = 1 << 14;
+}
+
+RequestPipeline::RequestPipeline(const PipelineConfig& config) :
+        config_(config),
+        window_(config.initialWindow),
+        rate_(0),
+        bytesSinceUpdate_(0),
+        lastUpdate_(Clock::now()),
+        minRtt_(std::chrono::microseconds::max()),
+        smoothedRtt_(0) {
+    requests_.reserve(std::max(config.initialWindow, config.maxWindow));
+}
+
+bool RequestPipeline::HasFreeSlot() const {
+    return requests_.size() < window_;
+}
+
+void RequestPipeline::Add(const Block& block, Clock::time_point now) {
+    requests_.push_back(BlockRequest{block.piece, block.offset, block.length, now});
+}
+
+std::optional<BlockRequest> RequestPipeline::Complete(uint32_t piece, uint32_t offset, Clock::time_point now) {
+    // блоки обычно приходят в порядке запросов, так что поиск почти всегда заканчивается на первом элементе
+    auto it = std::find_if(requests_.begin(), requests_.end(), [piece, offset] (const BlockRequest& request) {
+        return request.piece == piece && request.offset == offset;
+    });
+    if (it == requests_.end()) {
+        return std::nullopt;
+    }
+
+    BlockRequest request = *it;
+    requests_.erase(it);
+    auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(now - request.sentAt);
+    minRtt_ = std::min(minRtt_, rtt);
+    smoothedRtt_ = smoothedRtt_.count() == 0 ? rtt : (smoothedRtt_ * 7 + rtt) / 8;
+    bytesSinceUpdate_ += request.length;
+    return request;
+}
+
+std::vector<BlockRequest> RequestPipeline::TakeAll() {
+    std::vector<BlockRequest> result(requests_.begin(), requests_.end());
+    requests_.clear();
+    return result;
+}
+
+std::vector<BlockRequest> RequestPipeline::TakeIf(const std::function<bool(const BlockRequest&)>& predicate) {
+    std::vector<BlockRequest> result;
+    auto it = std::stable_partition(requests_.begin(), requests_.end(), [&predicate] (const BlockRequest& request) {
+        return !predicate(request);
+    });
+    result.assign(it, requests_.end());
+    requests_.erase(it, requests_.end());
+    return result;
+}
+
+bool RequestPipeline::IsRequested(uint32_t piece, uint32_t offset) const {
+    return std::any_of(requests_.begin(), requests_.end(), [piece, offset] (const BlockRequest& request) {
+        return request.piece == piece && request.offset == offset;
+    });
+}
+
+size_t RequestPipeline::Outstanding() const {
+    return requests_.size();
+}
+
+size_t RequestPipeline::Window() const {
+    return window_;
+}
+
+void RequestPipeline::Update(Clock::time_point now) {
+    auto elapsed = now - lastUpdate_;
+    if (elapsed < RATE_INTERVAL) {
+        return;
+    }
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    double sample = bytesSinceUpdate_ / seconds;
+    rate_ = rate_ == 0 ? sample : (1 - RATE_SMOOTHING) * rate_ + RATE_SMOOTHING * sample;
+    bytesSinceUpdate_ = 0;
+    lastUpdate_ = now;
+
+    if (minRtt_ == std::chrono::microseconds::max() || rate_ == 0) {
+        return;
+    }
+    double bdp = rate_ * std::chrono::duration<double>(minRtt_).count();
+    auto target = static_cast<size_t>(std::ceil(WINDOW_HEADROOM * bdp / BLOCK_SIZE));
+    window_ = std::clamp(target, config_.minWindow, config_.maxWindow);
+}
+
+void RequestPipeline::Reset(Clock::time_point now) {
+    requests_.clear();
+    window_ = config_.initialWindow;
+    rate_ = 0;
+    bytesSinceUpdate_ = 0;
+    lastUpdate_ = now;
+    minRtt_ = std::chrono::microseconds::max();
+    smoothedRtt_ = std::chrono::microseconds(0);
+}
+
+double RequestPipeline::Rate() const {
+    return rate_;
+}
+
+std::chrono::microseconds RequestPipeline::MinRtt() const {
+    return minRtt_;
+}
+
+std::chrono::microseconds RequestPipeline::SmoothedRtt() const {
+    return smoothedRtt_;
+}
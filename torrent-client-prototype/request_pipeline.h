@@ -0,0 +1,89 @@
+#pragma once
+
+#include "piece.h"
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+/*
+ * Параметры конвейера запросов блоков к одному пиру
+ */
+struct PipelineConfig {
+    size_t initialWindow = 8;  // количество одновременно запрошенных блоков сразу после подключения
+    size_t minWindow = 4;
+    size_t maxWindow = 256;
+};
+
+/*
+ * Отправленный пиру запрос блока, ответ на который еще не получен
+ */
+struct BlockRequest {
+    uint32_t piece;
+    uint32_t offset;
+    uint32_t length;
+    std::chrono::steady_clock::time_point sentAt;
+};
+
+/*
+ * Очередь запрошенных у пира блоков. Размер окна (число блоков "в полете") подбирается
+ * по наблюдаемому произведению скорости загрузки на задержку (bandwidth-delay product)
+ */
+class RequestPipeline {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit RequestPipeline(const PipelineConfig& config = PipelineConfig());
+
+    bool HasFreeSlot() const;
+
+    void Add(const Block& block, Clock::time_point now);
+
+    /*
+     * Убрать запрос из очереди при получении блока. Возвращает пустое значение, если такой блок не запрашивался
+     */
+    std::optional<BlockRequest> Complete(uint32_t piece, uint32_t offset, Clock::time_point now);
+
+    /*
+     * Забрать все неотвеченные запросы, например, после Choke от пира
+     */
+    std::vector<BlockRequest> TakeAll();
+
+    /*
+     * Забрать неотвеченные запросы, для которых predicate возвращает true, например, чтобы отменить их
+     */
+    std::vector<BlockRequest> TakeIf(const std::function<bool(const BlockRequest&)>& predicate);
+
+    bool IsRequested(uint32_t piece, uint32_t offset) const;
+
+    size_t Outstanding() const;
+
+    size_t Window() const;
+
+    /*
+     * Пересчитать скорость загрузки и размер окна, вызывается периодически
+     */
+    void Update(Clock::time_point now);
+
+    void Reset(Clock::time_point now);
+
+    double Rate() const;
+
+    std::chrono::microseconds MinRtt() const;
+
+    /*
+     * Сглаженная задержка ответа на запрос, как SRTT в TCP. Ноль, пока не получено ни одного блока
+     */
+    std::chrono::microseconds SmoothedRtt() const;
+
+private:
+    const PipelineConfig config_;
+    std::vector<BlockRequest> requests_;  // не длиннее maxWindow, память выделяется один раз
+    size_t window_;
+    double rate_;  // байт в секунду, экспоненциальное скользящее среднее
+    uint64_t bytesSinceUpdate_;
+    Clock::time_point lastUpdate_;
+    std::chrono::microseconds minRtt_;
+    std::chrono::microseconds smoothedRtt_;
+};
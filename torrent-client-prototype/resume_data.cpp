@@ -0,0 +1,175 @@
+#include "resume_data.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace {
+constexpr char MAGIC[8] = {'T', 'C', 'R', 'E', 'S', 'U', 'M', 'E'};
+constexpr uint32_t VERSION = 1;
+
+bool ReadAll(int fd, char* data, size_t size, int64_t offset) {
+    size_t read = 0;
+    while (read < size) {
+        ssize_t res = pread(fd, data + read, size - read, offset + read);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        read += res;
+    }
+    return true;
+}
+}
+
+struct ResumeData::Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t clean;
+    uint64_t piecesCount;
+    char infoHash[20];
+    char reserved[12];
+};
+
+ResumeData::ResumeData(const std::filesystem::path& path, const TorrentFile& tf) :
+        fd_(-1), data_(nullptr), size_(0), piecesCount_(tf.pieceHashes.size()), wasClean_(false) {
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ == -1) {
+        throw std::runtime_error(std::string("can't open resume file: ") + std::strerror(errno));
+    }
+
+    size_ = sizeof(Header) + (piecesCount_ + CHAR_BIT - 1) / CHAR_BIT;
+    struct stat st{};
+    fstat(fd_, &st);
+    bool sizeMatches = static_cast<size_t>(st.st_size) == size_;
+    if (!sizeMatches && ftruncate(fd_, size_) == -1) {
+        close(fd_);
+        throw std::runtime_error(std::string("can't resize resume file: ") + std::strerror(errno));
+    }
+
+    void* data = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+        close(fd_);
+        throw std::runtime_error(std::string("can't map resume file: ") + std::strerror(errno));
+    }
+    data_ = static_cast<uint8_t*>(data);
+
+    Header* header = GetHeader();
+    bool valid = sizeMatches && std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+                 header->version == VERSION && header->piecesCount == piecesCount_ &&
+                 tf.infoHash.size() == sizeof(header->infoHash) &&
+                 std::memcmp(header->infoHash, tf.infoHash.data(), sizeof(header->infoHash)) == 0;
+    if (!valid) {
+        std::memset(data_, 0, size_);
+        std::memcpy(header->magic, MAGIC, sizeof(MAGIC));
+        header->version = VERSION;
+        header->piecesCount = piecesCount_;
+        std::memcpy(header->infoHash, tf.infoHash.data(), std::min(tf.infoHash.size(), sizeof(header->infoHash)));
+    }
+    wasClean_ = valid && header->clean != 0;
+
+    // пока клиент работает, битовая карта может отставать от данных на диске
+    header->clean = 0;
+    msync(data_, sizeof(Header), MS_SYNC);
+}
+
+ResumeData::~ResumeData() {
+    if (data_) {
+        munmap(data_, size_);
+    }
+    if (fd_ != -1) {
+        close(fd_);
+    }
+}
+
+bool ResumeData::WasClean() const {
+    return wasClean_;
+}
+
+bool ResumeData::IsCompleted(size_t pieceIndex) const {
+    return (Bitmap()[pieceIndex / CHAR_BIT] >> (CHAR_BIT - 1 - pieceIndex % CHAR_BIT)) & 1;
+}
+
+void ResumeData::MarkCompleted(size_t pieceIndex) {
+    uint8_t bit = 1 << (CHAR_BIT - 1 - pieceIndex % CHAR_BIT);
+    __atomic_fetch_or(&Bitmap()[pieceIndex / CHAR_BIT], bit, __ATOMIC_RELAXED);
+}
+
+void ResumeData::Assign(const std::vector<bool>& completed) {
+    Clear();
+    for (size_t pieceIndex = 0; pieceIndex < completed.size() && pieceIndex < piecesCount_; ++pieceIndex) {
+        if (completed[pieceIndex]) {
+            MarkCompleted(pieceIndex);
+        }
+    }
+}
+
+void ResumeData::Clear() {
+    std::memset(Bitmap(), 0, size_ - sizeof(Header));
+}
+
+void ResumeData::CloseClean() {
+    msync(data_, size_, MS_SYNC);
+    GetHeader()->clean = 1;
+    msync(data_, sizeof(Header), MS_SYNC);
+}
+
+ResumeData::Header* ResumeData::GetHeader() const {
+    return reinterpret_cast<Header*>(data_);
+}
+
+uint8_t* ResumeData::Bitmap() const {
+    return data_ + sizeof(Header);
+}
+
+std::vector<bool> ResumeData::Recheck(FileStorage& storage, const TorrentFile& tf, size_t threadsCount) {
+    size_t piecesCount = tf.pieceHashes.size();
+
+    // std::vector<bool> нельзя писать из нескольких потоков, поэтому результат собирается в байтах
+    std::vector<uint8_t> completed(piecesCount, 0);
+    std::atomic<size_t> nextPiece(0);
+    auto worker = [&] () {
+        std::string buffer(tf.pieceLength, '\0');
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        for (size_t pieceIndex = nextPiece++; pieceIndex < piecesCount; pieceIndex = nextPiece++) {
+            size_t offset = pieceIndex * tf.pieceLength;
+            size_t length = std::min(tf.pieceLength, tf.length - offset);
+            bool readAll = true;
+            try {
+                // часть может пересекать границы файлов, каждый участок читается из своего файла
+                for (const auto& span : storage.Spans(offset, length)) {
+                    if (!ReadAll(storage.Open(span.fileIndex)->Get(), buffer.data() + span.dataOffset, span.length, span.fileOffset)) {
+                        readAll = false;
+                        break;
+                    }
+                }
+            } catch (const std::runtime_error&) {
+                readAll = false;
+            }
+            if (!readAll) continue;
+            SHA1(reinterpret_cast<const unsigned char*>(buffer.data()), length, hash);
+            completed[pieceIndex] = std::memcmp(hash, tf.pieceHashes[pieceIndex].data(), SHA_DIGEST_LENGTH) == 0;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::max<size_t>(threadsCount, 1); ++i) {
+        threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::vector<bool> result(piecesCount, false);
+    for (size_t pieceIndex = 0; pieceIndex < piecesCount; ++pieceIndex) {
+        result[pieceIndex] = completed[pieceIndex] != 0;
+    }
+    return result;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "torrent_file.h"
+#include "file_storage.h"
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+/*
+ * Файл с битовой картой скачанных частей, отображенный в память.
+ * Бит части выставляется после того, как часть проверена и записана на диск.
+ * При корректном завершении данные файла сбрасываются на диск и в заголовке ставится флаг clean,
+ * только в этом случае битовой карте можно доверять при следующем запуске.
+ */
+class ResumeData {
+public:
+    /*
+     * Открывает или создает файл. Если файл создан для другой раздачи, он перезаписывается
+     */
+    ResumeData(const std::filesystem::path& path, const TorrentFile& tf);
+    ~ResumeData();
+
+    ResumeData(const ResumeData&) = delete;
+    ResumeData& operator=(const ResumeData&) = delete;
+
+    /*
+     * Предыдущий запуск завершился корректно, битовая карта соответствует данным на диске
+     */
+    bool WasClean() const;
+
+    bool IsCompleted(size_t pieceIndex) const;
+
+    /*
+     * Можно вызывать из разных потоков
+     */
+    void MarkCompleted(size_t pieceIndex);
+
+    void Assign(const std::vector<bool>& completed);
+
+    void Clear();
+
+    /*
+     * Сбросить битовую карту на диск и отметить корректное завершение.
+     * Вызывающий должен до этого сбросить на диск сами данные
+     */
+    void CloseClean();
+
+    /*
+     * Проверить хеши частей в уже существующих файлах несколькими потоками.
+     * Части, которые не удалось прочитать целиком, считаются отсутствующими
+     */
+    static std::vector<bool> Recheck(FileStorage& storage, const TorrentFile& tf, size_t threadsCount);
+
+private:
+    struct Header;
+
+    int fd_;
+    uint8_t* data_;
+    size_t size_;
+    size_t piecesCount_;
+    bool wasClean_;
+
+    Header* GetHeader() const;
+
+    uint8_t* Bitmap() const;
+};
@@ -0,0 +1,98 @@
+#include "ring_buffer.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+RingBuffer::RingBuffer(size_t capacity) : data_(nullptr), capacity_(0), head_(0), tail_(0) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    capacity_ = (capacity + pageSize - 1) / pageSize * pageSize;
+
+    int fd = memfd_create("ring_buffer", MFD_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error(std::string("<RingBuffer> memfd_create failed: ") + std::strerror(errno));
+    }
+    if (ftruncate(fd, capacity_) == -1) {
+        close(fd);
+        throw std::runtime_error(std::string("<RingBuffer> ftruncate failed: ") + std::strerror(errno));
+    }
+
+    // резервируем 2 * capacity адресов и отображаем файл в обе половины
+    void* region = mmap(nullptr, 2 * capacity_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error(std::string("<RingBuffer> mmap failed: ") + std::strerror(errno));
+    }
+    data_ = static_cast<char*>(region);
+    for (char* half : {data_, data_ + capacity_}) {
+        if (mmap(half, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            int error = errno;
+            munmap(data_, 2 * capacity_);
+            close(fd);
+            throw std::runtime_error(std::string("<RingBuffer> mmap failed: ") + std::strerror(error));
+        }
+    }
+    close(fd);
+}
+
+RingBuffer::~RingBuffer() {
+    if (data_) {
+        munmap(data_, 2 * capacity_);
+    }
+}
+
+char* RingBuffer::WritePtr() {
+    return data_ + tail_ % capacity_;
+}
+
+size_t RingBuffer::WritableSize() const {
+    return capacity_ - Size();
+}
+
+void RingBuffer::Commit(size_t size) {
+    tail_ += size;
+}
+
+std::string_view RingBuffer::Readable() const {
+    return std::string_view(data_ + head_ % capacity_, Size());
+}
+
+void RingBuffer::Consume(size_t size) {
+    head_ += size;
+    if (head_ == tail_) {
+        // пустой буфер: начинаем с начала, чтобы следующие чтения шли одним куском
+        head_ = tail_ = 0;
+    }
+}
+
+size_t RingBuffer::Size() const {
+    return tail_ - head_;
+}
+
+size_t RingBuffer::Capacity() const {
+    return capacity_;
+}
+
+void RingBuffer::Reserve(size_t capacity) {
+    if (capacity <= capacity_) return;
+    RingBuffer other(std::max(capacity, 2 * capacity_));
+    std::string_view readable = Readable();
+    std::memcpy(other.WritePtr(), readable.data(), readable.size());
+    other.Commit(readable.size());
+    Swap(other);
+}
+
+void RingBuffer::Clear() {
+    head_ = tail_ = 0;
+}
+
+void RingBuffer::Swap(RingBuffer& other) {
+    std::swap(data_, other.data_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(head_, other.head_);
+    std::swap(tail_, other.tail_);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/*
+ * Кольцевой буфер для приема данных из сокета.
+ * Одна и та же память отображена в адресное пространство дважды подряд, поэтому любые
+ * Size() байт, начиная с начала непрочитанных данных, лежат в памяти непрерывно,
+ * даже если они переходят через конец буфера. Это позволяет отдавать сообщения наружу
+ * в виде std::string_view без копирования.
+ */
+class RingBuffer {
+public:
+    /*
+     * capacity округляется вверх до размера страницы
+     */
+    explicit RingBuffer(size_t capacity);
+    ~RingBuffer();
+
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
+    /*
+     * Место для записи новых данных, после записи нужно вызвать Commit
+     */
+    char* WritePtr();
+
+    size_t WritableSize() const;
+
+    void Commit(size_t size);
+
+    /*
+     * Все непрочитанные данные одним непрерывным куском
+     */
+    std::string_view Readable() const;
+
+    void Consume(size_t size);
+
+    size_t Size() const;
+
+    size_t Capacity() const;
+
+    /*
+     * Увеличить емкость, сохранив непрочитанные данные. Единственная операция, выделяющая память
+     */
+    void Reserve(size_t capacity);
+
+    void Clear();
+
+private:
+    char* data_;
+    size_t capacity_;
+    uint64_t head_, tail_;  // количество прочитанных и записанных байт за все время
+
+    void Swap(RingBuffer& other);
+};
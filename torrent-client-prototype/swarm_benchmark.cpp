@@ -0,0 +1,602 @@
+#include "byte_tools.h"
+#include "message.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Нагрузочный тест клиента на локальной раздаче: генерируется случайный файл и .torrent для него,
+ * в этом же процессе запускаются HTTP-трекер и N сидов, говорящих по протоколу пиров,
+ * после чего клиент запускается отдельным процессом и качает файл с них.
+ * Печатает время загрузки, скорость, процессорное время и пиковую память клиента и проверяет скачанный файл
+ */
+
+namespace fs = std::filesystem;
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+const std::string PROTOCOL_NAME = "BitTorrent protocol";
+const size_t HANDSHAKE_SIZE = 1 + PROTOCOL_NAME.size() + 8 + 20 + 20;
+const std::string PAYLOAD_NAME = "payload.bin";
+constexpr auto POLL_INTERVAL = 100ms;
+constexpr size_t SEND_CHUNK = 64 << 10;
+
+struct BenchmarkConfig {
+    fs::path client = "./torrent-client-prototype";
+    fs::path workDir = fs::temp_directory_path() / "swarm-benchmark";
+    size_t sizeMiB = 256;
+    size_t pieceLengthKiB = 256;
+    size_t seeders = 4;
+    std::chrono::milliseconds latency{0};  // задержка ответа сида на каждый запрос блока
+    size_t rateKiB = 0;  // ограничение скорости отдачи каждого сида, 0 -- без ограничения
+    std::chrono::milliseconds chokePeriod{0};  // сиды попеременно закрывают и открывают загрузку с этим периодом
+    double corruptProbability = 0;  // вероятность отдать блок с испорченными данными
+    size_t runs = 1;
+    std::vector<std::string> clientArgs;
+};
+
+struct RunResult {
+    double seconds;
+    double cpuSeconds;
+    double userSeconds;
+    double systemSeconds;
+    long peakRssKiB;
+    int exitStatus;
+    bool outputMatches;
+};
+
+[[noreturn]] void Fail(const std::string& message) {
+    throw std::runtime_error(message + ": " + std::strerror(errno));
+}
+
+int Listen() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        Fail("socket failed");
+    }
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        close(fd);
+        Fail("bind failed");
+    }
+    return fd;
+}
+
+uint16_t LocalPort(int fd) {
+    sockaddr_in addr{};
+    socklen_t length = sizeof(addr);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length);
+    return ntohs(addr.sin_port);
+}
+
+bool WaitReadable(int fd, std::chrono::milliseconds timeout) {
+    pollfd pfd{fd, POLLIN, 0};
+    return poll(&pfd, 1, static_cast<int>(timeout.count())) > 0;
+}
+
+bool ReadExact(int fd, char* data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t res = read(fd, data + done, size - done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        done += res;
+    }
+    return true;
+}
+
+bool WriteAll(int fd, const char* data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t res = send(fd, data + done, size - done, MSG_NOSIGNAL);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        done += res;
+    }
+    return true;
+}
+
+std::string BencodeString(std::string_view value) {
+    return std::to_string(value.size()) + ":" + std::string(value);
+}
+
+std::string Sha1(std::string_view data) {
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char*>(data.data()), data.size(), hash);
+    return std::string(reinterpret_cast<char*>(hash), SHA_DIGEST_LENGTH);
+}
+
+/*
+ * Синтетическая однофайловая раздача
+ */
+struct Payload {
+    std::string data;
+    size_t pieceLength;
+    std::string info;  // закодированный словарь info
+    std::string infoHash;
+
+    Payload(size_t size, size_t pieceLength) : pieceLength(pieceLength) {
+        data.resize(size);
+        std::mt19937_64 random(1);
+        for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+            uint64_t value = random();
+            std::memcpy(data.data() + i, &value, std::min(sizeof(value), size - i));
+        }
+
+        std::string hashes;
+        for (size_t offset = 0; offset < size; offset += pieceLength) {
+            hashes += Sha1(std::string_view(data).substr(offset, pieceLength));
+        }
+        // ключи словаря в лексикографическом порядке
+        info = "d6:lengthi" + std::to_string(size) + "e4:name" + BencodeString(PAYLOAD_NAME) +
+               "12:piece lengthi" + std::to_string(pieceLength) + "e6:pieces" + BencodeString(hashes) + "e";
+        infoHash = Sha1(info);
+    }
+
+    size_t PiecesCount() const {
+        return (data.size() + pieceLength - 1) / pieceLength;
+    }
+
+    void WriteTorrentFile(const fs::path& path, uint16_t trackerPort) const {
+        std::string announce = "http://127.0.0.1:" + std::to_string(trackerPort) + "/announce";
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << "d8:announce" << BencodeString(announce) << "7:comment" << BencodeString("swarm benchmark")
+            << "4:info" << info << "e";
+        if (!out) {
+            throw std::runtime_error("can't write " + path.string());
+        }
+    }
+};
+
+/*
+ * Ограничение скорости, общее для всех соединений одного сида
+ */
+class RateLimiter {
+public:
+    explicit RateLimiter(size_t bytesPerSecond) : bytesPerSecond_(bytesPerSecond), next_(Clock::now()) {}
+
+    void Acquire(size_t bytes) {
+        if (bytesPerSecond_ == 0) return;
+        Clock::time_point sendAt;
+        {
+            std::lock_guard lock(mtx_);
+            sendAt = std::max(next_, Clock::now());
+            next_ = sendAt + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+                    static_cast<double>(bytes) / bytesPerSecond_));
+        }
+        std::this_thread::sleep_until(sendAt);
+    }
+
+private:
+    const size_t bytesPerSecond_;
+    std::mutex mtx_;
+    Clock::time_point next_;
+};
+
+/*
+ * Сид, раздающий весь файл. Каждое соединение обслуживается своим потоком
+ */
+class Seeder {
+public:
+    Seeder(const Payload& payload, const BenchmarkConfig& config, size_t index) :
+            payload_(payload), config_(config), index_(index), listenFd_(Listen()),
+            limiter_(config.rateKiB << 10), stopped_(false), blocksCorrupted_(0) {
+        acceptThread_ = std::thread([this] () { AcceptLoop(); });
+    }
+
+    ~Seeder() {
+        stopped_ = true;
+        acceptThread_.join();
+        for (auto& thread : connectionThreads_) {
+            thread.join();
+        }
+        close(listenFd_);
+    }
+
+    uint16_t Port() const {
+        return LocalPort(listenFd_);
+    }
+
+    size_t BlocksCorrupted() const {
+        return blocksCorrupted_;
+    }
+
+private:
+    struct PendingBlock {
+        Clock::time_point dueAt;
+        uint32_t piece, offset, length;
+    };
+
+    const Payload& payload_;
+    const BenchmarkConfig& config_;
+    const size_t index_;
+    const int listenFd_;
+    RateLimiter limiter_;
+    std::atomic<bool> stopped_;
+    std::atomic<size_t> blocksCorrupted_;
+    std::thread acceptThread_;
+    std::vector<std::thread> connectionThreads_;
+
+    void AcceptLoop() {
+        while (!stopped_) {
+            if (!WaitReadable(listenFd_, POLL_INTERVAL)) continue;
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            connectionThreads_.emplace_back([this, fd] () {
+                Serve(fd);
+                close(fd);
+            });
+        }
+    }
+
+    bool SendMessage(int fd, MessageId id, const std::string& payload) {
+        std::string message = Message::Init(id, payload).ToString();
+        return WriteAll(fd, message.data(), message.size());
+    }
+
+    bool SendBlock(int fd, const PendingBlock& block, std::mt19937& random) {
+        size_t begin = static_cast<size_t>(block.piece) * payload_.pieceLength + block.offset;
+        if (begin + block.length > payload_.data.size()) {
+            return false;
+        }
+        std::string header = IntToBytes(9 + block.length);
+        header.push_back(static_cast<char>(MessageId::Piece));
+        header += IntToBytes(block.piece) + IntToBytes(block.offset);
+
+        std::string corrupted;
+        std::string_view data = std::string_view(payload_.data).substr(begin, block.length);
+        if (config_.corruptProbability > 0 && std::bernoulli_distribution(config_.corruptProbability)(random)) {
+            corrupted.assign(data);
+            corrupted[random() % corrupted.size()] ^= 0x5a;
+            data = corrupted;
+            ++blocksCorrupted_;
+        }
+
+        if (!WriteAll(fd, header.data(), header.size())) return false;
+        for (size_t sent = 0; sent < data.size(); sent += SEND_CHUNK) {
+            size_t chunk = std::min(SEND_CHUNK, data.size() - sent);
+            limiter_.Acquire(chunk);
+            if (!WriteAll(fd, data.data() + sent, chunk)) return false;
+        }
+        return true;
+    }
+
+    void Serve(int fd) {
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        std::string handshake(HANDSHAKE_SIZE, '\0');
+        if (!WaitReadable(fd, 5s) || !ReadExact(fd, handshake.data(), handshake.size())) return;
+        if (handshake.substr(1 + PROTOCOL_NAME.size() + 8, 20) != payload_.infoHash) return;
+        std::string peerId = "-SB0001-" + std::string(12 - std::to_string(index_).size(), '0') + std::to_string(index_);
+        std::string response = handshake.substr(0, 1 + PROTOCOL_NAME.size() + 8 + 20) + peerId;
+        if (!WriteAll(fd, response.data(), response.size())) return;
+
+        std::string bitfield((payload_.PiecesCount() + 7) / 8, '\0');
+        for (size_t i = 0; i < payload_.PiecesCount(); ++i) {
+            bitfield[i / 8] |= static_cast<char>(0x80 >> (i % 8));
+        }
+        if (!SendMessage(fd, MessageId::BitField, bitfield) || !SendMessage(fd, MessageId::Unchoke, "")) return;
+
+        std::mt19937 random(index_ * 7919 + fd);
+        std::deque<PendingBlock> pending;
+        bool choked = false;
+        auto nextToggle = Clock::now() + config_.chokePeriod;
+
+        while (!stopped_) {
+            auto now = Clock::now();
+            if (config_.chokePeriod.count() > 0 && now >= nextToggle) {
+                // закрывая загрузку, сид по протоколу отбрасывает все неотвеченные запросы
+                choked = !choked;
+                pending.clear();
+                if (!SendMessage(fd, choked ? MessageId::Choke : MessageId::Unchoke, "")) return;
+                nextToggle = now + config_.chokePeriod;
+            }
+            while (!pending.empty() && pending.front().dueAt <= now) {
+                if (!SendBlock(fd, pending.front(), random)) return;
+                pending.pop_front();
+            }
+
+            auto wakeAt = now + POLL_INTERVAL;
+            if (!pending.empty()) wakeAt = std::min(wakeAt, pending.front().dueAt);
+            if (config_.chokePeriod.count() > 0) wakeAt = std::min(wakeAt, nextToggle);
+            auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wakeAt - now);
+            if (!WaitReadable(fd, std::max(timeout, 0ms))) continue;
+
+            char lengthBytes[4];
+            if (!ReadExact(fd, lengthBytes, sizeof(lengthBytes))) return;
+            size_t length = static_cast<uint32_t>(BytesToInt(std::string_view(lengthBytes, sizeof(lengthBytes))));
+            if (length == 0) continue;
+            if (length > (1 << 20)) return;
+            std::string body(length, '\0');
+            if (!ReadExact(fd, body.data(), length)) return;
+
+            auto id = static_cast<MessageId>(body[0]);
+            if ((id != MessageId::Request && id != MessageId::Cancel) || length < 13) continue;
+            PendingBlock block{Clock::now() + config_.latency,
+                               static_cast<uint32_t>(BytesToInt(std::string_view(body).substr(1, 4))),
+                               static_cast<uint32_t>(BytesToInt(std::string_view(body).substr(5, 4))),
+                               static_cast<uint32_t>(BytesToInt(std::string_view(body).substr(9, 4)))};
+            if (id == MessageId::Cancel) {
+                pending.erase(std::remove_if(pending.begin(), pending.end(), [&block] (const PendingBlock& other) {
+                    return other.piece == block.piece && other.offset == block.offset;
+                }), pending.end());
+            } else if (!choked) {
+                pending.push_back(block);
+            }
+        }
+    }
+};
+
+/*
+ * Трекер, который на любой запрос отвечает списком всех сидов в компактном формате
+ */
+class Tracker {
+public:
+    explicit Tracker(const std::vector<uint16_t>& ports) : listenFd_(Listen()), stopped_(false) {
+        std::string peers;
+        for (uint16_t port : ports) {
+            peers += std::string("\x7f\x00\x00\x01", 4);
+            peers.push_back(static_cast<char>(port >> 8));
+            peers.push_back(static_cast<char>(port & 0xff));
+        }
+        std::string body = "d8:intervali1800e5:peers" + BencodeString(peers) + "e";
+        response_ = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " + std::to_string(body.size()) +
+                    "\r\nConnection: close\r\n\r\n" + body;
+        thread_ = std::thread([this] () { Run(); });
+    }
+
+    ~Tracker() {
+        stopped_ = true;
+        thread_.join();
+        close(listenFd_);
+    }
+
+    uint16_t Port() const {
+        return LocalPort(listenFd_);
+    }
+
+private:
+    const int listenFd_;
+    std::atomic<bool> stopped_;
+    std::string response_;
+    std::thread thread_;
+
+    void Run() {
+        while (!stopped_) {
+            if (!WaitReadable(listenFd_, POLL_INTERVAL)) continue;
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            std::string request;
+            char buffer[4096];
+            while (request.find("\r\n\r\n") == std::string::npos && WaitReadable(fd, 1s)) {
+                ssize_t res = read(fd, buffer, sizeof(buffer));
+                if (res <= 0) break;
+                request.append(buffer, res);
+            }
+            WriteAll(fd, response_.data(), response_.size());
+            close(fd);
+        }
+    }
+};
+
+bool OutputMatches(const fs::path& path, const std::string& expected) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::string buffer(1 << 20, '\0');
+    size_t offset = 0;
+    while (in) {
+        in.read(buffer.data(), buffer.size());
+        size_t read = in.gcount();
+        if (offset + read > expected.size() || expected.compare(offset, read, buffer, 0, read) != 0) {
+            return false;
+        }
+        offset += read;
+    }
+    return offset == expected.size();
+}
+
+RunResult RunClient(const BenchmarkConfig& config, const fs::path& torrentPath, const fs::path& outputDir, const fs::path& logPath) {
+    std::vector<std::string> args = {config.client.string(), "-d", outputDir.string(), "-p", "100"};
+    args.insert(args.end(), config.clientArgs.begin(), config.clientArgs.end());
+    args.push_back(torrentPath.string());
+    std::vector<char*> argv;
+    for (auto& arg : args) {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+
+    auto start = Clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        Fail("fork failed");
+    }
+    if (pid == 0) {
+        int logFd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (logFd >= 0) {
+            dup2(logFd, STDOUT_FILENO);
+            dup2(logFd, STDERR_FILENO);
+        }
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    rusage usage{};
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) Fail("wait4 failed");
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    auto toSeconds = [] (const timeval& time) { return time.tv_sec + time.tv_usec / 1e6; };
+    RunResult result{};
+    result.seconds = seconds;
+    result.userSeconds = toSeconds(usage.ru_utime);
+    result.systemSeconds = toSeconds(usage.ru_stime);
+    result.cpuSeconds = result.userSeconds + result.systemSeconds;
+    result.peakRssKiB = usage.ru_maxrss;
+    result.exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return result;
+}
+
+const char* Usage = "Usage: swarm-benchmark [options] [-- <client options>]\n"
+                    "Options:\n"
+                    "  --client <path>        client binary (default ./torrent-client-prototype)\n"
+                    "  --work-dir <dir>       directory for the torrent file, downloads and client logs\n"
+                    "  --size <MiB>           payload size (default 256)\n"
+                    "  --piece-length <KiB>   piece length (default 256)\n"
+                    "  --seeders <n>          number of seeders (default 4)\n"
+                    "  --latency <ms>         delay before each block is sent (default 0)\n"
+                    "  --rate <KiB/s>         upload rate limit of each seeder, 0 -- unlimited (default 0)\n"
+                    "  --choke-period <ms>    seeders alternately choke and unchoke the client with this period\n"
+                    "  --corrupt <p>          probability that a sent block is corrupted (default 0)\n"
+                    "  --runs <n>             number of downloads (default 1)\n";
+
+BenchmarkConfig ParseArgs(int argc, char* argv[]) {
+    BenchmarkConfig config;
+    for (int i = 1; i < argc; ++i) {
+        std::string flag = argv[i];
+        if (flag == "--") {
+            config.clientArgs.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        if (i + 1 >= argc) {
+            throw std::invalid_argument("missing value for " + flag);
+        }
+        std::string value = argv[++i];
+        if (flag == "--client") {
+            config.client = value;
+        } else if (flag == "--work-dir") {
+            config.workDir = value;
+        } else if (flag == "--size") {
+            config.sizeMiB = std::stoul(value);
+        } else if (flag == "--piece-length") {
+            config.pieceLengthKiB = std::stoul(value);
+        } else if (flag == "--seeders") {
+            config.seeders = std::stoul(value);
+        } else if (flag == "--latency") {
+            config.latency = std::chrono::milliseconds(std::stoul(value));
+        } else if (flag == "--rate") {
+            config.rateKiB = std::stoul(value);
+        } else if (flag == "--choke-period") {
+            config.chokePeriod = std::chrono::milliseconds(std::stoul(value));
+        } else if (flag == "--corrupt") {
+            config.corruptProbability = std::stod(value);
+        } else if (flag == "--runs") {
+            config.runs = std::stoul(value);
+        } else {
+            throw std::invalid_argument("unknown option " + flag);
+        }
+    }
+    if (config.sizeMiB == 0 || config.pieceLengthKiB == 0 || config.seeders == 0 || config.runs == 0) {
+        throw std::invalid_argument("size, piece length, seeders and runs must be positive");
+    }
+    if (config.corruptProbability < 0 || config.corruptProbability > 1) {
+        throw std::invalid_argument("corrupt probability must be between 0 and 1");
+    }
+    return config;
+}
+}
+
+int main(int argc, char* argv[]) {
+    BenchmarkConfig config;
+    try {
+        config = ParseArgs(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n" << Usage;
+        return 1;
+    }
+
+    try {
+        config.client = fs::absolute(config.client);
+        if (!fs::exists(config.client)) {
+            std::cerr << "Client binary " << config.client << " does not exist\n" << Usage;
+            return 1;
+        }
+        fs::create_directories(config.workDir);
+
+        std::cout << "Generating " << config.sizeMiB << " MiB payload" << std::endl;
+        Payload payload(config.sizeMiB << 20, config.pieceLengthKiB << 10);
+
+        std::vector<std::unique_ptr<Seeder>> seeders;
+        std::vector<uint16_t> ports;
+        for (size_t i = 0; i < config.seeders; ++i) {
+            seeders.emplace_back(std::make_unique<Seeder>(payload, config, i));
+            ports.push_back(seeders.back()->Port());
+        }
+        Tracker tracker(ports);
+        fs::path torrentPath = config.workDir / "benchmark.torrent";
+        payload.WriteTorrentFile(torrentPath, tracker.Port());
+
+        std::cout << "Payload " << config.sizeMiB << " MiB, " << payload.PiecesCount() << " pieces of "
+                  << config.pieceLengthKiB << " KiB, " << config.seeders << " seeders, latency " << config.latency.count()
+                  << " ms, rate " << (config.rateKiB ? std::to_string(config.rateKiB) + " KiB/s" : "unlimited")
+                  << ", choke period " << config.chokePeriod.count() << " ms, corrupt " << config.corruptProbability << std::endl;
+
+        std::vector<RunResult> results;
+        bool allMatch = true;
+        for (size_t run = 0; run < config.runs; ++run) {
+            fs::path outputDir = config.workDir / "download";
+            fs::remove_all(outputDir);
+            fs::path logPath = config.workDir / ("client-" + std::to_string(run) + ".log");
+
+            RunResult result = RunClient(config, torrentPath, outputDir, logPath);
+            result.outputMatches = OutputMatches(outputDir / PAYLOAD_NAME, payload.data);
+            allMatch = allMatch && result.exitStatus == 0 && result.outputMatches;
+            results.push_back(result);
+
+            std::cout << std::fixed << std::setprecision(2)
+                      << "Run " << run + 1 << ": " << result.seconds << " s, "
+                      << payload.data.size() / result.seconds / 1e6 << " MB/s, CPU " << result.cpuSeconds
+                      << " s (user " << result.userSeconds << " s, sys " << result.systemSeconds << " s), peak RSS "
+                      << result.peakRssKiB / 1024.0 << " MiB, exit status " << result.exitStatus << ", output "
+                      << (result.outputMatches ? "matches" : "DOES NOT MATCH") << " (log " << logPath.string() << ")" << std::endl;
+        }
+
+        std::sort(results.begin(), results.end(), [] (const RunResult& lhs, const RunResult& rhs) {
+            return lhs.seconds < rhs.seconds;
+        });
+        const RunResult& median = results[results.size() / 2];
+        size_t corrupted = 0;
+        for (const auto& seeder : seeders) {
+            corrupted += seeder->BlocksCorrupted();
+        }
+        std::cout << std::fixed << std::setprecision(2)
+                  << "Median: " << median.seconds << " s, " << payload.data.size() / median.seconds / 1e6 << " MB/s, CPU "
+                  << median.cpuSeconds << " s, peak RSS " << median.peakRssKiB / 1024.0 << " MiB; "
+                  << corrupted << " corrupted blocks sent" << std::endl;
+        return allMatch ? 0 : 2;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -2,6 +2,7 @@
 #include "byte_tools.h"
 
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
 #include <stdexcept>
 #include <cstring>
@@ -27,7 +28,18 @@ TcpConnect::~TcpConnect() {
 }
 
 void TcpConnect::EstablishConnection() {
-    sock_ = socket(AF_INET, SOCK_STREAM, 0);
+    StartConnection();
+
+    pollfd pfd{sock_, POLLOUT, 0};
+    int pollres = poll(&pfd, 1, connectTimeout_.count());
+    if (pollres <= 0) {
+        CloseConnection();
+        throw std::runtime_error("can't connect to peer");
+    }
+}
+
+void TcpConnect::StartConnection() {
+    sock_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sock_ == -1) {
         throw std::runtime_error("Failed to create socket");
     }
@@ -36,6 +48,7 @@ void TcpConnect::EstablishConnection() {
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port_);
     if (inet_pton(AF_INET, ip_.c_str(), &addr.sin_addr) <= 0) {
+        CloseConnection();
         throw std::runtime_error("Invalid address");
     }
 
@@ -43,12 +56,63 @@ void TcpConnect::EstablishConnection() {
     fcntl(sock_, F_SETFL, flags | O_NONBLOCK);
 
     int res = connect(sock_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
-    pollfd pfd{sock_, POLLOUT, 0};
-    int pollres = poll(&pfd, 1, connectTimeout_.count());
-    if (pollres <= 0) {
+    if (res == -1 && errno != EINPROGRESS) {
         CloseConnection();
-        throw std::runtime_error("can't connect to peer");
+        throw std::runtime_error(std::string("can't connect to peer: ") + std::strerror(errno));
+    }
+}
+
+void TcpConnect::Attach(int sock) {
+    CloseConnection();
+    sock_ = sock;
+}
+
+void TcpConnect::CheckConnection() {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(sock_, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+        throw std::runtime_error(std::string("can't connect to peer: ") + std::strerror(error));
+    }
+}
+
+size_t TcpConnect::TrySend(const char* data, size_t size) {
+    ssize_t sent = send(sock_, data, size, MSG_NOSIGNAL);
+    if (sent >= 0) {
+        return sent;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return 0;
+    }
+    throw std::runtime_error(std::string("<TrySend> send() failed: ") + std::strerror(errno));
+}
+
+size_t TcpConnect::TrySendFile(int fd, int64_t offset, size_t size) {
+    off_t fileOffset = offset;
+    ssize_t sent = sendfile(sock_, fd, &fileOffset, size);
+    if (sent > 0) {
+        return sent;
     }
+    if (sent == 0) {
+        throw std::runtime_error("<TrySendFile> unexpected end of file");
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return 0;
+    }
+    throw std::runtime_error(std::string("<TrySendFile> sendfile() failed: ") + std::strerror(errno));
+}
+
+size_t TcpConnect::TryReceive(char* buffer, size_t size) {
+    ssize_t received = recv(sock_, buffer, size, 0);
+    if (received > 0) {
+        return received;
+    }
+    if (received == 0) {
+        throw std::runtime_error("<TryReceive> connection closed by peer");
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return 0;
+    }
+    throw std::runtime_error(std::string("<TryReceive> recv() failed: ") + std::strerror(errno));
 }
 
 void TcpConnect::SendData(const std::string& data) {
@@ -139,6 +203,10 @@ void TcpConnect::CloseConnection() {
     }
 }
 
+int TcpConnect::GetSocket() const {
+    return sock_;
+}
+
 const std::string& TcpConnect::GetIp() const {
     return ip_;
 }
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <chrono>
+#include <cstdint>
 
 /*
  * Обертка над низкоуровневой структурой сокета.
@@ -13,6 +14,35 @@ public:
 
     void EstablishConnection();
 
+    /*
+     * Неблокирующий режим работы, используется реактором.
+     * StartConnection только начинает подключение, результат проверяется в CheckConnection,
+     * когда сокет становится готов к записи
+     */
+    void StartConnection();
+
+    void CheckConnection();
+
+    /*
+     * Использовать уже подключенный сокет, например, принятый слушающим сокетом. Сокет закрывается вместе с объектом
+     */
+    void Attach(int sock);
+
+    /*
+     * Возвращают количество отправленных/полученных байт, 0 -- если сокет не готов
+     */
+    size_t TrySend(const char* data, size_t size);
+
+    size_t TryReceive(char* buffer, size_t size);
+
+    /*
+     * Отправить size байт файла fd начиная с offset без копирования через память процесса (sendfile).
+     * Возвращает количество отправленных байт, 0 -- если сокет не готов
+     */
+    size_t TrySendFile(int fd, int64_t offset, size_t size);
+
+    int GetSocket() const;
+
     void SendData(const std::string& data);
 
     std::string ReceiveData(size_t bufferSize = 0);
@@ -1,40 +1,112 @@
 #include "torrent_file.h"
 #include "bencode.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <vector>
-#include <openssl/sha.h>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
-#include <variant>
+#include <iostream>
 #include <sstream>
 #include <set>
+#include <stdexcept>
 
 using namespace Bencode;
 
-TorrentFile LoadTorrentFile(const std::string& filename) {
-    std::ifstream file(filename, std::ios::binary);
+namespace {
+/*
+ * Компоненты пути берутся из .torrent файла, поэтому не даем выйти за пределы директории загрузки
+ */
+std::string CheckPathComponent(const std::string& component) {
+    if (component.empty() || component == "." || component == ".." || component.find('/') != std::string::npos) {
+        throw std::invalid_argument("Invalid file path in torrent file: " + component);
+    }
+    return component;
+}
+
+/*
+ * .torrent файл, отображенный в память. Если файл нельзя отобразить (например, это pipe), он читается целиком
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) : mapping_(MAP_FAILED), size_(0) {
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            throw std::invalid_argument("Can't open torrent file " + filename + ": " + std::strerror(errno));
+        }
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            size_ = st.st_size;
+            mapping_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
 
-    std::ostringstream oss;
-    oss << file.rdbuf();
-    std::string data = oss.str();
-    BencodeParser pb(data);
-    auto root = pb.parse();
+        if (mapping_ == MAP_FAILED) {
+            std::ifstream file(filename, std::ios::binary);
+            std::ostringstream oss;
+            oss << file.rdbuf();
+            buffer_ = oss.str();
+        }
+    }
 
-    auto rootDict = std::get<Bmap>(root->value);
+    ~MappedFile() {
+        if (mapping_ != MAP_FAILED) {
+            munmap(mapping_, size_);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view Data() const {
+        if (mapping_ != MAP_FAILED) {
+            return std::string_view(static_cast<const char*>(mapping_), size_);
+        }
+        return buffer_;
+    }
+
+private:
+    void* mapping_;
+    size_t size_;
+    std::string buffer_;
+};
+}
+
+PieceHashes::PieceHashes(std::shared_ptr<const void> owner, std::string_view data) : owner_(std::move(owner)), data_(data) {}
+
+size_t PieceHashes::size() const {
+    return data_.size() / HASH_SIZE;
+}
+
+bool PieceHashes::empty() const {
+    return data_.empty();
+}
+
+std::string_view PieceHashes::operator[](size_t pieceIndex) const {
+    return data_.substr(pieceIndex * HASH_SIZE, HASH_SIZE);
+}
+
+TorrentFile LoadTorrentFile(const std::string& filename) {
+    auto file = std::make_shared<const MappedFile>(filename);
+    Document document(file->Data());
+    const Node& root = document.Root();
 
     TorrentFile result;
-    result.announce = std::get<Bstring>(rootDict["announce"]->value);    
-    result.comment = std::get<Bstring>(rootDict["comment"]->value);
-    
+    result.announce = root.At("announce").AsString();
+    if (const Node* comment = root.Find("comment")) {
+        result.comment = comment->AsString();
+    }
+
     std::set<std::string> announceSet = {result.announce};
-    auto it = rootDict.find("announce-list");
-    if (it != rootDict.end() && std::holds_alternative<Blist>(it->second->value)) {
-        const auto& list = std::get<Blist>(it->second->value);
-        for (const auto& tierNode : list) {
-            if (tierNode && std::holds_alternative<Blist>(tierNode->value)) {
-                const auto& tier = std::get<Blist>(tierNode->value);
-                for (const auto& announceNode : tier) {
-                    if (announceNode && std::holds_alternative<Bstring>(announceNode->value)) {
-                        announceSet.insert(std::get<Bstring>(announceNode->value));
-                    }
+    const Node* announceList = root.Find("announce-list");
+    if (announceList && announceList->IsList()) {
+        for (const Node& tier : *announceList) {
+            if (!tier.IsList()) continue;
+            for (const Node& announce : tier) {
+                if (announce.IsString()) {
+                    announceSet.insert(std::string(announce.AsString()));
                 }
             }
         }
@@ -46,18 +118,58 @@ TorrentFile LoadTorrentFile(const std::string& filename) {
         std::cout << url << std::endl;
     }
 
-    auto infoDict = std::get<Bmap>(rootDict["info"]->value);
-    result.name = std::get<Bstring>(infoDict["name"]->value);
-    result.pieceLength = std::get<Bint>(infoDict["piece length"]->value);
-    result.length = std::get<Bint>(infoDict["length"]->value);
-    
-    std::string pieces = std::get<Bstring>(infoDict["pieces"]->value);
-    for (int i = 0; i < (int)pieces.size(); i += 20) {
-        result.pieceHashes.push_back(pieces.substr(i, 20));
+    const Node& info = root.At("info");
+    result.name = CheckPathComponent(std::string(info.At("name").AsString()));
+    int64_t pieceLength = info.At("piece length").AsInt();
+    if (pieceLength <= 0) {
+        throw std::invalid_argument("Invalid piece length in torrent file");
+    }
+    result.pieceLength = pieceLength;
+
+    if (const Node* files = info.Find("files")) {
+        // многофайловая раздача: name -- имя корневой директории
+        result.length = 0;
+        for (const Node& file : *files) {
+            TorrentFileEntry entry;
+            entry.path.push_back(result.name);
+            for (const Node& component : file.At("path")) {
+                entry.path.push_back(CheckPathComponent(std::string(component.AsString())));
+            }
+            if (entry.path.size() == 1) {
+                throw std::invalid_argument("Empty file path in torrent file");
+            }
+            int64_t length = file.At("length").AsInt();
+            if (length < 0) {
+                throw std::invalid_argument("Invalid file length in torrent file");
+            }
+            entry.length = length;
+            entry.offset = result.length;
+            result.length += entry.length;
+            result.files.push_back(std::move(entry));
+        }
+    } else {
+        int64_t length = info.At("length").AsInt();
+        if (length < 0) {
+            throw std::invalid_argument("Invalid file length in torrent file");
+        }
+        result.length = length;
+        result.files.push_back(TorrentFileEntry{{result.name}, result.length, 0});
+    }
+
+    std::string_view pieces = info.At("pieces").AsString();
+    if (pieces.size() % PieceHashes::HASH_SIZE != 0) {
+        throw std::invalid_argument("Invalid pieces hashes in torrent file");
+    }
+    // у каждой части, включая последнюю, должна быть ненулевая длина
+    size_t piecesCount = result.length / result.pieceLength + (result.length % result.pieceLength != 0);
+    if (pieces.size() / PieceHashes::HASH_SIZE != piecesCount) {
+        throw std::invalid_argument("Pieces count does not match torrent length");
     }
+    // хеши остаются в отображении файла, оно живет, пока на него ссылается TorrentFile
+    result.pieceHashes = PieceHashes(file, pieces);
 
-    std::string infoString = extract_info(rootDict["info"]);
-    result.infoHash = sha1_raw(infoString);
+    // infohash считается по исходным байтам словаря info, без перекодирования
+    result.infoHash = sha1_raw(info.raw);
 
     return result;
 }
@@ -1,17 +1,55 @@
 #pragma once
 
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
+/*
+ * SHA-1 хеши частей, записанные подряд по 20 байт. Хеши не копируются из .torrent файла,
+ * а ссылаются на его отображение в память, которое держит owner
+ */
+class PieceHashes {
+public:
+    static constexpr size_t HASH_SIZE = 20;
+
+    PieceHashes() = default;
+    PieceHashes(std::shared_ptr<const void> owner, std::string_view data);
+
+    size_t size() const;
+
+    bool empty() const;
+
+    std::string_view operator[](size_t pieceIndex) const;
+
+private:
+    std::shared_ptr<const void> owner_;
+    std::string_view data_;
+};
+
+/*
+ * Один файл раздачи. Данные всех файлов идут подряд в порядке перечисления,
+ * части раздачи нарезаются из этого общего потока и могут пересекать границы файлов
+ */
+struct TorrentFileEntry {
+    std::vector<std::string> path;  // путь относительно директории загрузки, для многофайловой раздачи начинается с name
+    size_t length;
+    size_t offset;  // смещение начала файла в общем потоке данных раздачи
+};
+
 struct TorrentFile {
     std::string announce;
     std::vector<std::string> announceList;
     std::string comment;
-    std::vector<std::string> pieceHashes;
+    PieceHashes pieceHashes;
     size_t pieceLength;
-    size_t length;
+    size_t length;  // суммарная длина всех файлов
     std::string name;
+    std::vector<TorrentFileEntry> files;
     std::string infoHash;
 };
 
+/*
+ * Файл отображается в память, разбираются только нужные поля, хеши частей остаются в отображении
+ */
 TorrentFile LoadTorrentFile(const std::string& filename);
@@ -3,6 +3,7 @@
 #include "byte_tools.h"
 #include <cpr/cpr.h>
 
+#include <chrono>
 #include <iostream>
 #include "peer.h"
 #include <string>
@@ -14,39 +15,38 @@
 #include <map>
 #include <sstream>
 #include <memory>
+#include <algorithm>
 
 using namespace Bencode;
 
-TorrentTracker::TorrentTracker(const std::string& url) : url_(url) {}
-
-void TorrentTracker::UpdatePeers(const TorrentFile& tf, std::string peerId, int port) {
-    cpr::Response response;
-    for (const auto& url : tf.announceList) {
-        std::cout << "Try to connect : " << url << std::endl;
-        response = cpr::Get(
-            cpr::Url{url},
-            cpr::Parameters{
-                {"info_hash", tf.infoHash},
-                {"peer_id", peerId},
-                {"port", std::to_string(port)},
-                {"uploaded", "0"},
-                {"downloaded", "0"},
-                {"left", std::to_string(tf.length)},
-                {"compact", "1"}
-            },
-            cpr::Timeout{1000}
-        );
-
-        if (response.status_code == 200) break;
-    }
+namespace {
+constexpr auto ANNOUNCE_TIMEOUT = std::chrono::seconds(3);
+constexpr auto STOP_TIMEOUT = std::chrono::seconds(1);
+constexpr auto POLL_INTERVAL = std::chrono::milliseconds(10);
+constexpr auto STATS_CHECK_INTERVAL = std::chrono::seconds(1);  // как быстро замечается окончание загрузки
+constexpr auto DEFAULT_INTERVAL = std::chrono::seconds(1800);
+constexpr auto MIN_INTERVAL = std::chrono::seconds(5);  // не анонсироваться чаще, даже если трекер прислал interval 0
+constexpr auto RETRY_DELAY = std::chrono::seconds(15);
+constexpr auto MAX_RETRY_DELAY = std::chrono::seconds(1800);
+constexpr int NUMWANT = 50;
 
-    if (response.status_code != 200) {
-        throw std::runtime_error("Failed to connect to tracker");
-    }
+std::chrono::seconds RetryDelay(size_t failures) {
+    return std::min<std::chrono::seconds>(RETRY_DELAY * (1 << std::min<size_t>(failures - 1, 7)), MAX_RETRY_DELAY);
+}
 
-    auto data = BencodeParser(response.text).parse();
-    std::string peersRaw = std::get<Bstring>(std::get<Bmap>(data->value)["peers"]->value);
+/*
+ * Пиры в компактном виде (по 6 байт) или списком словарей с ip и port
+ */
+std::vector<Peer> ParsePeers(const Node& peersNode) {
+    std::vector<Peer> peers;
+    if (peersNode.IsList()) {
+        for (const Node& peerNode : peersNode) {
+            peers.push_back(Peer{std::string(peerNode.At("ip").AsString()), static_cast<int>(peerNode.At("port").AsInt())});
+        }
+        return peers;
+    }
 
+    std::string_view peersRaw = peersNode.AsString();
     for (size_t i = 0; i + 6 <= peersRaw.size(); i += 6) {
         Peer p;
         p.ip = std::to_string((uint8_t)peersRaw[i]) + "." +
@@ -54,12 +54,241 @@ void TorrentTracker::UpdatePeers(const TorrentFile& tf, std::string peerId, int
                std::to_string((uint8_t)peersRaw[i + 2]) + "." +
                std::to_string((uint8_t)peersRaw[i + 3]);
         p.port = ((uint8_t)peersRaw[i + 4] << 8) | (uint8_t)peersRaw[i + 5];
-        peers_.push_back(p);
+        peers.push_back(p);
+    }
+    return peers;
+}
+}
+
+TorrentTracker::TorrentTracker(const TorrentFile& tf, std::string peerId, int port) :
+        tf_(tf),
+        peerId_(std::move(peerId)),
+        port_(port),
+        downloading_(false),
+        announces_(tf.announceList.size()),
+        peersRequested_(false),
+        newPeersSinceRequest_(0),
+        stopped_(false) {
+    for (size_t i = 0; i < announces_.size(); ++i) {
+        announces_[i].url = tf.announceList[i];
+    }
+}
+
+TorrentTracker::~TorrentTracker() {
+    Stop();
+}
+
+void TorrentTracker::Start(StatsCallback getStats, PeersCallback onPeers) {
+    getStats_ = std::move(getStats);
+    onPeers_ = std::move(onPeers);
+    downloading_ = getStats_().left > 0;
+    {
+        std::lock_guard lock(mtx_);
+        peersRequested_ = true;
+        auto now = Clock::now();
+        for (auto& announce : announces_) {
+            announce.nextAt = now;
+            announce.requested = true;
+        }
     }
+    thread_ = std::thread([this] () { Run(); });
 }
 
-const std::vector<Peer>& TorrentTracker::GetPeers() const {
-    return peers_;
+bool TorrentTracker::RequestPeers() {
+    std::lock_guard lock(mtx_);
+    if (!peersRequested_) {
+        peersRequested_ = true;
+        newPeersSinceRequest_ = 0;
+        auto now = Clock::now();
+        for (auto& announce : announces_) {
+            announce.requested = true;
+            announce.nextAt = std::min(announce.nextAt, std::max(now, announce.lastAt + announce.minInterval));
+        }
+        cv_.notify_all();
+        return true;
+    }
+    for (const auto& announce : announces_) {
+        if (announce.requested) {
+            return true;
+        }
+    }
+    peersRequested_ = false;
+    return newPeersSinceRequest_ > 0;
+}
+
+void TorrentTracker::Stop() {
+    {
+        std::lock_guard lock(mtx_);
+        if (stopped_) {
+            return;
+        }
+        stopped_ = true;
+    }
+    cv_.notify_all();
+    if (!thread_.joinable()) {
+        return;
+    }
+    thread_.join();
+
+    // поток остановлен, дальше состояние трекеров принадлежит только этому потоку
+    for (auto& announce : announces_) {
+        if (announce.response) {
+            HandleResponse(announce, Clock::now());
+        }
+    }
+    TransferStats stats = getStats_();
+    // о завершении загрузки трекер должен узнать до выхода из раздачи
+    if (downloading_ && stats.left == 0) {
+        for (auto& announce : announces_) {
+            if (announce.started && !announce.completed) {
+                Send(announce, stats, "completed", STOP_TIMEOUT);
+            }
+        }
+        for (auto& announce : announces_) {
+            if (announce.response) {
+                HandleResponse(announce, Clock::now());
+            }
+        }
+    }
+    for (auto& announce : announces_) {
+        if (announce.started) {
+            Send(announce, stats, "stopped", STOP_TIMEOUT);
+        }
+    }
+    for (auto& announce : announces_) {
+        if (announce.response) {
+            announce.response->wait();
+            announce.response.reset();
+        }
+    }
+}
+
+void TorrentTracker::Run() {
+    std::unique_lock lock(mtx_);
+    while (!stopped_) {
+        lock.unlock();
+        TransferStats stats = getStats_();
+        lock.lock();
+
+        auto now = Clock::now();
+        auto wakeAt = now + STATS_CHECK_INTERVAL;
+        bool inFlight = false;
+        for (auto& announce : announces_) {
+            if (!announce.response) {
+                bool justCompleted = downloading_ && stats.left == 0 && announce.started && !announce.completed;
+                if (justCompleted && (announce.failures == 0 || now >= announce.nextAt)) {
+                    Send(announce, stats, "completed", ANNOUNCE_TIMEOUT);
+                } else if (now >= announce.nextAt) {
+                    Send(announce, stats, announce.started ? "" : "started", ANNOUNCE_TIMEOUT);
+                }
+            }
+            if (announce.response) {
+                inFlight = true;
+            } else {
+                wakeAt = std::min(wakeAt, announce.nextAt);
+            }
+        }
+        if (!inFlight) {
+            // будит Stop или RequestPeers
+            cv_.wait_until(lock, wakeAt);
+            continue;
+        }
+
+        lock.unlock();
+        std::this_thread::sleep_for(POLL_INTERVAL);
+        lock.lock();
+
+        std::vector<std::pair<Announce*, std::vector<Peer>>> answered;
+        now = Clock::now();
+        for (auto& announce : announces_) {
+            if (announce.response && announce.response->wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                answered.emplace_back(&announce, HandleResponse(announce, now));
+            }
+        }
+
+        // пиры передаются без блокировки: обработчик может обращаться к RequestPeers
+        lock.unlock();
+        size_t newPeers = 0;
+        for (const auto& [announce, peers] : answered) {
+            if (onPeers_ && !peers.empty()) {
+                newPeers += onPeers_(peers);
+            }
+        }
+        lock.lock();
+        for (const auto& [announce, peers] : answered) {
+            announce->requested = false;
+        }
+        newPeersSinceRequest_ += newPeers;
+    }
+}
+
+void TorrentTracker::Send(Announce& announce, const TransferStats& stats, std::string event, std::chrono::milliseconds timeout) {
+    if (event == "started") {
+        std::cout << "Try to connect : " << announce.url << std::endl;
+    }
+    cpr::Parameters parameters{
+        {"info_hash", tf_.infoHash},
+        {"peer_id", peerId_},
+        {"port", std::to_string(port_)},
+        {"uploaded", std::to_string(stats.uploaded)},
+        {"downloaded", std::to_string(stats.downloaded)},
+        {"left", std::to_string(stats.left)},
+        {"compact", "1"},
+        {"numwant", std::to_string(event == "stopped" ? 0 : NUMWANT)}
+    };
+    if (!event.empty()) {
+        parameters.Add({"event", event});
+    }
+    if (!announce.trackerId.empty()) {
+        parameters.Add({"trackerid", announce.trackerId});
+    }
+    announce.event = std::move(event);
+    announce.response = cpr::GetAsync(cpr::Url{announce.url}, parameters, cpr::Timeout{timeout});
+}
+
+std::vector<Peer> TorrentTracker::HandleResponse(Announce& announce, Clock::time_point now) {
+    cpr::Response response = announce.response->get();
+    announce.response.reset();
+
+    std::string error;
+    std::vector<Peer> peers;
+    if (response.status_code != 200) {
+        error = "not available";
+    } else {
+        try {
+            Document document(response.text);
+            const Node& root = document.Root();
+            if (const Node* failure = root.Find("failure reason")) {
+                throw std::invalid_argument(std::string(failure->AsString()));
+            }
+            if (const Node* warning = root.Find("warning message")) {
+                std::cerr << "Tracker " << announce.url << " warning: " << warning->AsString() << std::endl;
+            }
+            const Node* interval = root.Find("interval");
+            const Node* minInterval = root.Find("min interval");
+            const Node* trackerId = root.Find("tracker id");
+            peers = ParsePeers(root.At("peers"));
+
+            announce.minInterval = std::chrono::seconds(minInterval ? minInterval->AsInt() : 0);
+            announce.nextAt = now + std::max(interval ? std::chrono::seconds(interval->AsInt()) : DEFAULT_INTERVAL, MIN_INTERVAL);
+            if (trackerId) {
+                announce.trackerId = trackerId->AsString();
+            }
+            announce.lastAt = now;
+            announce.failures = 0;
+            announce.started = true;
+            announce.completed = announce.completed || announce.event == "completed";
+        } catch (const std::invalid_argument& e) {
+            error = e.what();
+        }
+    }
+
+    if (!error.empty()) {
+        ++announce.failures;
+        announce.nextAt = now + RetryDelay(announce.failures);
+        std::cerr << "Tracker " << announce.url << " failed: " << error << std::endl;
+    }
+    return peers;
 }
 
 std::string TorrentTracker::urlEncode(const std::string& value) {
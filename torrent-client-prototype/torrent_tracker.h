@@ -1,21 +1,104 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
+#include <vector>
+#include <cpr/cpr.h>
 #include "torrent_file.h"
 #include "bencode.h"
 #include "peer.h"
 
+/*
+ * Объем данных за этот запуск, о котором сообщается трекеру
+ */
+struct TransferStats {
+    uint64_t uploaded = 0;
+    uint64_t downloaded = 0;
+    uint64_t left = 0;  // сколько байт раздачи еще нет на диске
+};
+
+/*
+ * Анонсы на все трекеры раздачи в фоновом потоке. Каждый трекер анонсируется заново через interval из его ответа,
+ * недоступный трекер -- с растущей паузой. Трекеры опрашиваются одновременно, ответы обрабатываются по мере поступления
+ */
 class TorrentTracker {
 public:
-    TorrentTracker(const std::string& url);
+    /*
+     * Вызывается из фонового потока с пирами из ответа трекера, возвращает, сколько из них оказались новыми
+     */
+    using PeersCallback = std::function<size_t(const std::vector<Peer>& peers)>;
+    using StatsCallback = std::function<TransferStats()>;
+
+    TorrentTracker(const TorrentFile& tf, std::string peerId, int port);
+    ~TorrentTracker();
+
+    TorrentTracker(const TorrentTracker&) = delete;
+    TorrentTracker& operator=(const TorrentTracker&) = delete;
 
-    void UpdatePeers(const TorrentFile& tf, std::string peerId, int port);
-    const std::vector<Peer>& GetPeers() const;
+    /*
+     * Начать анонсы. Первый раунд считается запросом пиров, см. RequestPeers
+     */
+    void Start(StatsCallback getStats, PeersCallback onPeers);
+
+    /*
+     * Попросить пиров раньше срока: трекеры анонсируются, как только позволяет их min interval.
+     * Возвращает true, пока запрос выполняется или если он принес новых пиров, и false, если трекеры
+     * ответили и новых пиров нет. Можно вызывать из любого потока
+     */
+    bool RequestPeers();
+
+    /*
+     * Остановить анонсы и сообщить трекерам о выходе из раздачи
+     */
+    void Stop();
 
 private:
-    std::string url_;
-    std::vector<Peer> peers_;
+    using Clock = std::chrono::steady_clock;
+
+    struct Announce {
+        std::string url;
+        Clock::time_point nextAt;
+        Clock::time_point lastAt;  // последний успешный анонс
+        std::chrono::seconds minInterval{0};
+        size_t failures = 0;
+        bool started = false;  // трекер принял event=started
+        bool completed = false;
+        bool requested = false;  // ответа ждет RequestPeers
+        std::string trackerId;
+        std::string event;
+        std::optional<cpr::AsyncResponse> response;
+    };
+
+    const TorrentFile& tf_;
+    const std::string peerId_;
+    const int port_;
+    StatsCallback getStats_;
+    PeersCallback onPeers_;
+    bool downloading_;  // при старте не все скачано, поэтому по окончании отправляется event=completed
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::vector<Announce> announces_;
+    bool peersRequested_;
+    size_t newPeersSinceRequest_;
+    bool stopped_;
+    std::thread thread_;
+
+    void Run();
+
+    void Send(Announce& announce, const TransferStats& stats, std::string event, std::chrono::milliseconds timeout);
+
+    /*
+     * Разобрать ответ и запланировать следующий анонс, возвращает пиров из ответа
+     */
+    std::vector<Peer> HandleResponse(Announce& announce, Clock::time_point now);
 
     std::string urlEncode(const std::string& value);
     std::string InfoHashToHexString(const std::string& info_hash);
-};
\ No newline at end of file
+};